@@ -12,16 +12,57 @@
 #include <windows.h>
 #endif
 #include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
 #include "global.h"
 #include "Config.h"
+#include "Log.h"
+#include "TimeFormat.h"
 
 FILE       *Config::getLogfile()               { return logfile;             }
+const char *Config::getLogfileName()           { return logfileName;         }
+int         Config::getLogKeep()               { return logKeep;             }
+long long   Config::getLogRotateSize()         { return logRotateSize;       }
+int         Config::getLogRotateHours()        { return logRotateHours;      }
+int         Config::getLogCompress()           { return logCompress;         }
+const char *Config::getJournal()               { return journal;             }
 const char *Config::getMqttServer()            { return mqttServer;          }
 const char *Config::getMqttTopicBase()         { return mqttTopicBase;       }
 const char *Config::getFlicdServer()           { return flicdServer;         }
 int         Config::getFlicdPort()             { return flicdPort;           }
-const char *Config::getFlicName(int i)         { return flicName[i];         }
-const char *Config::getFlicMac(int i)          { return flicMac[i];          }
+int         Config::getFlicdPingInterval()     { return flicdPingInterval;   }
+int         Config::getFlicdPingMisses()       { return flicdPingMisses;     }
+int         Config::getBatteryHeartbeat()      { return batteryHeartbeat;    }
+const char *Config::getMetaCache()             { return metaCache;           }
+int         Config::getMetaRefresh()           { return metaRefresh;         }
+int         Config::getPresenceInterval()      { return presenceInterval;    }
+const PayloadTemplate *Config::getPayloadEvent() { return payloadEvent.empty() ? 0 : &payloadEvent; }
+int         Config::getTimeFormat()            { return timeFormat;          }
+const char *Config::getSeqFile()               { return seqFile;             }
+int         Config::getSeqCheckpoint()         { return seqCheckpoint;       }
+int         Config::getStatsInterval()         { return statsInterval;       }
+int         Config::getRateBurst()             { return rateBurst;           }
+int         Config::getRatePerMinute()         { return ratePerMinute;       }
+int         Config::getHoldTimeout()           { return holdTimeout;         }
+int         Config::getShutdownDrain()         { return shutdownDrain;       }
+int         Config::getWatchdog()              { return watchdog;            }
+const char *Config::getTraceFile()             { return traceFile;           }
+int         Config::getFlicCount()             { return (int)buttons.size(); }
+const char *Config::getFlicName(int i)         { return i>=0 && i<(int)buttons.size() && !buttons[i].name.empty() ? buttons[i].name.c_str() : 0;  }
+const char *Config::getFlicMac(int i)          { return i>=0 && i<(int)buttons.size() && !buttons[i].mac.empty()  ? buttons[i].mac.c_str()  : 0;  }
+const char *Config::getFlicTopic(int i)        { return i>=0 && i<(int)buttons.size() && !buttons[i].topic.empty() ? buttons[i].topic.c_str() : 0; }
+int         Config::getFlicLatency(int i)      { return i>=0 && i<(int)buttons.size() ? buttons[i].latency  : FLIC_LATENCY_NORMAL; }
+unsigned    Config::getFlicGestures(int i)     { return i>=0 && i<(int)buttons.size() ? buttons[i].gestures : 0; }
+
+//
+// Every top level KEY= we understand.  Anything else gets a warning.
+//
+static const char *CONFIG_KEYS[]={"LOGFILE", "LOG_KEEP", "LOG_ROTATE_SIZE", "LOG_ROTATE_HOURS", "LOG_COMPRESS", "JOURNAL",
+                                  "MQTT_SERVER", "MQTT_TOPIC_BASE", "FLICD_SERVER", "FLICD_PORT", "FLICD_PING_INTERVAL",
+                                  "FLICD_PING_MISSES", "BATTERY_HEARTBEAT", "META_CACHE", "META_REFRESH",
+                                  "PRESENCE_INTERVAL", "PAYLOAD_EVENT", "TIME_FORMAT", "SEQ_FILE",
+                                  "SEQ_CHECKPOINT", "STATS_INTERVAL", "RATE_BURST", "RATE_PER_MINUTE", "HOLD_TIMEOUT",
+                                  "SHUTDOWN_DRAIN", "WATCHDOG", "TRACE_FILE", 0};
 
 Config::Config() { 
   logfile=0;
@@ -30,17 +71,249 @@ Config::Config() {
   mqttServer=0;
   mqttTopicBase=0;
   flicdPort=0;
-  for(int i=0;i<8;i++) { flicName[i]=0; flicMac[i]=0; }
+  flicdPingInterval=0;
+  flicdPingMisses=0;
+  batteryHeartbeat=0;
+  metaCache=0;
+  metaRefresh=0;
+  presenceInterval=0;
+  timeFormat=TIME_FORMAT_ASCTIME;
+  seqFile=0;
+  seqCheckpoint=0;
+  statsInterval=0;
+  rateBurst=0;
+  ratePerMinute=0;
+  holdTimeout=0;
+  shutdownDrain=0;
+  watchdog=0;
+  traceFile=0;
+  logKeep=0;
+  logRotateSize=0;
+  logRotateHours=0;
+  logCompress=0;
+  journal=0;
+  parseName=0;
+  parseErrors=0;
+  parseSection=-1;
+  parseReload=false;
+}
+
+Config::~Config() {
+  //
+  // logfile belongs to the log writer once logInit has it, so it is left open
+  //
+  if(logfileName)      { free(logfileName);      }
+  if(mqttServer)       { free(mqttServer);       }
+  if(mqttTopicBase)    { free(mqttTopicBase);    }
+  if(flicdServer)      { free(flicdServer);      }
+  if(journal)          { free(journal);          }
+  if(metaCache)        { free(metaCache);        }
+  if(seqFile)          { free(seqFile);          }
+  if(traceFile)        { free(traceFile);        }
+}
+
+//
+// Report a problem with the config file.  line 0 is for things not tied to one line.  At
+// startup this goes to stderr; on a reload the log writer is running so it goes there.
+//
+void Config::parseReport(int lvl, int line, const char *fmt, va_list args) {
+  char msg[512];
+  vsnprintf(msg, sizeof(msg), fmt, args);
+  const char *what=lvl==LOG_ERROR ? "" : "warning: ";
+  if(parseReload) {
+    if(line) { LOG(LOG_CONFIG, lvl, "%s:%d: %s%s\n",parseName,line,what,msg); }
+    else     { LOG(LOG_CONFIG, lvl, "%s: %s%s\n",parseName,what,msg);         }
+  } else {
+    if(line) { fprintf(stderr,"%s:%d: %s%s\n",parseName,line,what,msg); }
+    else     { fprintf(stderr,"%s: %s%s\n",parseName,what,msg);         }
+  }
+}
+
+void Config::parseError(int line, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  parseReport(LOG_ERROR, line, fmt, args);
+  va_end(args);
+  parseErrors++;
+}
+
+void Config::parseWarn(int line, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  parseReport(LOG_WARN, line, fmt, args);
+  va_end(args);
+}
+
+static bool config_valid_mac(const char *s) {
+  for(int i=0;i<17;i++) {
+    if(i%3==2 ? s[i]!=':' : !isxdigit((unsigned char)s[i])) { return false; }
+  }
+  return !s[17];
+}
+
+//
+// Button names and topics end up in MQTT topics so no wildcards or whitespace
+//
+static bool config_valid_topic(const char *s) {
+  if(!*s) { return false; }
+  for(;*s;s++) {
+    if(*s=='+' || *s=='#' || isspace((unsigned char)*s)) { return false; }
+  }
+  return true;
+}
+
+//
+// FLIC_NAME_nn / FLIC_MAC_nn put a button at slot nn
+//
+FlicButton *Config::legacyButton(const char *digits, int line) {
+  char *end;
+  long slot=strtol(digits,&end,10);
+  if(!isdigit((unsigned char)*digits) || *end || slot>=FLIC_MAX_BUTTONS) {
+    parseError(line,"button number %s should be 0 to %d",digits,FLIC_MAX_BUTTONS-1);
+    return 0;
+  }
+  if((size_t)slot>=buttons.size()) { buttons.resize(slot+1); }
+  if(!buttons[slot].line) { buttons[slot].line=line; }
+  return &buttons[slot];
+}
+
+//
+// key=value inside a [button name] section
+//
+void Config::parseButtonKey(FlicButton *b, const char *key, const char *value, int line) {
+  int i;
+  if(!strcmp(key,"mac")) {
+    b->mac=value;
+  } else if(!strcmp(key,"latency")) {
+    for(i=0;i<3 && strcmp(value,FLIC_LATENCY_NAMES[i]);i++) {}
+    if(i==3) { parseError(line,"latency=%s should be normal, low or high",value); return; }
+    b->latency=i;
+  } else if(!strcmp(key,"gestures")) {
+    //
+    // comma or space separated gesture names, or all
+    //
+    b->gestures=0;
+    for(const char *p=value;*p;) {
+      size_t n=strcspn(p,", \t");
+      if(n==3 && !strncmp(p,"all",3)) {
+        b->gestures=FLIC_GESTURES_ALL;
+      } else if(n) {
+        for(i=0;i<FLIC_GESTURES && (strlen(FLIC_GESTURE_NAMES[i])!=n || strncmp(p,FLIC_GESTURE_NAMES[i],n));i++) {}
+        if(i==FLIC_GESTURES) {
+          parseError(line,"unknown gesture %.*s (want all, state, click, hold, holdup, clickclick, clickhold or clickholdup)",(int)n,p);
+        } else {
+          b->gestures|=1u<<i;
+        }
+      }
+      p+=n;
+      p+=strspn(p,", \t");
+    }
+  } else if(!strcmp(key,"topic")) {
+    if(!config_valid_topic(value)) { parseError(line,"topic=%s is not a valid MQTT topic",value); return; }
+    b->topic=value;
+  } else {
+    parseError(line,"unknown button setting %s (want mac, latency, gestures or topic)",key);
+  }
+}
+
+//
+// One line of the config file.  s is writable and null terminated without the newline.
+//
+void Config::parseLine(char *s, int line) {
+  char *e, *v;
+
+  if((e=strchr(s,'#'))) { *e=0; }              // comments run to end of line
+  while(*s==' ' || *s=='\t') { s++; }
+  for(e=s+strlen(s);e>s && (e[-1]==' ' || e[-1]=='\t' || e[-1]=='\r');) { *--e=0; }
+  if(!*s) { return; }
+
+  if(*s=='[') {
+    //
+    // [button name] starts a section, which lasts until the next one
+    //
+    parseSection=-1;
+    if(e[-1]!=']') { parseError(line,"section header needs a closing ]"); return; }
+    for(*--e=0;e>s+1 && (e[-1]==' ' || e[-1]=='\t');) { *--e=0; }
+    for(s++;*s==' ' || *s=='\t';) { s++; }
+    if(strncmp(s,"button",6) || (s[6]!=' ' && s[6]!='\t')) {
+      parseError(line,"unknown section [%s] (want [button name])",s);
+      return;
+    }
+    for(s+=6;*s==' ' || *s=='\t';) { s++; }
+    parseSections.push_back(FlicButton());
+    parseSection=(int)parseSections.size()-1;
+    parseSections[parseSection].name=s;
+    parseSections[parseSection].line=line;
+    return;
+  }
+
+  v=strchr(s,'=');
+  if(!v || v==s) { parseError(line,"expected KEY=value, not \"%s\"",s); return; }
+  for(e=v;e>s && (e[-1]==' ' || e[-1]=='\t');) { e--; }
+  *e=0;
+  for(v++;*v==' ' || *v=='\t';) { v++; }
+
+  if(parseSection>=0) {
+    parseButtonKey(&parseSections[parseSection],s,v,line);
+  } else if(!strncmp(s,"FLIC_NAME_",10)) {
+    FlicButton *b=legacyButton(&s[10],line);
+    if(b) { b->name=v; }
+  } else if(!strncmp(s,"FLIC_MAC_",9)) {
+    FlicButton *b=legacyButton(&s[9],line);
+    if(b) { b->mac=v; }
+  } else {
+    ConfigValue &cv=settings[s];
+    if(cv.line) { parseWarn(line,"%s was already set on line %d, using this one",s,cv.line); }
+    cv.value=v;
+    cv.line=line;
+  }
+}
+
+const ConfigValue *Config::setting(const char *key) {
+  std::unordered_map<std::string, ConfigValue>::iterator it=settings.find(key);
+  return it==settings.end() ? 0 : &it->second;
+}
+
+//
+// A copy of the value of key (caller frees), or 0 if it is not set
+//
+char *Config::settingStr(const char *key, bool required) {
+  const ConfigValue *cv=setting(key);
+  if(!cv || cv->value.empty()) {
+    if(required) { parseError(0,"%s= is required",key); }
+    return 0;
+  }
+  return strdup(cv->value.c_str());
 }
 
 //
-// Read Flic2MQTT.config and populate settings
+// Number valued key, at least lo.  suffix allows k/m/g multipliers.
 //
-void Config::readConfig(const char *fname) {
+long long Config::settingNum(const char *key, long long dflt, long long lo, bool suffix) {
+  const ConfigValue *cv=setting(key);
+  char *end;
+  if(!cv) { return dflt; }
+  long long n=strtoll(cv->value.c_str(),&end,10);
+  if(suffix && *end) {
+    if(*end=='k' || *end=='K') { n<<=10; end++; }
+    else if(*end=='m' || *end=='M') { n<<=20; end++; }
+    else if(*end=='g' || *end=='G') { n<<=30; end++; }
+  }
+  if(end==cv->value.c_str() || *end) {
+    parseError(cv->line,"%s=%s is not a number",key,cv->value.c_str());
+    return dflt;
+  }
+  return n<lo ? lo : n;
+}
+
+//
+// Read Flic2MQTT.config and populate settings.  Exits with line numbered messages if it is not usable,
+// or for a reload returns false and leaves the log alone.
+//
+bool Config::readConfig(const char *fname, bool reload) {
   FILE *f;
-  int i, ch;
-  char buf[4096];
-  char cc,*p,*q;
+  int i;
+  int levels[LOG_SUBSYSTEMS];
 
   if(logfile && logfile!=stderr && logfile!=stdout) { fclose(logfile); }
   logfile=0;
@@ -48,51 +321,169 @@ void Config::readConfig(const char *fname) {
   if(mqttServer)       { free(mqttServer);       mqttServer=0;       }
   if(mqttTopicBase)    { free(mqttTopicBase);    mqttTopicBase=0;    }
   if(flicdServer)      { free(flicdServer);      flicdServer=0;      }
-  flicdPort=5551;
-  for(i=0;i<8;i++) {
-    if(flicName[i]) { free(flicName[i]);  flicName[i]=0; }
-    if(flicMac[i])  { free(flicMac[i]);   flicMac[i]=0;  }
-  }
+  if(journal)          { free(journal);          journal=0;          }
+  buttons.clear();
+  settings.clear();
+  parseSections.clear();
+  parseName=fname;
+  parseErrors=0;
+  parseSection=-1;
+  parseReload=reload;
 
   f=fopen(fname,"r");
   if(!f) {
-    fprintf(stderr,"Could not open Flic2MQTT.config\n");
+    if(reload) {
+      LOG(LOG_CONFIG, LOG_ERROR, "Could not open %s\n",fname);
+      return false;
+    }
+    fprintf(stderr,"Could not open %s\n",fname);
     exit(1);
   }
 
-  for(i=0;i<4095;i++) {
-     ch=fgetc(f);
-     if(ch==EOF) {
-        buf[i]=0;
-        i=4095;
-     } else {
-        buf[i]=(char)ch;
-     }
+  //
+  // One pass over the file a chunk at a time.  Lines are handed to parseLine in place
+  // unless one straddles two chunks, then it is gathered in carry first.
+  //
+  static char chunk[65536];
+  std::string carry;
+  size_t n;
+  int lineNo=0;
+  while((n=fread(chunk,1,sizeof(chunk),f))>0) {
+    char *p=chunk, *end=chunk+n, *nl;
+    while((nl=(char*)memchr(p,'\n',end-p))) {
+      *nl=0;
+      lineNo++;
+      if(carry.empty()) {
+        parseLine(p,lineNo);
+      } else {
+        carry.append(p,nl-p);
+        parseLine(&carry[0],lineNo);
+        carry.clear();
+      }
+      p=nl+1;
+    }
+    carry.append(p,end-p);
   }
+  if(!carry.empty()) { parseLine(&carry[0],++lineNo); }
   fclose(f);
-  if(ch!=EOF) {
-    fprintf(stderr,"Excessively long Flic2MQTT.config\n");
-    exit(1);
+
+  //
+  // Pick up the top level settings
+  //
+  logfileName=settingStr("LOGFILE",false);
+  journal=settingStr("JOURNAL",false);
+  mqttServer=settingStr("MQTT_SERVER",true);
+  mqttTopicBase=settingStr("MQTT_TOPIC_BASE",true);
+  flicdServer=settingStr("FLICD_SERVER",true);
+  logKeep=(int)settingNum("LOG_KEEP",9,1,false);
+  logRotateSize=settingNum("LOG_ROTATE_SIZE",0,0,true);
+  logRotateHours=(int)settingNum("LOG_ROTATE_HOURS",0,0,false);
+  logCompress=(int)settingNum("LOG_COMPRESS",0,0,false);
+  flicdPort=(int)settingNum("FLICD_PORT",5551,1,false);
+  flicdPingInterval=(int)settingNum("FLICD_PING_INTERVAL",5,0,false);
+  flicdPingMisses=(int)settingNum("FLICD_PING_MISSES",3,1,false);
+  batteryHeartbeat=(int)settingNum("BATTERY_HEARTBEAT",24,0,false);
+  metaCache=settingStr("META_CACHE",false);
+  metaRefresh=(int)settingNum("META_REFRESH",24,1,false);
+  presenceInterval=(int)settingNum("PRESENCE_INTERVAL",0,0,false);
+  seqFile=settingStr("SEQ_FILE",false);
+  seqCheckpoint=(int)settingNum("SEQ_CHECKPOINT",100,1,false);
+  statsInterval=(int)settingNum("STATS_INTERVAL",0,0,false);
+  rateBurst=(int)settingNum("RATE_BURST",20,0,false);
+  ratePerMinute=(int)settingNum("RATE_PER_MINUTE",120,1,false);
+  holdTimeout=(int)settingNum("HOLD_TIMEOUT",300,0,false);
+  shutdownDrain=(int)settingNum("SHUTDOWN_DRAIN",10,0,false);
+  watchdog=(int)settingNum("WATCHDOG",60,0,false);
+  traceFile=settingStr("TRACE_FILE",false);
+  const ConfigValue *tmpl=setting("PAYLOAD_EVENT");
+  if(tmpl && !tmpl->value.empty()) {
+    std::string why;
+    if(!payloadEvent.compile(tmpl->value.c_str(),why)) { parseError(tmpl->line,"PAYLOAD_EVENT: %s",why.c_str()); }
+  }
+  const ConfigValue *tf=setting("TIME_FORMAT");
+  timeFormat=TIME_FORMAT_ASCTIME;
+  if(tf) {
+    timeFormat=timeFormatParse(tf->value.c_str());
+    if(timeFormat<0) { parseError(tf->line,"TIME_FORMAT=%s should be asctime, iso or epoch",tf->value.c_str()); }
   }
 
-  // hash out all line contents after a hashmark
-  for(i=0;buf[i];i++) {
-    if(buf[i]=='#') {
-      int j;
-      for(j=i+1;buf[j] && (buf[j]!='\r') && (buf[j]!='\n');j++) {
-        buf[j]='#';
+  char chartmp[24];
+  for(i=0;i<LOG_SUBSYSTEMS;i++) {
+    sprintf(chartmp,"LOG_LEVEL_%s",LOG_SUBSYSTEM_NAMES[i]);
+    const ConfigValue *cv=setting(chartmp);
+    levels[i]=LOG_OFF-1;
+    if(cv) {
+      levels[i]=logLevelParse(cv->value.c_str());
+      if(levels[i]<LOG_OFF) {
+        parseError(cv->line,"%s=%s should be ERROR, WARN, INFO, DEBUG or OFF",chartmp,cv->value.c_str());
       }
-      i=j-1;
     }
   }
 
-  p=strstr(buf,"LOGFILE=");
-  if(p) {
-    for(q=p;(*q) && (*q!='\r') && (*q!='\n');) { q=q+1; }  // find end of config parameter
-    cc=*q; 
-    *q=0;
-    logfileName=strdup(&p[8]);
-    *q=cc;
+  for(std::unordered_map<std::string, ConfigValue>::iterator it=settings.begin();it!=settings.end();++it) {
+    const char *key=it->first.c_str();
+    for(i=0;CONFIG_KEYS[i] && strcmp(key,CONFIG_KEYS[i]);i++) {}
+    if(!CONFIG_KEYS[i] && strncmp(key,"LOG_LEVEL_",10)) {
+      parseWarn(it->second.line,"unknown setting %s ignored",key);
+    }
+  }
+
+  //
+  // [button] sections go after the numbered buttons, in file order
+  //
+  for(i=0;i<(int)parseSections.size();i++) {
+    if(parseSections[i].mac.empty()) { parseError(parseSections[i].line,"[button %s] needs a mac=",parseSections[i].name.c_str()); }
+    if(buttons.size()>=FLIC_MAX_BUTTONS) { parseError(parseSections[i].line,"more than %d buttons",FLIC_MAX_BUTTONS); break; }
+    buttons.push_back(parseSections[i]);
+  }
+  parseSections.clear();
+
+  //
+  // Names and MACs must be unique and well formed
+  //
+  std::unordered_map<std::string, int> names, macs;
+  names.reserve(buttons.size());
+  macs.reserve(buttons.size());
+  for(i=0;i<(int)buttons.size();i++) {
+    FlicButton &b=buttons[i];
+    if(b.name.empty()) {
+      if(!b.mac.empty()) { parseError(b.line,"FLIC_MAC_%02d has no FLIC_NAME_%02d",i,i); }
+      continue;
+    }
+    if(!config_valid_topic(b.name.c_str()) || strchr(b.name.c_str(),'/')) {
+      parseError(b.line,"button name \"%s\" can not contain /, +, # or spaces",b.name.c_str());
+    }
+    std::pair<std::unordered_map<std::string, int>::iterator, bool> r=names.insert(std::make_pair(b.name,b.line));
+    if(!r.second) { parseError(b.line,"button %s was already defined on line %d",b.name.c_str(),r.first->second); }
+    if(!b.mac.empty()) {
+      for(size_t j=0;j<b.mac.size();j++) { b.mac[j]=(char)tolower((unsigned char)b.mac[j]); }
+      if(!config_valid_mac(b.mac.c_str())) {
+        parseError(b.line,"button %s mac %s should look like 00:11:22:aa:bb:cc",b.name.c_str(),b.mac.c_str());
+      }
+      r=macs.insert(std::make_pair(b.mac,b.line));
+      if(!r.second) { parseError(b.line,"button %s has the same mac as the one on line %d",b.name.c_str(),r.first->second); }
+    }
+    if(b.topic.empty() && mqttTopicBase) { b.topic=std::string(mqttTopicBase)+"/"+b.name; }
+  }
+
+  if(parseErrors) {
+    if(reload) {
+      LOG(LOG_CONFIG, LOG_ERROR, "%s: %d error%s, keeping the running config\n",fname,parseErrors,parseErrors==1 ? "" : "s");
+      return false;
+    }
+    fprintf(stderr,"%s: %d error%s, not starting\n",fname,parseErrors,parseErrors==1 ? "" : "s");
+    exit(1);
+  }
+
+  //
+  // Only now that the whole file is good do the levels change
+  //
+  for(i=0;i<LOG_SUBSYSTEMS;i++) {
+    if(levels[i]>=LOG_OFF) { logSetLevel(i,levels[i]); }
+  }
+  if(reload) { return true; }
+
+  if(logfileName) {
     if(!strcmp(logfileName,"stderr")) {
       logfile=stderr;
     } else if(!strcmp(logfileName,"stdout")) {
@@ -101,13 +492,7 @@ void Config::readConfig(const char *fname) {
       //
       //  Cycle the old log files
       //
-      char from[1024], to[1024];
-      for(i=8;i>=0;i--) {
-        if(i) { sprintf(from,"%s.%d",logfileName,i); } else { sprintf(from,"%s",logfileName); }
-        sprintf(to,"%s.%d",logfileName,i+1);
-        remove(to);
-        rename(from,to);
-      }
+      logShiftFiles(logfileName,logKeep);
       //
       // open the new log file
       //
@@ -115,70 +500,83 @@ void Config::readConfig(const char *fname) {
     }
   }
 
-  p=strstr(buf,"MQTT_SERVER=");
-  for(q=p;(*q) && (*q!='\r') && (*q!='\n');) { q=q+1; }  // find end of config parameter
-  cc=*q;
-  *q=0;
-  mqttServer=strdup(&p[12]);
-  *q=cc;
-
-  p=strstr(buf,"MQTT_TOPIC_BASE=");
-  for(q=p;(*q) && (*q!='\r') && (*q!='\n');) { q=q+1; }  // find end of config parameter
-  cc=*q;
-  *q=0;
-  mqttTopicBase=strdup(&p[16]);
-  *q=cc;
-
-  p=strstr(buf,"FLICD_SERVER=");
-  for(q=p;(*q) && (*q!='\r') && (*q!='\n');) { q=q+1; }  // find end of config parameter
-  cc=*q;
-  *q=0;
-  flicdServer=strdup(&p[13]);
-  *q=cc;
-
-  p=strstr(buf,"FLICD_PORT=");
-  if(p) {
-    for(q=p;(*q) && (*q!='\r') && (*q!='\n');) { q=q+1; }  // find end of config parameter
-    cc=*q;
-    *q=0;
-    flicdPort=atoi(&p[11]);
-    *q=cc;
-  }
-
-  char chartmp[24];
-  for(i=0;i<8;i++) {
-    sprintf(chartmp,"FLIC_NAME_%02d=",i);
-    p=strstr(buf,chartmp);
-    if(p) {
-      for(q=p;(*q) && (*q!='\r') && (*q!='\n');) { q=q+1; }  // find end of config parameter
-      cc=*q;
-      *q=0;
-      flicName[i]=strdup(&p[strlen(chartmp)]);
-      *q=cc;
-    }
-    sprintf(chartmp,"FLIC_MAC_%02d=",i);
-    p=strstr(buf,chartmp);
-    if(p) {
-      for(q=p;(*q) && (*q!='\r') && (*q!='\n');) { q=q+1; }  // find end of config parameter
-      cc=*q;
-      *q=0;
-      flicMac[i]=strdup(&p[strlen(chartmp)]);
-      *q=cc;
-    }
-  }
-
-#ifdef DEBUG_PRINT_CONFIG
-  if(logfile) { 
-    fprintf(logfile,"LOGFILE=%s\n",logfileName);
+  if(logfile && LOG_ENABLED(LOG_CONFIG, LOG_DEBUG)) {
+    //
+    // the log writer is not running yet so dump straight to the file
+    //
+    fprintf(logfile,"LOGFILE=%s\n",logfileName ? logfileName : "");
+    fprintf(logfile,"LOG_KEEP=%d\n",logKeep);
+    fprintf(logfile,"LOG_ROTATE_SIZE=%lld\n",logRotateSize);
+    fprintf(logfile,"LOG_ROTATE_HOURS=%d\n",logRotateHours);
+    fprintf(logfile,"LOG_COMPRESS=%d\n",logCompress);
+    fprintf(logfile,"JOURNAL=%s\n",journal ? journal : "");
     fprintf(logfile,"MQTT_SERVER=%s\n",mqttServer);
     fprintf(logfile,"MQTT_TOPIC_BASE=%s\n",mqttTopicBase);
     fprintf(logfile,"FLICD_SERVER=%s\n",flicdServer);
     fprintf(logfile,"FLICD_PORT=%d\n",flicdPort);
-    for(i=0;i<8;i++) {
-      fprintf(logfile,"FLIC_NAME_%02d=%s\n",i,flicName[i]);
-      fprintf(logfile,"FLIC_MAC_%02d=%s\n",i,flicMac[i]);
+    fprintf(logfile,"FLICD_PING_INTERVAL=%d\n",flicdPingInterval);
+    fprintf(logfile,"FLICD_PING_MISSES=%d\n",flicdPingMisses);
+    fprintf(logfile,"BATTERY_HEARTBEAT=%d\n",batteryHeartbeat);
+    fprintf(logfile,"META_CACHE=%s\n",metaCache ? metaCache : "");
+    fprintf(logfile,"META_REFRESH=%d\n",metaRefresh);
+    fprintf(logfile,"PRESENCE_INTERVAL=%d\n",presenceInterval);
+    const ConfigValue *tv=setting("PAYLOAD_EVENT");
+    fprintf(logfile,"PAYLOAD_EVENT=%s\n",tv ? tv->value.c_str() : "");
+    fprintf(logfile,"TIME_FORMAT=%s\n",TIME_FORMAT_NAMES[timeFormat]);
+    fprintf(logfile,"SEQ_FILE=%s\n",seqFile ? seqFile : "");
+    fprintf(logfile,"SEQ_CHECKPOINT=%d\n",seqCheckpoint);
+    fprintf(logfile,"STATS_INTERVAL=%d\n",statsInterval);
+    fprintf(logfile,"RATE_BURST=%d\n",rateBurst);
+    fprintf(logfile,"RATE_PER_MINUTE=%d\n",ratePerMinute);
+    fprintf(logfile,"HOLD_TIMEOUT=%d\n",holdTimeout);
+    fprintf(logfile,"SHUTDOWN_DRAIN=%d\n",shutdownDrain);
+    fprintf(logfile,"WATCHDOG=%d\n",watchdog);
+    fprintf(logfile,"TRACE_FILE=%s\n",traceFile ? traceFile : "");
+    for(i=0;i<LOG_SUBSYSTEMS;i++) {
+      fprintf(logfile,"LOG_LEVEL_%s=%s\n",LOG_SUBSYSTEM_NAMES[i],theLogLevel[i]<0 ? "OFF" : LOG_LEVEL_NAMES[theLogLevel[i]]);
+    }
+    for(i=0;i<(int)buttons.size();i++) {
+      FlicButton &b=buttons[i];
+      if(b.name.empty()) { continue; }
+      fprintf(logfile,"BUTTON(%d) %s mac=%s latency=%s gestures=0x%02x topic=%s\n",i,b.name.c_str(),b.mac.c_str(),FLIC_LATENCY_NAMES[b.latency],b.gestures,b.topic.c_str());
     }
   }
-#endif
+  return true;
 }
 
+//
+// After a reload, move buttons so each one that old also has (by name) keeps the slot, and
+// so its flicd channel, it had there.  New buttons take slots neither config uses, then go
+// on the end, so a slot never changes hands inside one reload.
+//
+void Config::keepSlots(Config *old) {
+  std::unordered_map<std::string, int> oldSlot;
+  std::vector<FlicButton> placed(old->buttons.size());
+  std::vector<FlicButton*> fresh;
+  int i, spare=0;
+
+  oldSlot.reserve(old->buttons.size());
+  for(i=0;i<(int)old->buttons.size();i++) {
+    if(!old->buttons[i].name.empty()) { oldSlot[old->buttons[i].name]=i; }
+  }
+  for(i=0;i<(int)buttons.size();i++) {
+    if(buttons[i].name.empty()) { continue; }
+    std::unordered_map<std::string, int>::iterator it=oldSlot.find(buttons[i].name);
+    if(it!=oldSlot.end()) {
+      placed[it->second]=buttons[i];
+    } else {
+      fresh.push_back(&buttons[i]);
+    }
+  }
+  for(i=0;i<(int)fresh.size();i++) {
+    while(spare<(int)placed.size() && (!placed[spare].name.empty() || !old->buttons[spare].name.empty())) { spare++; }
+    if(spare<(int)placed.size()) {
+      placed[spare]=*fresh[i];
+    } else if(placed.size()<FLIC_MAX_BUTTONS) {
+      placed.push_back(*fresh[i]);
+    } else {
+      LOG(LOG_CONFIG, LOG_ERROR, "No slot left for button %s\n",fresh[i]->name.c_str());
+    }
+  }
+  buttons.swap(placed);
+}
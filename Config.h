@@ -8,28 +8,144 @@
 #ifndef _CONFIGH
 #define _CONFIGH
 
+#include <stdarg.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "Payload.h"
+
+//
+// A button's slot is its index in the button list and doubles as its flicd conn_id.
+// Slot 65535 is FLIC_BUTTON_ALL on the pipe.
+//
+#define FLIC_MAX_BUTTONS   65535
+
+//
+// latency= in a [button] section, same values as flicd's LatencyMode
+//
+#define FLIC_LATENCY_NORMAL 0
+#define FLIC_LATENCY_LOW    1
+#define FLIC_LATENCY_HIGH   2
+
+static const char *FLIC_LATENCY_NAMES[]={"normal", "low", "high"};
+
+//
+// gestures= in a [button] section.  Indexed by BUTT_xxx (see PahoWrapper.h), also the topic suffixes.
+//
+#define FLIC_GESTURES      7
+#define FLIC_GESTURES_ALL  ((1u<<FLIC_GESTURES)-1)
+
+static const char *FLIC_GESTURE_NAMES[]={"state", "click", "hold", "holdup", "clickclick", "clickhold", "clickholdup"};
+
+struct FlicButton {
+  std::string name;             // empty for an unused legacy slot
+  std::string mac;
+  std::string topic;            // topic prefix, {MQTT_TOPIC_BASE}/{name} unless topic= is given
+  int latency;                  // FLIC_LATENCY_xxx
+  unsigned int gestures;        // bit per BUTT_xxx that gets published
+  int line;                     // where it was defined
+
+  FlicButton() : latency(FLIC_LATENCY_NORMAL), gestures(FLIC_GESTURES_ALL), line(0) {}
+};
+
+//
+// KEY=value setting and the line it came from
+//
+struct ConfigValue {
+  std::string value;
+  int line;
+};
+
 class Config {
 
 private:
   FILE *logfile;
   char *logfileName;
+  int   logKeep;
+  long long logRotateSize;
+  int   logRotateHours;
+  int   logCompress;
+  char *journal;
   char *mqttServer;
   char *mqttTopicBase;
   char *flicdServer;
   int   flicdPort;
-  char *flicName[8];
-  char *flicMac[8];
-  
+  int   flicdPingInterval;
+  int   flicdPingMisses;
+  int   batteryHeartbeat;       // hours between unchanged battery publishes, 0 = only on change
+  char *metaCache;              // button metadata cache file, 0 = memory only
+  int   metaRefresh;            // hours before cached button metadata is asked for again
+  int   presenceInterval;       // seconds between presence snapshots, 0 = no scanning
+  PayloadTemplate payloadEvent; // PAYLOAD_EVENT=, empty for the classic timestamp
+  int   timeFormat;             // TIME_FORMAT_xxx for gesture timestamps
+  char *seqFile;                // sequence counter file, 0 = memory only
+  int   seqCheckpoint;          // events between syncs of seqFile
+  int   statsInterval;          // seconds between {topic}/stats, 0 = none
+  int   rateBurst;              // events a button may publish at once, 0 = no limit
+  int   ratePerMinute;          // and the rate they come back at
+  int   holdTimeout;            // seconds before a hold is ended for it, 0 = never
+  int   shutdownDrain;          // seconds a stop waits for in flight messages
+  int   watchdog;               // seconds without progress before a stage is reported stalled, 0 = off
+  char *traceFile;              // chrome trace json written on SIGQUIT, 0 = no tracing
+  std::vector<FlicButton> buttons;
+  std::unordered_map<std::string, ConfigValue> settings;
+
+  // parse state
+  const char *parseName;
+  int parseErrors;
+  int parseSection;             // index into parseSections of the [button] being filled, -1 at top level
+  bool parseReload;             // report to the log rather than stderr
+  std::vector<FlicButton> parseSections;
+
+  void parseReport(int lvl, int line, const char *fmt, va_list args);
+  void parseError(int line, const char *fmt, ...);
+  void parseWarn(int line, const char *fmt, ...);
+  void parseLine(char *s, int line);
+  void parseButtonKey(FlicButton *b, const char *key, const char *value, int line);
+  FlicButton *legacyButton(const char *digits, int line);
+  const ConfigValue *setting(const char *key);
+  char *settingStr(const char *key, bool required);
+  long long settingNum(const char *key, long long dflt, long long lo, bool suffix);
+
 public:
   Config();
-  void readConfig(const char *fname);
+  ~Config();
+  bool readConfig(const char *fname, bool reload=false);
+  void keepSlots(Config *old);
   FILE *getLogfile();
+  const char *getLogfileName();
+  int getLogKeep();
+  long long getLogRotateSize();
+  int getLogRotateHours();
+  int getLogCompress();
+  const char *getJournal();
   const char *getMqttServer();
   const char *getMqttTopicBase();
   const char *getFlicdServer();
   int getFlicdPort();
+  int getFlicdPingInterval();
+  int getFlicdPingMisses();
+  int getBatteryHeartbeat();
+  const char *getMetaCache();
+  int getMetaRefresh();
+  int getPresenceInterval();
+  const PayloadTemplate *getPayloadEvent();
+  int getTimeFormat();
+  const char *getSeqFile();
+  int getSeqCheckpoint();
+  int getStatsInterval();
+  int getRateBurst();
+  int getRatePerMinute();
+  int getHoldTimeout();
+  int getShutdownDrain();
+  int getWatchdog();
+  const char *getTraceFile();
+  int getFlicCount();
   const char *getFlicName(int i);
   const char *getFlicMac(int i);
+  const char *getFlicTopic(int i);
+  int getFlicLatency(int i);
+  unsigned int getFlicGestures(int i);
 };
 
 #endif
@@ -12,14 +12,19 @@
 #include <cstdlib>
 #include <cstring>
 #include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/inotify.h>
 #define LONG long
 #define DWORD unsigned long
 #define _read read
+#define _write write
 
 static unsigned long GetTickCount() {
   struct timespec ts;
   clock_gettime(CLOCK_MONOTONIC,&ts);
-  return ts.tv_sec+(ts.tv_nsec/1000);
+  return ts.tv_sec*1000+(ts.tv_nsec/1000000);
 }
 
 #else
@@ -31,11 +36,23 @@ static unsigned long GetTickCount() {
 #include <fcntl.h>
 #include <time.h>
 #include <stdio.h>
+#include <errno.h>
 #include "global.h"
 #include "Config.h"
 #include "PahoWrapper.h"
 #include "flicd_client.h"
-#include <assert.h>
+#include "Metrics.h"
+#include "Log.h"
+#include "Journal.h"
+#include "MetaCache.h"
+#include "Presence.h"
+#include "TimeFormat.h"
+#include "Sequence.h"
+#include "Stats.h"
+#include "Watchdog.h"
+#include "Resource.h"
+#include "Trace.h"
+#include <vector>
 
 Config *myConfig=new Config();
 PahoWrapper *myPaho=0;
@@ -44,19 +61,26 @@ int thePipeR=0,thePipeW=0;
 DWORD firstTick;         //  When did we start?
 DWORD epochTick;         //  When did this epoch start?
 DWORD availabilityTick;  //  When should we refresh availablity on MQTT server?
+DWORD rttTick;           //  When did we last publish the flicd rtt summary?
+DWORD pahoRetryTick;     //  When did we last try to reconnect to the broker?
+DWORD statsPubTick;      //  When did we last publish usage stats? (0 not yet)
 FILE *logfile;
 int epochNum=0;
 int packetCount;
 int packetCountEpoch;
+ResourceSample resPrev;  //  process resource use at the last sample
+DWORD resTick;           //  and when it was taken
+int resPackets;          //  packetCount then
 
 extern int flicd_client_main(int argc, char *argv[]);
 extern int flicd_client_init(const char *server, int port);
-extern int flicd_client_handle_line(int sockfd, const char *incmd);
+extern int flicd_client_handle_line(const char *incmd);
 
 void Usage() {
   fprintf(stderr,"flic2MQTT                               # this message\n");
   fprintf(stderr,"flic2MQTT -interact host [port]         # run a flic simpleclient to host[port]\n");
   fprintf(stderr,"flic2MQTT -mqtt                         # run in mqtt mode with settings from Flic2MQTT.config\n");
+  fprintf(stderr,"flic2MQTT -journal file [filters]       # list journaled events (-journal alone for filters)\n");
 }
 
 #ifndef __LINUX__
@@ -76,110 +100,752 @@ static void winsock_cleanup() {
 }
 #endif
 
-void timeFill(char *buf) {
-  time_t clock;
-  time(&clock);
-  sprintf(buf,"%.24s", asctime(localtime(&clock)));
+//
+// The timestamp sent with gestures, in the configured TIME_FORMAT.  Returns the time used
+// so ${ms} in a payload template matches it.
+//
+static TimeFormatter theTimeFormat;
+
+uint64_t timeFill(char *buf) {
+  uint64_t ms=timeNowMs();
+  theTimeFormat.render(buf, TIME_MAX, ms);
+  return ms;
+}
+
+//
+// flicd reader thread tells us a connection channel came up (or failed)
+//
+static void connectDone(void *context, int result, const void *evt, int evtLen, unsigned long latencyMs) {
+  LOG(LOG_MAIN, LOG_INFO, "main<-flicd: channel %d result=%d after %lums\n",(int)(size_t)context,result,latencyMs);
+}
+
+//
+// Per button radio link counters, kept by the main thread from the connection events and
+// published hourly to {topic}/link so buttons at the edge of radio range stand out.
+//
+struct ButtonLink {
+  DWORD readySince;                 // tick the channel became Ready, 0 while it is not
+  unsigned long readyMs;            // time Ready this epoch, closed intervals only
+  unsigned int disconnects;         // dropped from Ready this epoch
+  unsigned int disconnectsTotal;
+};
+static std::vector<ButtonLink> theButtonLinks;
+
+//
+// A button's channel became Ready (ready) or stopped being Ready.  dropped says the radio link
+// went, as opposed to flicd or us removing the channel.
+//
+static void linkUpdate(int bno, bool ready, bool dropped) {
+  if(bno>=(int)theButtonLinks.size()) { theButtonLinks.resize(bno+1); }
+  ButtonLink &l=theButtonLinks[bno];
+  DWORD tick=GetTickCount();
+  if(ready) {
+    if(!l.readySince) { l.readySince=tick|1; }
+    return;
+  }
+  if(l.readySince) {
+    l.readyMs+=tick-l.readySince;
+    l.readySince=0;
+    if(dropped) {
+      l.disconnects++;
+      l.disconnectsTotal++;
+      metricAdd(METRIC_BUTTON_DISCONNECTS, 1);
+    }
+  }
+}
+
+static void linkPublish(DWORD epochMs) {
+  char msg[128];
+  DWORD tick=GetTickCount();
+  for(int i=0;i<(int)theButtonLinks.size();i++) {
+    ButtonLink &l=theButtonLinks[i];
+    if(!myConfig->getFlicName(i)) { continue; }
+    unsigned long ms=l.readyMs;
+    if(l.readySince) {
+      ms+=tick-l.readySince;
+      l.readySince=tick|1;
+    }
+    double pct=epochMs ? 100.0*ms/epochMs : 0;
+    snprintf(msg,sizeof(msg),"{\"disconnects\":%u,\"disconnects_total\":%u,\"connected_pct\":%.1f}",l.disconnects,l.disconnectsTotal,pct>100 ? 100.0 : pct);
+    myPaho->writeButton(i, "link", msg);
+    l.readyMs=0;
+    l.disconnects=0;
+  }
+}
+
+//
+// Last battery report per button, from the flicd battery listener registered alongside each
+// channel.  {topic}/battery is published when the percentage changes or, for buttons that
+// just sit there, every BATTERY_HEARTBEAT hours.
+//
+#define BATTERY_LOW 15
+
+struct ButtonBattery {
+  int percent;                      // -1 until flicd has heard from the button
+  long long timestamp;              // when flicd got the reading, seconds since the epoch
+  DWORD publishedTick;
+
+  ButtonBattery() : percent(-1), timestamp(0), publishedTick(0) {}
+};
+static std::vector<ButtonBattery> theButtonBatteries;
+
+static void batteryUpdate(int bno, const char *msg) {
+  int percent=-1;
+  long long timestamp=0;
+  if(!myConfig->getFlicName(bno) || sscanf(msg,"%d %lld",&percent,&timestamp)<1 || percent<0) { return; }
+  if(bno>=(int)theButtonBatteries.size()) { theButtonBatteries.resize(bno+1); }
+  ButtonBattery &b=theButtonBatteries[bno];
+  b.timestamp=timestamp;
+  if(percent==b.percent) { return; }
+  if(percent<=BATTERY_LOW && (b.percent<0 || b.percent>BATTERY_LOW)) {
+    LOG(LOG_MAIN, LOG_WARN, "button %s battery is down to %d%%\n",myConfig->getFlicName(bno),percent);
+  } else {
+    LOG(LOG_MAIN, LOG_DEBUG, "button %s battery %d%% as of %lld\n",myConfig->getFlicName(bno),percent,timestamp);
+  }
+  b.percent=percent;
+  b.publishedTick=GetTickCount();
+  myPaho->writeBattery(bno, percent);
+}
+
+//
+// Called once an epoch (hourly), so the heartbeat is good to the hour
+//
+static void batteryHeartbeat() {
+  DWORD due=(DWORD)myConfig->getBatteryHeartbeat()*3600000;
+  DWORD tick=GetTickCount();
+  if(!due) { return; }
+  for(int i=0;i<(int)theButtonBatteries.size();i++) {
+    ButtonBattery &b=theButtonBatteries[i];
+    if(b.percent<0 || tick-b.publishedTick+60000<due) { continue; }
+    b.publishedTick=tick;
+    myPaho->writeBattery(i, b.percent, true);
+  }
+}
+
+//
+// Button metadata.  Published from the MetaCache at startup without waiting on flicd, then
+// refreshed in the background META_BATCH getButtonInfo requests at a time: the next batch
+// goes out once every answer (or timeout) for the last one is back.
+//
+#define META_BATCH 32
+
+static int theMetaPending;          // getButtonInfo requests in flight
+static int theMetaNext;             // slot the refresh has got to
+
+static void metaPublish(int bno) {
+  const char *mac=myConfig->getFlicMac(bno);
+  MetaRecord m;
+  char json[256];
+  if(!mac || !metaGet(metaKey(mac),&m)) { return; }
+  if(m.known) {
+    char uuid[33];
+    for(int i=0;i<16;i++) { sprintf(uuid+i*2,"%02x",m.uuid[i]); }
+    snprintf(json,sizeof(json),"{\"mac\":\"%s\",\"verified\":%s,\"uuid\":\"%s\",\"color\":\"%s\",\"serial\":\"%s\",\"flic_version\":%d,\"firmware\":%u}",
+             mac,m.verified ? "true" : "false",uuid,m.color,m.serial,m.flicVersion,m.firmware);
+  } else {
+    snprintf(json,sizeof(json),"{\"mac\":\"%s\",\"verified\":%s}",mac,m.verified ? "true" : "false");
+  }
+  myPaho->writeMeta(bno, json);
+}
+
+//
+// flicd reader thread: a getButtonInfo finished.  The answer is already in the MetaCache.
+//
+static void metaDone(void *context, int result, const void *evt, int evtLen, unsigned long latencyMs) {
+  flicd_client_pipe_send(FLIC_META, result, (unsigned int)(size_t)context, "");
+}
+
+//
+// paho thread: the broker connection is up.  The main thread sends the cached state.
+//
+static void pahoConnected() {
+  flicd_client_pipe_send(FLIC_MQTT, FLIC_STATUS_UP, FLIC_BUTTON_ALL, "");
+}
+
+static void metaRefresh() {
+  if(theMetaPending) { return; }
+  uint64_t stale=(uint64_t)time(0)*1000-(uint64_t)myConfig->getMetaRefresh()*3600000;
+  int count=myConfig->getFlicCount();
+  FlicdBatch batch;
+  for(;theMetaNext<count && batch.count()<META_BATCH;theMetaNext++) {
+    const char *mac=myConfig->getFlicMac(theMetaNext);
+    MetaRecord m;
+    if(!mac || (metaGet(metaKey(mac),&m) && m.refreshedMs>stale)) { continue; }
+    batch.getButtonInfo(mac, metaDone, (void*)(size_t)theMetaNext, 10000);
+  }
+  theMetaPending=batch.count();
+  if(theMetaPending) {
+    int status=batch.flush();
+    LOG(LOG_MAIN, LOG_DEBUG, "main->flicd: %d getButtonInfo : status=%d\n",theMetaPending,status);
+  }
+}
+
+static bool differs(const char *a, const char *b) {
+  if(!a || !b) { return a!=b; }
+  return strcmp(a,b)!=0;
+}
+
+//
+// Flic2MQTT.config changed.  Parse it into a new Config and, if it is good, switch to it touching
+// only the buttons that changed: their flicd channels are dropped/created in one batch and their
+// topics rebuilt.  Every other channel stays up so its events keep flowing.  Slots whose button
+// went away or moved to a different MAC are added to reset so the looper forgets their hold state.
+//
+static void reloadConfig(std::vector<int> &reset) {
+  Config *next=new Config();
+  if(!next->readConfig("Flic2MQTT.config", true)) {
+    delete next;
+    return;
+  }
+  next->keepSlots(myConfig);
+
+  FlicdBatch batch;
+  int added=0, removed=0, remapped=0, retuned=0, retopiced=0;
+  int count=next->getFlicCount()>myConfig->getFlicCount() ? next->getFlicCount() : myConfig->getFlicCount();
+  for(int i=0;i<count;i++) {
+    const char *oname=myConfig->getFlicName(i), *nname=next->getFlicName(i);
+    const char *omac=myConfig->getFlicMac(i),   *nmac=next->getFlicMac(i);
+    if(differs(oname,nname) || differs(omac,nmac)) {
+      //
+      // New, gone, or a new MAC for the same name
+      //
+      if(omac) {
+        batch.disconnect(i);
+        batch.removeBatteryStatusListener(i);
+      }
+      if(nmac) {
+        batch.connect(nmac, i, next->getFlicLatency(i), 0x1ff, connectDone, (void*)(size_t)i);
+        batch.createBatteryStatusListener(nmac, i);
+      }
+      if(!oname)       { added++;    }
+      else if(!nname)  { removed++;  }
+      else             { remapped++; }
+      reset.push_back(i);
+    } else if(nmac && myConfig->getFlicLatency(i)!=next->getFlicLatency(i)) {
+      batch.changeModeParameters(i, next->getFlicLatency(i), 0x1ff);
+      retuned++;
+    }
+    if(differs(oname,nname) || differs(myConfig->getFlicTopic(i),next->getFlicTopic(i)) || myConfig->getFlicGestures(i)!=next->getFlicGestures(i)) {
+      myPaho->setButton(i, nname, next->getFlicTopic(i), next->getFlicGestures(i));
+      if(nname) { retopiced++; }
+    }
+  }
+  if(!myConfig->getPresenceInterval()!=!next->getPresenceInterval()) {
+    if(next->getPresenceInterval()) { batch.createScanner(PRESENCE_SCAN_ID); }
+    else                            { batch.removeScanner(PRESENCE_SCAN_ID); }
+  }
+  presenceSetInterval(next->getPresenceInterval());
+  myPaho->setPayload(next->getPayloadEvent());
+  theTimeFormat.setFormat(next->getTimeFormat());
+  seqSetCheckpoint(next->getSeqCheckpoint());
+  if(!next->getStatsInterval()) { statsPubTick=0; }
+  statsSetInterval(next->getStatsInterval());
+  watchdogSetThreshold(next->getWatchdog());
+  traceSetFile(next->getTraceFile());
+  int status=batch.count() ? batch.flush() : 0;
+
+  flicd_client_set_ping(next->getFlicdPingInterval(), next->getFlicdPingMisses());
+  if(differs(myConfig->getMqttServer(),next->getMqttServer()) || differs(myConfig->getMqttTopicBase(),next->getMqttTopicBase()) ||
+     differs(myConfig->getFlicdServer(),next->getFlicdServer()) || myConfig->getFlicdPort()!=next->getFlicdPort() ||
+     differs(myConfig->getLogfileName(),next->getLogfileName()) || differs(myConfig->getJournal(),next->getJournal()) ||
+     differs(myConfig->getMetaCache(),next->getMetaCache()) || differs(myConfig->getSeqFile(),next->getSeqFile())) {
+    LOG(LOG_CONFIG, LOG_WARN, "MQTT_SERVER, MQTT_TOPIC_BASE, FLICD_SERVER/PORT, LOGFILE, JOURNAL, META_CACHE and SEQ_FILE changes need a restart\n");
+  }
+  LOG(LOG_CONFIG, LOG_INFO, "Reloaded config: %d added, %d removed, %d new MAC, %d new latency, %d new topics : status=%d\n",added,removed,remapped,retuned,retopiced,status);
+
+  Config *old=myConfig;
+  myConfig=next;
+  delete old;
+}
+
+#ifdef __LINUX__
+//
+// Watch the directory holding the config (editors often write a new file and rename it over
+// the old one) and tell the main thread once changes to it have been quiet for 250ms.
+//
+static void *configWatcher(void *param) {
+  const char *fname=(const char*)param;
+  const char *base=strrchr(fname,'/');
+  char dir[1024];
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool pending=false;
+
+  if(base) { snprintf(dir,sizeof(dir),"%.*s",(int)(base-fname),fname); base++; }
+  else     { strcpy(dir,"."); base=fname; }
+  int fd=inotify_init1(IN_CLOEXEC);
+  if(fd<0 || inotify_add_watch(fd,dir,IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE)<0) {
+    LOG(LOG_CONFIG, LOG_ERROR, "Can not watch %s for changes: %s\n",fname,strerror(errno));
+    if(fd>=0) { close(fd); }
+    return 0;
+  }
+  for(;;) {
+    struct pollfd pfd={fd,POLLIN,0};
+    int n=poll(&pfd,1,pending ? 250 : -1);
+    if(n<0 && errno==EINTR) { continue; }
+    if(n<0) { break; }
+    if(n==0) {
+      char piper[FLIC_BUFSIZE];
+      memset(piper,0,sizeof(piper));
+      piper[0]=FLIC_RELOAD;
+      piper[2]=piper[3]=(char)0xff;          // FLIC_BUTTON_ALL
+      watchdogIn(WD_DISPATCH);
+      if(_write(thePipeW,piper,FLIC_BUFSIZE)!=FLIC_BUFSIZE) { break; }
+      pending=false;
+      continue;
+    }
+    ssize_t len=read(fd,buf,sizeof(buf));
+    for(char *p=buf;len>0 && p<buf+len;) {
+      struct inotify_event *ev=(struct inotify_event*)p;
+      if(ev->len && !strcmp(ev->name,base)) { pending=true; }
+      p+=sizeof(struct inotify_event)+ev->len;
+    }
+  }
+  close(fd);
+  return 0;
+}
+#endif
+
+//
+// Reload the config whenever it changes.  Linux only; on Windows config changes need a restart.
+//
+static void configWatch(const char *fname) {
+#ifdef __LINUX__
+  pthread_t tid;
+  if(!pthread_create(&tid, NULL, configWatcher, (void*)fname)) { pthread_detach(tid); }
+#endif
+}
+
+//
+// Stop cleanly on SIGINT/SIGTERM (Ctrl-C or console close on Windows): the main thread is
+// told through the pipe like any other event, so it finishes what it is doing first.  A
+// second signal while it drains means stop now.  SIGQUIT (Ctrl-Break on Windows) writes
+// the trace instead, straight from here so it works even when the main thread is stuck.
+//
+static void shutdownRequest() {
+  static LONG volatile requested=0;
+  char piper[FLIC_BUFSIZE];
+#ifdef __LINUX__
+  if(__sync_fetch_and_add(&requested,1)) {
+#else
+  if(InterlockedIncrement(&requested)>1) {
+#endif
+    fprintf(stderr,"Second stop request, not waiting for the drain\n");
+    _exit(1);
+  }
+  memset(piper,0,sizeof(piper));
+  piper[0]=FLIC_SHUTDOWN;
+  piper[2]=piper[3]=(char)0xff;          // FLIC_BUTTON_ALL
+  watchdogIn(WD_DISPATCH);
+  if(_write(thePipeW,piper,FLIC_BUFSIZE)!=FLIC_BUFSIZE) { _exit(1); }
+}
+
+#ifdef __LINUX__
+static void *shutdownWatcher(void *param) {
+  sigset_t *sigs=(sigset_t*)param;
+  for(;;) {
+    int sig=0;
+    if(sigwait(sigs,&sig)) { continue; }
+    if(sig==SIGQUIT) {
+      if(traceDump()<0) { LOG(LOG_MAIN, LOG_WARN, "Got SIGQUIT, but TRACE_FILE is not set\n"); }
+      continue;
+    }
+    LOG(LOG_MAIN, LOG_INFO, "Got %s, stopping\n",sig==SIGINT ? "SIGINT" : "SIGTERM");
+    shutdownRequest();
+  }
+  return 0;
+}
+#else
+static BOOL WINAPI shutdownHandler(DWORD type) {
+  if(type==CTRL_BREAK_EVENT) {
+    if(traceDump()<0) { LOG(LOG_MAIN, LOG_WARN, "Got Ctrl-Break, but TRACE_FILE is not set\n"); }
+    return TRUE;
+  }
+  shutdownRequest();
+  if(type==CTRL_CLOSE_EVENT || type==CTRL_LOGOFF_EVENT || type==CTRL_SHUTDOWN_EVENT) {
+    //
+    // Windows ends the process when this returns; main's return will do it instead
+    //
+    Sleep(INFINITE);
+  }
+  return TRUE;
+}
+#endif
+
+//
+// Call before any other thread is started: they inherit SIGINT/SIGTERM/SIGQUIT blocked, so only
+// the watcher ever takes them.  The watcher is the first thread, started before logInit(), so
+// SIGUSR1/SIGUSR2 are blocked here too; the log writer takes those.
+//
+static void shutdownWatch() {
+#ifdef __LINUX__
+  static sigset_t sigs;
+  sigset_t mask;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGQUIT);
+  mask=sigs;
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  pthread_t tid;
+  if(!pthread_create(&tid, NULL, shutdownWatcher, (void*)&sigs)) { pthread_detach(tid); }
+#else
+  SetConsoleCtrlHandler(shutdownHandler, TRUE);
+#endif
+}
+
+//
+// Per button token bucket on published events, so one faulty button (or a confused flicd)
+// can not flood the broker.  Tokens are counted in 1/60000ths of an event, which lets a
+// per minute rate refill in whole units every ms.
+//
+#define RATE_UNIT 60000
+
+struct ButtonRate {
+  long long tokens;                 // -1 until the button's first event (starts full)
+  DWORD tick;                       // last refill
+  unsigned int dropped;             // since throttling began, 0 while not throttled
+
+  ButtonRate() : tokens(-1), tick(0), dropped(0) {}
+};
+static std::vector<ButtonRate> theButtonRates;
+
+static bool rateAllow(int bno) {
+  int burst=myConfig->getRateBurst();
+  if(!burst) { return true; }
+  if(bno>=(int)theButtonRates.size()) { theButtonRates.resize(bno+1); }
+  ButtonRate &r=theButtonRates[bno];
+  DWORD tick=GetTickCount();
+  long long full=(long long)burst*RATE_UNIT;
+  if(r.tokens<0) {
+    r.tokens=full;
+  } else {
+    r.tokens+=(long long)(tick-r.tick)*myConfig->getRatePerMinute();
+    if(r.tokens>full) { r.tokens=full; }
+  }
+  r.tick=tick;
+  if(r.tokens>=RATE_UNIT) {
+    r.tokens-=RATE_UNIT;
+    if(r.dropped) {
+      LOG(LOG_MAIN, LOG_INFO, "button %s is no longer throttled, %u events were dropped\n",myConfig->getFlicName(bno),r.dropped);
+      r.dropped=0;
+    }
+    return true;
+  }
+  if(!r.dropped++) {
+    LOG(LOG_MAIN, LOG_WARN, "button %s is sending more than %d events a minute, dropping them until it calms down\n",myConfig->getFlicName(bno),myConfig->getRatePerMinute());
+  }
+  metricAdd(METRIC_BUTTON_THROTTLED, 1);
+  return false;
+}
+
+//
+// A gesture was recognised: count it and publish it.  The end of a hold is never throttled
+// so nothing is left looking held.
+//
+static void gesture(int bno, int mode, const char *timeStr, bool queued, uint64_t ms) {
+  uint64_t t0=TRACE_ON() ? traceNow() : 0;
+  statsGesture(bno, mode, queued);
+  if(mode==BUTT_HOLD_UP || mode==BUTT_CLICKHOLD_UP || rateAllow(bno)) {
+    myPaho->writeState(bno, mode, timeStr, queued, ms);
+  }
+  if(t0) { traceSpan(TRACE_GESTURE, t0, mode); }
+}
+
+//
+// End a hold we will not see the end of: flicd lost the up event, or the button is stuck.
+// held is the BUTT_xxx that started it.  Subscribers get the Off and the hold up they
+// would otherwise wait for forever.
+//
+static void holdEnd(int bno, int held, const char *why) {
+  char timeStr[TIME_MAX];
+  LOG(LOG_MAIN, LOG_WARN, "button %s: %s, ending its hold\n",myConfig->getFlicName(bno),why);
+  metricAdd(METRIC_BUTTON_REPAIRS, 1);
+  myPaho->writeState(bno, BUTT_STATE, "Off");
+  uint64_t ms=timeFill(timeStr);
+  gesture(bno, held==BUTT_CLICKHOLD ? BUTT_CLICKHOLD_UP : BUTT_HOLD_UP, timeStr, false, ms);
+}
+
+//
+// {base}/resources: what the process used since the last sample, per event handled too
+//
+static void resourcePublish() {
+  char msg[512];
+  ResourceSample cur;
+  DWORD tick=GetTickCount();
+  resourceSample(&cur);
+  resourceFormat(msg, sizeof(msg), &resPrev, &cur, tick-resTick, packetCount-resPackets);
+  myPaho->writeFlicd(FLICD_RESOURCES, msg);
+  LOG(LOG_MAIN, LOG_INFO, "Resources: %s\n", msg);
+  resPrev=cur;
+  resTick=tick;
+  resPackets=packetCount;
+}
+
+//
+// {topic}/stats for every button, from the reader's FLIC_STATS tick
+//
+static void statsPublish() {
+  char msg[512];
+  DWORD tick=GetTickCount();
+  DWORD interval=statsPubTick ? tick-statsPubTick : (DWORD)myConfig->getStatsInterval()*1000;
+  statsPubTick=tick;
+  for(int i=0;i<myConfig->getFlicCount();i++) {
+    if(!myConfig->getFlicName(i)) { continue; }
+    statsFormat(msg, sizeof(msg), i, interval);
+    myPaho->writeButton(i, "stats", msg);
+  }
+  resourcePublish();
+}
+
+//
+// The watchdog thread saw a stage stall or recover.  paho is only used from this thread, so
+// it just asks; the looper publishes {base}/watchdog on FLIC_WATCHDOG.
+//
+static void watchdogDue() {
+  flicd_client_pipe_send(FLIC_WATCHDOG, FLIC_STATUS_OK, FLIC_BUTTON_ALL, "");
 }
 
 int looper(DWORD gotill) {
-  char piper[32];                      // the 32 byte payload for the pipe to the main thread
+  char piper[FLIC_BUFSIZE];            // the payload for the pipe to the main thread
   int ret;
   int flicOp;
   int flicStat;
   int flicButt;
-  const char *flicMsg=&piper[3];
+  const char *flicMsg=&piper[4];
   char timeStr[64];
+  uint64_t nowMs;
   int holdCt=0;                        // how many buttons are being actively held down at this time?
-  int butt_held[8];                    // is button being held down
-  int butt_downct[8];                  // how many down events since an event finalization happened (in a clickclick situation)
-  for(int i=0;i<8;i++) { butt_held[i]=butt_downct[i]=0; }
+  int buttons=myConfig->getFlicCount();
+  std::vector<int> butt_held(buttons,0);     // is button being held down (BUTT_HOLD or BUTT_CLICKHOLD)
+  std::vector<DWORD> butt_holdtick(buttons,0);   // when the hold started
+  std::vector<int> butt_downct(buttons,0);   // how many down events since an event finalization happened (in a clickclick situation)
 
   for(;;) {
+    //
+    // The last message is handled (by now even if it ended the previous looper)
+    //
+    static bool taken=false;
+    static uint64_t takenTrace=0;
+    static int takenOp=0;
+    if(taken) {
+      watchdogOut(WD_DISPATCH);
+      if(takenTrace) { traceSpan(TRACE_DISPATCH, takenTrace, takenOp); }
+      taken=false;
+    }
+
     //
     // Check for exit loop condition.  the time is after the limit and we do not have any active button holds
     //
     DWORD tick=GetTickCount();
     if(tick>gotill && !holdCt) { return 1000; }
 
-    ret=_read(thePipeR,piper,32);
-    assert(ret==32);
+    //
+    // A hold that has gone on too long is a stuck button or a lost up event.  Checked
+    // whenever we wake, which is at least once a minute.
+    //
+    DWORD holdTimeout=(DWORD)myConfig->getHoldTimeout()*1000;
+    for(int i=0;holdCt && holdTimeout && i<buttons;i++) {
+      if(butt_held[i] && tick-butt_holdtick[i]>holdTimeout) {
+        holdEnd(i, butt_held[i], "held longer than HOLD_TIMEOUT");
+        butt_held[i]=butt_downct[i]=0;
+        holdCt--;
+      }
+    }
+
+    //
+    // Broker went away.  Try to get back every 30s rather than waiting for the next epoch.
+    // reconnect() only starts the attempt; FLIC_MQTT arrives once it is up.
+    //
+    if(!myPaho->isUp() && tick-pahoRetryTick>=30000) {
+      pahoRetryTick=tick;
+      myPaho->reconnect();
+    }
+
+    //
+    // Messages are written whole and are smaller than PIPE_BUF, so anything but a full
+    // message means the pipe itself is broken.
+    //
+    ret=_read(thePipeR,piper,FLIC_BUFSIZE);
+    if(ret<0 && errno==EINTR) { continue; }
+    if(ret!=FLIC_BUFSIZE) {
+      LOG(LOG_MAIN, LOG_ERROR, "pipe from the flicd reader gave %d bytes (%s)\n",ret,ret<0 ? strerror(errno) : "closed or short");
+      return -1;
+    }
+    taken=true;
+    takenOp=(unsigned char)piper[0];
+    takenTrace=TRACE_ON() ? traceNow() : 0;
+    if(takenTrace) {
+      uint32_t id=0;
+      for(int i=3;i>=0;i--) { id=(id<<8)|(unsigned char)piper[FLIC_TRACE_OFF+i]; }
+      traceThreadName("main");
+      if(id) { traceFlow(TRACE_PIPE, 'f', id, takenOp); }
+    }
 
-    flicOp=piper[0];
+    flicOp=(unsigned char)piper[0];
     flicStat=piper[1];
-    flicButt=piper[2];
+    flicButt=(unsigned char)piper[2] | ((unsigned char)piper[3]<<8);
 
-#ifdef DEBUG_PRINT_MAIN
-    fprintf(logfile,"piper got %s %d %d %s\n",FLIC_OPS[flicOp],flicStat,flicButt,flicMsg);
-#endif
+    LOG(LOG_MAIN, LOG_DEBUG, "piper got %s %d %d %s\n",flicOp<FLIC_OP_COUNT ? FLIC_OPS[flicOp] : "?",flicStat,flicButt,flicMsg);
     if(flicOp==FLIC_PING) {
     } else if(flicOp==FLIC_INFO_GENERAL) {
       myPaho->markAvailable(true);
-    } else if(flicOp==FLIC_CONNECT) {
-    } else if(flicOp==FLIC_STATUS) {
+      myPaho->writeFlicd(FLICD_CONTROLLER, flicMsg);
+      for(int i=0;i<buttons;i++) { metaPublish(i); }   // the verified list came with it
+    } else if(flicOp==FLIC_CONTROLLER) {
+      LOG(LOG_MAIN, LOG_WARN, "bluetooth controller is %s\n",flicMsg);
+      myPaho->writeFlicd(FLICD_CONTROLLER, flicMsg);
+    } else if(flicOp==FLIC_SPACE) {
+      if(flicStat==FLIC_STATUS_NO_SPACE) { LOG(LOG_MAIN, LOG_WARN, "flicd has no room for more connections (max %s)\n",flicMsg); }
+      myPaho->writeFlicd(FLICD_SPACE, flicStat==FLIC_STATUS_NO_SPACE ? "Full" : "Available");
+    } else if((flicOp==FLIC_CONNECT || flicOp==FLIC_STATUS) && flicStat>=0 && flicStat<=FLIC_STATUS_CONN_FAILED) {
+      if(flicStat==FLIC_STATUS_DISCONNECTED || flicStat==FLIC_STATUS_CONN_FAILED) {
+        LOG(LOG_MAIN, LOG_INFO, "button %d %s: %s\n",flicButt,FLIC_CONNECTION_NAMES[flicStat],flicMsg);
+      }
+      linkUpdate(flicButt, flicStat==FLIC_STATUS_READY, flicStat==FLIC_STATUS_DISCONNECTED);
+      myPaho->writeConnection(flicButt, FLIC_CONNECTION_NAMES[flicStat]);
+    } else if(flicOp==FLIC_REMOVED) {
+      LOG(LOG_MAIN, LOG_INFO, "flicd removed the channel for button %d: %s\n",flicButt,flicMsg);
+      linkUpdate(flicButt, false, false);
+      myPaho->writeConnection(flicButt, "Removed");
+    } else if(flicOp==FLIC_BATTERY) {
+      batteryUpdate(flicButt, flicMsg);
+    } else if(flicOp==FLIC_PRESENCE) {
+      static char *snapshot=(char*)malloc(PRESENCE_SLOTS*64+128);
+      presenceFormat(snapshot, PRESENCE_SLOTS*64+128, GetTickCount());
+      myPaho->writeFlicd(FLICD_PRESENCE, snapshot);
+    } else if(flicOp==FLIC_SHUTDOWN) {
+      return 2000;
+    } else if(flicOp==FLIC_STATS) {
+      statsPublish();
+    } else if(flicOp==FLIC_WATCHDOG) {
+      char json[512];
+      if(watchdogFormat(json, sizeof(json))) { myPaho->writeFlicd(FLICD_WATCHDOG, json); }
+    } else if(flicOp==FLIC_MQTT) {
+      myPaho->republish();
+    } else if(flicOp==FLIC_META) {
+      if(flicStat==FLICD_RESULT_OK) { metaPublish(flicButt); }
+      if(theMetaPending>0 && --theMetaPending==0) { metaRefresh(); }
+    } else if(flicOp==FLIC_LINK) {
+      if(flicStat==FLIC_STATUS_LINK_DOWN) {
+        //
+        // flicd went away.  Any hold in progress will never see its up event so forget them.
+        //
+        myPaho->writeFlicd(FLICD_LINK, "Offline");
+        for(int i=0;i<buttons;i++) {
+          butt_held[i]=butt_downct[i]=0;
+          linkUpdate(i, false, false);
+          myPaho->writeConnection(i, "Disconnected", true);
+        }
+        holdCt=0;
+      } else if(flicStat==FLIC_STATUS_LINK_RTT) {
+        //
+        // A ping came back.  Publish the rtt summary at most once a minute
+        //
+        if(GetTickCount()-rttTick>=60000) {
+          char rtt[160];
+          rttTick=GetTickCount();
+          flicd_client_rtt_format(rtt,sizeof(rtt));
+          myPaho->writeFlicd(FLICD_RTT, rtt);
+        }
+      } else {
+        //
+        // Relinked.  flicMsg carries time to resync in ms
+        //
+        myPaho->writeFlicd(FLICD_LINK, "Online");
+        myPaho->writeFlicd(FLICD_RESYNC, flicMsg);
+      }
+    } else if(flicOp==FLIC_RELOAD) {
+      std::vector<int> reset;
+      reloadConfig(reset);
+      buttons=myConfig->getFlicCount();
+      butt_held.resize(buttons,0);
+      butt_holdtick.resize(buttons,0);
+      butt_downct.resize(buttons,0);
+      for(size_t i=0;i<reset.size();i++) {
+        if(butt_held[reset[i]]) { holdCt--; }
+        butt_held[reset[i]]=butt_downct[reset[i]]=0;
+        if(reset[i]<(int)theButtonLinks.size()) { theButtonLinks[reset[i]]=ButtonLink(); }
+        if(reset[i]<(int)theButtonBatteries.size()) { theButtonBatteries[reset[i]]=ButtonBattery(); }
+        if(reset[i]<(int)theButtonRates.size()) { theButtonRates[reset[i]]=ButtonRate(); }
+        statsReset(reset[i]);
+        metaPublish(reset[i]);
+      }
+      if(!theMetaPending) {
+        theMetaNext=0;
+        metaRefresh();
+      }
+    } else if(flicOp==FLIC_UPDOWN && flicButt>=buttons) {
+      LOG(LOG_MAIN, LOG_WARN, "piper got %s for unknown button %d\n",FLIC_OPS[flicOp],flicButt);
     } else if(flicOp==FLIC_UPDOWN) {
+      bool queued=strstr(flicMsg," queued ")!=0;
       if(flicStat==FLIC_STATUS_DOWN) { 
         //
-        // We started pressing down
+        // We started pressing down.  If a hold is still open flicd lost its up event.
         //
-        myPaho->writeState(flicButt, BUTT_STATE, "On"); 
+        if(butt_held[flicButt]) {
+          holdEnd(flicButt, butt_held[flicButt], "pressed again while still held");
+          butt_held[flicButt]=butt_downct[flicButt]=0;
+          holdCt--;
+        }
+        if(rateAllow(flicButt)) { myPaho->writeState(flicButt, BUTT_STATE, "On"); }
+        statsDown(flicButt, GetTickCount(), queued);
 	butt_downct[flicButt]++;
-        assert(!butt_held[flicButt]);
       } else if(flicStat==FLIC_STATUS_UP) {
         //
         // We stopped pressing down
         //
         myPaho->writeState(flicButt, BUTT_STATE, "Off"); 
+        statsUp(flicButt, GetTickCount(), butt_held[flicButt]!=0);
       } else if(flicStat==FLIC_STATUS_HOLD) {
         //
         // We are holding it down.  based on value of butt_downct, its either a simple hold or a click then hold.
 	// We send an event in this case in case user wants to trigger off of when the hold begins instead of
 	// when the hold ends.
         //
-        timeFill(timeStr);
-	if(butt_downct[flicButt]>1) {
-          myPaho->writeState(flicButt, BUTT_CLICKHOLD, timeStr); 
-	} else {
-          myPaho->writeState(flicButt, BUTT_HOLD, timeStr); 
-	}
-        butt_held[flicButt]=1;
-        holdCt++; 
+        if(butt_held[flicButt]) {
+          LOG(LOG_MAIN, LOG_WARN, "button %d: hold while already held, ignored\n",flicButt);
+          metricAdd(METRIC_BUTTON_REPAIRS, 1);
+        } else {
+          nowMs=timeFill(timeStr);
+          butt_held[flicButt]=butt_downct[flicButt]>1 ? BUTT_CLICKHOLD : BUTT_HOLD;
+          gesture(flicButt, butt_held[flicButt], timeStr, queued, nowMs);
+          butt_holdtick[flicButt]=GetTickCount();
+          holdCt++; 
+        }
       } else if(flicStat==FLIC_STATUS_SINGLECLICK) {
         //
         // Flic detected a single click completion.  Send a click or hold_up event
         //
-        timeFill(timeStr);
+        nowMs=timeFill(timeStr);
         if(butt_held[flicButt]) {
-          myPaho->writeState(flicButt, BUTT_HOLD_UP, timeStr); 
+          gesture(flicButt, BUTT_HOLD_UP, timeStr, queued, nowMs);
           butt_held[flicButt]=0;   // clear the hold status
           holdCt--;
         } else {
-          myPaho->writeState(flicButt, BUTT_CLICK, timeStr); 
+          gesture(flicButt, BUTT_CLICK, timeStr, queued, nowMs);
         }
 	butt_downct[flicButt]=0;  // finalize.  reset downct
       } else if(flicStat==FLIC_STATUS_DOUBLECLICK) {
         //
         // Flic detected a double click completion.  Send a clickclick or clickhold_up event
         //
-        timeFill(timeStr);
+        nowMs=timeFill(timeStr);
         if(butt_held[flicButt]) {
-          myPaho->writeState(flicButt, BUTT_CLICKHOLD_UP, timeStr); 
+          gesture(flicButt, BUTT_CLICKHOLD_UP, timeStr, queued, nowMs);
           butt_held[flicButt]=0;   // clear the hold status
           holdCt--;
         } else {
-          myPaho->writeState(flicButt, BUTT_CLICKCLICK, timeStr); 
+          gesture(flicButt, BUTT_CLICKCLICK, timeStr, queued, nowMs);
         }
 	butt_downct[flicButt]=0;  // finalize.  reset downct
       }
     } else {
-#ifdef DEBUG_PRINT_MAIN
-      fprintf(logfile,"piper got UNKNOWN %s %d %d %s\n",FLIC_OPS[flicOp],flicStat,flicButt,flicMsg);
-#endif
+      LOG(LOG_MAIN, LOG_WARN, "piper got UNKNOWN %d %d %d %s\n",flicOp,flicStat,flicButt,flicMsg);
     }
     packetCountEpoch++;
-#ifdef DEBUG_PRINT_MAIN
-    fflush(logfile);
-#endif
+    packetCount++;
   }
 }
 
@@ -198,6 +864,9 @@ int main(int argc, char *argv[]) {
     flicd_client_main(argc-1,&argv[1]);
     return(0);
   }
+  if(argc>1 && !strcmp(argv[1],"-journal")) {
+    return journalQuery(argc-1,&argv[1]);
+  }
   if(argc==2 && !strcmp(argv[1],"-mqtt")) {
     fprintf(stderr,"MQTT mode.  lets go!\n");
   } else {
@@ -208,7 +877,7 @@ int main(int argc, char *argv[]) {
 #ifdef __LINUX__
   status=pipe(pipes);
 #else
-  status=_pipe(pipes,1024,O_BINARY);
+  status=_pipe(pipes,4096,O_BINARY);
 #endif
   if(status==-1) {
     fprintf(stderr, "Error creating pipes\n");
@@ -216,6 +885,7 @@ int main(int argc, char *argv[]) {
   }
   thePipeR=pipes[0];
   thePipeW=pipes[1];
+  shutdownWatch();
 
   //
   // Load Config
@@ -223,45 +893,80 @@ int main(int argc, char *argv[]) {
   fprintf(stderr, "Loading Config File\n");
   myConfig->readConfig("Flic2MQTT.config");
   logfile=myConfig->getLogfile();
+  //
+  // no LOGFILE still goes through the writer thread, to stderr: a synchronous write per
+  // packet and publish is only for -interact
+  //
+  logInit(logfile ? logfile : stderr);
+  logSetRotation(myConfig->getLogfileName(), myConfig->getLogRotateSize(), myConfig->getLogRotateHours(), myConfig->getLogKeep(), myConfig->getLogCompress());
+  if(myConfig->getJournal()) {
+    char source[64];
+    snprintf(source,sizeof(source),"%s:%d",myConfig->getFlicdServer(),myConfig->getFlicdPort());
+    if(journalOpen(myConfig->getJournal(), source)) {
+      LOG(LOG_MAIN, LOG_ERROR, "Could not open journal %s.  Not journaling.\n", myConfig->getJournal());
+    }
+  }
+
+  metaOpen(myConfig->getMetaCache());
+  seqOpen(myConfig->getSeqFile(), myConfig->getSeqCheckpoint());
+  presenceSetInterval(myConfig->getPresenceInterval());
+  theTimeFormat.setFormat(myConfig->getTimeFormat());
+  statsSetInterval(myConfig->getStatsInterval());
+  traceSetFile(myConfig->getTraceFile());
 
   //
   // Initialize Flic
   //
+  flicd_client_set_ping(myConfig->getFlicdPingInterval(), myConfig->getFlicdPingMisses());
   int sockfd=flicd_client_init(myConfig->getFlicdServer(), myConfig->getFlicdPort());
   if(sockfd<0) {
-    if(logfile) { fprintf(logfile,"Error connecting to flicd server\n"); }
+    LOG(LOG_MAIN, LOG_ERROR, "Error connecting to flicd server\n");
+    logFlush();
     return -1;
   }
 
   //
   // Initialize MQTT
   //
-  PahoWrapper *pt=new PahoWrapper(myConfig);
+  PahoWrapper *pt=new PahoWrapper(myConfig, pahoConnected);
   pt->markAvailable(false);
+  pt->writeFlicd(FLICD_LINK, "Online");
   myPaho=pt;
 
   // 
-  // Kick off with info request and register for desired buttons
+  // Kick off with info request and register for desired buttons, their batteries and the
+  // presence scanner.  All in one write.
   //
-  status=flicd_client_handle_line(sockfd, "getInfo");
-#ifdef DEBUG_PRINT_MAIN
-  fprintf(logfile,"main->flicd: getInfo : status=%d\n",status);
-#endif
-
-  for(int i=0;i<8;i++) {
+  FlicdBatch batch;
+  int connects=0;
+  batch.getInfo();
+  for(int i=0;i<myConfig->getFlicCount();i++) {
     const char *mac=myConfig->getFlicMac(i);
     if(mac) {
-      char cmd[32];
-      sprintf(cmd,"connect %s %d",mac,i);
-      status=flicd_client_handle_line(sockfd, cmd);
-#ifdef DEBUG_PRINT_MAIN
-      fprintf(logfile,"main->flicd: %s : status=%d\n",cmd,status);
-#endif
+      batch.connect(mac, i, myConfig->getFlicLatency(i), 0x1ff, connectDone, (void*)(size_t)i);
+      batch.createBatteryStatusListener(mac, i);
+      connects++;
     }
   }
+  if(myConfig->getPresenceInterval()) { batch.createScanner(PRESENCE_SCAN_ID); }
+  int cmds=batch.count();
+  status=batch.flush();
+  LOG(LOG_MAIN, LOG_INFO, "main->flicd: %d commands, getInfo + %d connects + %d battery listeners%s : status=%d\n",cmds,connects,connects,myConfig->getPresenceInterval() ? " + scanner" : "",status);
+
+  //
+  // What we knew about the buttons last time goes out now; flicd is asked again in the background
+  //
+  for(int i=0;i<myConfig->getFlicCount();i++) { metaPublish(i); }
+  metaRefresh();
+  configWatch("Flic2MQTT.config");
+  watchdogStart(myConfig->getWatchdog(), watchdogDue);
 
   firstTick=epochTick=availabilityTick=0;
+  rttTick=GetTickCount()-60000;
   packetCount=packetCountEpoch=0;
+  resourceSample(&resPrev);
+  resTick=GetTickCount();
+  resPackets=0;
   epochNum=0;
 
   //
@@ -275,13 +980,11 @@ int main(int argc, char *argv[]) {
 
     epochNum++;
     packetCountEpoch=0;
-#ifdef DEBUG_PRINT_MAIN
-    if(logfile) { 
+    if(LOG_ENABLED(LOG_MAIN, LOG_INFO)) {
       time_t clock;
       time(&clock);
-      fprintf(logfile,"Epoch %d begins: %.24s\n", epochNum, asctime(localtime(&clock)));
-   }
-#endif
+      logWrite(LOG_MAIN, LOG_INFO, "Epoch %d begins: %.24s\n", epochNum, asctime(localtime(&clock)));
+    }
     epochTick=GetTickCount();
     availabilityTick=epochTick+1000*60*60;   // one hour
     if(!firstTick) { firstTick=epochTick; }
@@ -290,19 +993,16 @@ int main(int argc, char *argv[]) {
 
     DWORD tick=GetTickCount();
 
-#ifdef DEBUG_PRINT_MAIN
-    if(logfile) { 
+    if(LOG_ENABLED(LOG_MAIN, LOG_INFO)) {
       int h, m, s, frac;
       frac=(tick-epochTick);
       h=frac/(1000*60*60); frac=frac%(1000*60*60);
       m=frac/(1000*60);    frac=frac%(1000*60);
       s=frac/(1000);       frac=frac%(1000);
       frac=frac/100;
-      fprintf(logfile, "Looper ended with status %d (normal=1000) Epoch %d after epochTime=%d:%02d:%02d.%01d packets=%d\n",status,epochNum,h,m,s,frac,packetCountEpoch);
-      fprintf(logfile, "firstTick=%u epochTick=%u tick=%u\n",firstTick,epochTick,tick);
-      fflush(logfile); 
+      logWrite(LOG_MAIN, LOG_INFO, "Looper ended with status %d (normal=1000) Epoch %d after epochTime=%d:%02d:%02d.%01d packets=%d\n",status,epochNum,h,m,s,frac,packetCountEpoch);
+      logWrite(LOG_MAIN, LOG_INFO, "firstTick=%lu epochTick=%lu tick=%lu\n",firstTick,epochTick,tick);
     }
-#endif
 
     //
     // Why did looper end?
@@ -310,17 +1010,50 @@ int main(int argc, char *argv[]) {
     //
     // Expected availiability deadline timeout (1000)
     //
-    char msg[1024];
+    char msg[2048];
     if(status==1000) {
-      flicd_client_handle_line(sockfd, "getInfo");
+      FlicdBatch info;
+      info.getInfo();
+      info.flush();
+      resourcePublish();
+      metricFormat(msg,sizeof(msg));
+      myPaho->writeFlicd(FLICD_METRICS, msg);
+      linkPublish(tick-epochTick);
+      batteryHeartbeat();
+      if(!theMetaPending) {
+        theMetaNext=0;
+        metaRefresh();
+      }
       sprintf(msg,"EPOCH %d - LOOPER END - 1000 - NORMAL LOOPER TIMEOUT TO REFRESH AVAILABILITY.",epochNum);
+    //
+    // Asked to stop (2000): let go of flicd so it stops sending, then give the broker
+    // SHUTDOWN_DRAIN seconds to take what is in flight before saying Offline ourselves
+    //
+    } else if(status==2000) {
+      LOG(LOG_MAIN, LOG_INFO, "EPOCH %d - LOOPER END - 2000 - SHUTDOWN REQUESTED.\n",epochNum);
+      watchdogNotify("STOPPING=1");
+      watchdogSetThreshold(0);                // waiting on the drain is not a stall
+      FlicdBatch bye;
+      for(int i=0;i<myConfig->getFlicCount();i++) {
+        if(myConfig->getFlicMac(i)) {
+          bye.disconnect(i);
+          bye.removeBatteryStatusListener(i);
+        }
+      }
+      if(myConfig->getPresenceInterval()) { bye.removeScanner(PRESENCE_SCAN_ID); }
+      bye.flush();
+      int flushed=0;
+      int abandoned=myPaho->shutdown(myConfig->getShutdownDrain()*1000, &flushed);
+      sprintf(msg,"Shutdown: %d messages flushed, %d abandoned in %lums",flushed,abandoned,GetTickCount()-tick);
+      LOG(LOG_MAIN, abandoned ? LOG_WARN : LOG_INFO, "%s\n",msg);
+      if(TRACE_ON()) { traceDump(); }
+      break;
     } else {
       sprintf(msg,"EPOCH %d - LOOPER END - %d - UNEXPECTED RETURN.  DIE!!!!",epochNum,status);
     }
-#ifdef DEBUG_PRINT_MAIN
-    if(logfile && msg) { fprintf(logfile, "%s\n",msg); }
-#endif
+    LOG(LOG_MAIN, status==1000 ? LOG_INFO : LOG_ERROR, "%s\n",msg);
   }
-  if(logfile) { fflush(logfile); } // should be in Config.cpp destructor?
+  seqClose();
+  logFlush();
 }
 
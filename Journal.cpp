@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Binary event journal.  The file is memory mapped and grown in chunks, so appending a
+// record is a copy into the page cache: nothing is lost if the process dies, and no
+// write() is made per event.  The index gets one 8 byte entry the first time each hour
+// is seen, which lets the query mode seek straight to the time range it wants.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <vector>
+#include "global.h"
+#include "Log.h"
+#include "Journal.h"
+
+using namespace std;
+
+#define JOURNAL_GROW 4096                     // records added each time the file fills
+
+#ifdef __LINUX__
+
+static int theJournalFd=-1;
+static int theIndexFd=-1;
+static uint8_t *theJournalMap=0;
+static size_t theJournalMapped=0;
+static uint32_t theLastHour=0;
+static char theJournalSource[24];
+static pthread_mutex_t theJournalLock=PTHREAD_MUTEX_INITIALIZER;
+
+#define JOURNAL_HEADER ((JournalHeader *)theJournalMap)
+#define JOURNAL_RECORD(seq) ((JournalRecord *)(theJournalMap+(size_t)(seq)*sizeof(JournalRecord)))
+
+static uint64_t journal_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+//
+// Make the file (and the mapping) big enough for bytes, in whole JOURNAL_GROW chunks
+//
+static int journal_map(size_t bytes) {
+  if(bytes<=theJournalMapped) { return 0; }
+  size_t chunk=JOURNAL_GROW*sizeof(JournalRecord);
+  size_t want=(bytes+chunk-1)/chunk*chunk;
+  if(ftruncate(theJournalFd, want)) { LOG(LOG_MAIN, LOG_ERROR, "journal grow: %s\n", strerror(errno)); return -1; }
+  if(theJournalMap) { munmap(theJournalMap, theJournalMapped); }
+  theJournalMap=(uint8_t*)mmap(0, want, PROT_READ|PROT_WRITE, MAP_SHARED, theJournalFd, 0);
+  if(theJournalMap==MAP_FAILED) {
+    LOG(LOG_MAIN, LOG_ERROR, "journal mmap: %s\n", strerror(errno));
+    theJournalMap=0;
+    theJournalMapped=0;
+    return -1;
+  }
+  theJournalMapped=want;
+  return 0;
+}
+
+//
+// Open (or create) the journal at path.  source names the flicd events come from.
+// Returns 0 on success; on failure journaling stays off.
+//
+int journalOpen(const char *path, const char *source) {
+  char idx[1024];
+  struct stat st;
+
+  theJournalFd=open(path, O_RDWR|O_CREAT, 0644);
+  if(theJournalFd<0 || fstat(theJournalFd,&st)) {
+    LOG(LOG_MAIN, LOG_ERROR, "Can not open journal %s: %s\n", path, strerror(errno));
+    if(theJournalFd>=0) { close(theJournalFd); }
+    theJournalFd=-1;
+    return -1;
+  }
+  snprintf(idx,sizeof(idx),"%s.idx",path);
+  theIndexFd=open(idx, O_RDWR|O_CREAT|O_APPEND, 0644);
+  if(theIndexFd<0) {
+    LOG(LOG_MAIN, LOG_ERROR, "Can not open journal index %s: %s\n", idx, strerror(errno));
+    close(theJournalFd);
+    theJournalFd=-1;
+    return -1;
+  }
+
+  if(journal_map(st.st_size ? st.st_size : sizeof(JournalHeader))) { return -1; }
+  JournalHeader *hdr=JOURNAL_HEADER;
+  if(!st.st_size) {
+    memcpy(hdr->magic, JOURNAL_MAGIC, 8);
+    hdr->recordSize=sizeof(JournalRecord);
+    hdr->count=0;
+  } else if(memcmp(hdr->magic, JOURNAL_MAGIC, 8) || hdr->recordSize!=sizeof(JournalRecord)) {
+    LOG(LOG_MAIN, LOG_ERROR, "%s is not a journal this version can append to\n", path);
+    munmap(theJournalMap, theJournalMapped);
+    theJournalMap=0;
+    close(theJournalFd);
+    close(theIndexFd);
+    theJournalFd=theIndexFd=-1;
+    return -1;
+  }
+
+  JournalIndex last;
+  if(lseek(theIndexFd, -(off_t)sizeof(last), SEEK_END)>=0 && read(theIndexFd, &last, sizeof(last))==sizeof(last)) {
+    theLastHour=last.hour;
+  }
+  snprintf(theJournalSource,sizeof(theJournalSource),"%s",source);
+  return 0;
+}
+
+//
+// Record one published button event.  Returns its seq for journalAck(), 0 if not journaling.
+//
+uint32_t journalAppend(int slot, const char *name, int mode, const char *payload) {
+  if(!theJournalMap) { return 0; }
+  uint64_t now=journal_now_ms();
+  pthread_mutex_lock(&theJournalLock);
+  uint32_t seq=JOURNAL_HEADER->count+1;
+  if(journal_map((size_t)(seq+1)*sizeof(JournalRecord))) {
+    pthread_mutex_unlock(&theJournalLock);
+    return 0;
+  }
+  JournalRecord *rec=JOURNAL_RECORD(seq);
+  memset(rec, 0, sizeof(*rec));
+  rec->timeMs=now;
+  rec->seq=seq;
+  rec->slot=slot;
+  rec->mode=mode;
+  rec->ack=JOURNAL_PENDING;
+  strncpy(rec->name, name ? name : "", sizeof(rec->name)-1);
+  memcpy(rec->source, theJournalSource, sizeof(rec->source));
+  strncpy(rec->payload, payload ? payload : "", sizeof(rec->payload)-1);
+
+  uint32_t hour=(uint32_t)(now/3600000);
+  if(hour!=theLastHour) {
+    JournalIndex ent={hour, seq};
+    if(write(theIndexFd, &ent, sizeof(ent))==sizeof(ent)) { theLastHour=hour; }
+  }
+  JOURNAL_HEADER->count=seq;
+  pthread_mutex_unlock(&theJournalLock);
+  return seq;
+}
+
+//
+// The broker answered for record seq (JOURNAL_ACKED or JOURNAL_FAILED).  Any thread.
+//
+void journalAck(uint32_t seq, int result) {
+  if(!seq) { return; }
+  pthread_mutex_lock(&theJournalLock);
+  if(theJournalMap && seq<=JOURNAL_HEADER->count) { JOURNAL_RECORD(seq)->ack=result; }
+  pthread_mutex_unlock(&theJournalLock);
+}
+
+//
+// "YYYY-MM-DD", "YYYY-MM-DD HH" or "YYYY-MM-DD HH:MM" local time to ms since the epoch.
+// "today" and "tomorrow" are the midnight that starts them.
+//
+static int64_t journal_parse_time(const char *s) {
+  struct tm lt;
+  memset(&lt, 0, sizeof(lt));
+  if(!strcmp(s,"today") || !strcmp(s,"tomorrow")) {
+    time_t now=time(0);
+    localtime_r(&now, &lt);
+    lt.tm_hour=lt.tm_min=lt.tm_sec=0;
+    if(!strcmp(s,"tomorrow")) { lt.tm_mday++; }      // mktime carries it into the next month
+    lt.tm_isdst=-1;
+    return (int64_t)mktime(&lt)*1000;
+  }
+  int n=sscanf(s, "%d-%d-%d %d:%d", &lt.tm_year, &lt.tm_mon, &lt.tm_mday, &lt.tm_hour, &lt.tm_min);
+  if(n<3) { return -1; }
+  lt.tm_year-=1900;
+  lt.tm_mon-=1;
+  lt.tm_isdst=-1;
+  return (int64_t)mktime(&lt)*1000;
+}
+
+static void journal_usage() {
+  fprintf(stderr,"flic2MQTT -journal file [-button name|slot] [-event state|click|hold|holdup|clickclick|clickhold|clickholdup]\n");
+  fprintf(stderr,"                        [-from \"YYYY-MM-DD[ HH:MM]\"|today|tomorrow] [-to \"YYYY-MM-DD[ HH:MM]\"|today|tomorrow]\n");
+}
+
+//
+// -journal mode: print the records matching the filters.  The index picks the first and
+// last record that can be in the time range so only that stretch of the file is read.
+//
+int journalQuery(int argc, char *argv[]) {
+  const char *path=0, *button=0;
+  int mode=-1;
+  int64_t from=0, to=INT64_MAX;
+  char idx[1024];
+
+  for(int i=1;i<argc;i++) {
+    if(!strcmp(argv[i],"-button") && i+1<argc) {
+      button=argv[++i];
+    } else if(!strcmp(argv[i],"-event") && i+1<argc) {
+      i++;
+      for(int m=0;m<(int)(sizeof(JOURNAL_MODES)/sizeof(JOURNAL_MODES[0]));m++) { if(!strcmp(argv[i],JOURNAL_MODES[m])) { mode=m; } }
+      if(mode<0) { journal_usage(); return 1; }
+    } else if(!strcmp(argv[i],"-from") && i+1<argc) {
+      if((from=journal_parse_time(argv[++i]))<0) { journal_usage(); return 1; }
+    } else if(!strcmp(argv[i],"-to") && i+1<argc) {
+      if((to=journal_parse_time(argv[++i]))<0) { journal_usage(); return 1; }
+    } else if(!path && argv[i][0]!='-') {
+      path=argv[i];
+    } else {
+      journal_usage();
+      return 1;
+    }
+  }
+  if(!path) { journal_usage(); return 1; }
+
+  int fd=open(path, O_RDONLY);
+  struct stat st;
+  if(fd<0 || fstat(fd,&st) || st.st_size<(off_t)sizeof(JournalHeader)) {
+    fprintf(stderr,"Cannot read journal %s\n",path);
+    return 1;
+  }
+  const uint8_t *map=(const uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(map==MAP_FAILED) { perror("journal mmap"); return 1; }
+  const JournalHeader *hdr=(const JournalHeader*)map;
+  if(memcmp(hdr->magic, JOURNAL_MAGIC, 8) || hdr->recordSize!=sizeof(JournalRecord)) {
+    fprintf(stderr,"%s is not a journal\n",path);
+    return 1;
+  }
+  uint32_t count=hdr->count;
+  if((off_t)((count+1)*sizeof(JournalRecord))>st.st_size) { count=st.st_size/sizeof(JournalRecord)-1; }
+
+  //
+  // Narrow [first,last] with the hour index
+  //
+  vector<JournalIndex> index;
+  snprintf(idx,sizeof(idx),"%s.idx",path);
+  FILE *fi=fopen(idx,"rb");
+  if(fi) {
+    JournalIndex ent;
+    while(fread(&ent,sizeof(ent),1,fi)==1) { index.push_back(ent); }
+    fclose(fi);
+  }
+  uint32_t first=1, last=count;
+  uint32_t fromHour=(uint32_t)(from/3600000), toHour=to==INT64_MAX ? UINT32_MAX : (uint32_t)(to/3600000);
+  for(size_t i=0;i<index.size();i++) {
+    if(index[i].hour<=fromHour) { first=index[i].first; }
+    if(index[i].hour>toHour) { last=index[i].first-1; break; }
+  }
+
+  int slot=-1;
+  if(button && button[0]>='0' && button[0]<='9') { slot=atoi(button); button=0; }
+
+  int matched=0;
+  for(uint32_t seq=first;seq<=last && seq<=count;seq++) {
+    const JournalRecord *rec=(const JournalRecord*)(map+(size_t)seq*sizeof(JournalRecord));
+    if((int64_t)rec->timeMs<from || (int64_t)rec->timeMs>=to) { continue; }
+    if(mode>=0 && rec->mode!=mode) { continue; }
+    if(slot>=0 && rec->slot!=slot) { continue; }
+    if(button && strncmp(rec->name, button, sizeof(rec->name))) { continue; }
+
+    char when[32];
+    time_t secs=rec->timeMs/1000;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+    printf("%s.%03d #%u %.*s(%d) %s '%.*s' %s from %.*s\n", when, (int)(rec->timeMs%1000), rec->seq,
+           (int)sizeof(rec->name), rec->name, rec->slot,
+           rec->mode<sizeof(JOURNAL_MODES)/sizeof(JOURNAL_MODES[0]) ? JOURNAL_MODES[rec->mode] : "?",
+           (int)sizeof(rec->payload), rec->payload,
+           rec->ack<=JOURNAL_FAILED ? JOURNAL_ACK_NAMES[rec->ack] : "?",
+           (int)sizeof(rec->source), rec->source);
+    matched++;
+  }
+  fprintf(stderr,"%d of %u records matched (searched %u)\n", matched, count, last>=first ? last-first+1 : 0);
+  munmap((void*)map, st.st_size);
+  close(fd);
+  return 0;
+}
+
+#else
+
+//
+// The journal relies on mmap.  Not built on Windows yet.
+//
+int journalOpen(const char *path, const char *source) {
+  LOG(LOG_MAIN, LOG_ERROR, "JOURNAL is not supported on Windows\n");
+  return -1;
+}
+
+uint32_t journalAppend(int slot, const char *name, int mode, const char *payload) { return 0; }
+void journalAck(uint32_t seq, int result) { }
+
+int journalQuery(int argc, char *argv[]) {
+  fprintf(stderr,"-journal is not supported on Windows\n");
+  return 1;
+}
+
+#endif
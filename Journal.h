@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _JOURNALH
+#define _JOURNALH
+
+#include <stdint.h>
+
+//
+// Append only binary journal of every button event published.  file holds a header
+// record then fixed size records; file.idx holds one JournalIndex per hour that has
+// events, pointing at the first record of that hour.
+//
+#define JOURNAL_MAGIC      "F2MJRNL1"
+
+#define JOURNAL_PENDING    0    // published, broker has not answered yet
+#define JOURNAL_ACKED      1
+#define JOURNAL_FAILED     2
+
+static const char *JOURNAL_ACK_NAMES[]={"pending", "acked", "failed"};
+
+//
+// Names of the published events, indexed by BUTT_xxx (see PahoWrapper.h)
+//
+static const char *JOURNAL_MODES[]={"state", "click", "hold", "holdup", "clickclick", "clickhold", "clickholdup"};
+
+struct JournalRecord {
+  uint64_t timeMs;              // wall clock, ms since the epoch
+  uint32_t seq;                 // record number, from 1
+  uint16_t slot;                // button slot
+  uint8_t  mode;                // BUTT_xxx
+  uint8_t  ack;                 // JOURNAL_xxx
+  char     name[24];            // button name
+  char     source[24];          // flicd host:port the event came from
+  char     payload[32];         // what was published (truncated)
+};
+
+struct JournalHeader {
+  char     magic[8];
+  uint32_t recordSize;
+  uint32_t count;               // records in use
+  char     unused[sizeof(JournalRecord)-16];
+};
+
+struct JournalIndex {
+  uint32_t hour;                // timeMs/3600000
+  uint32_t first;               // seq of the first record in that hour
+};
+
+static_assert(sizeof(JournalRecord)==96, "journal records are 96 bytes on disk");
+static_assert(sizeof(JournalHeader)==sizeof(JournalRecord), "header fills record 0");
+
+extern int journalOpen(const char *path, const char *source);
+extern uint32_t journalAppend(int slot, const char *name, int mode, const char *payload);
+extern void journalAck(uint32_t seq, int result);
+extern int journalQuery(int argc, char *argv[]);
+
+#endif
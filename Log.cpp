@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Asynchronous logger.  Callers format into a slot of a fixed ring and return; a background
+// thread writes whatever has accumulated and flushes once per batch.  Slots are claimed with
+// a compare and swap on the head and published with a per slot sequence number, so any
+// thread may log without taking a lock.  If the writer falls a full ring behind, new
+// messages are dropped and counted rather than blocking the caller.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <zlib.h>
+#include <vector>
+#define Sleep(xxx) usleep(xxx*1000)
+#define LOG_CAS(ptr,old,val) __sync_bool_compare_and_swap(ptr,old,val)
+#define LOG_BARRIER()        __sync_synchronize()
+#else
+#include <windows.h>
+#define LOG_CAS(ptr,old,val) (InterlockedCompareExchange(ptr,val,old)==(old))
+#define LOG_BARRIER()        MemoryBarrier()
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include "global.h"
+#include "Log.h"
+#include "Metrics.h"
+
+#define LOG_RING_SLOTS  1024                  // power of two
+#define LOG_SLOT_TEXT   244
+
+struct LogSlot {
+  long volatile seq;                          // == index when free, index+1 when filled
+  int len;
+  char text[LOG_SLOT_TEXT];
+};
+
+int volatile theLogLevel[LOG_SUBSYSTEMS]={LOG_DEBUG, LOG_DEBUG, LOG_INFO, LOG_INFO};
+static int theLogConfigured[LOG_SUBSYSTEMS]={LOG_DEBUG, LOG_DEBUG, LOG_INFO, LOG_INFO};
+
+static LogSlot theLogRing[LOG_RING_SLOTS];
+static long volatile theLogHead=0;            // next slot a producer claims
+static long volatile theLogTail=0;            // next slot the writer drains
+static FILE *theLogFile=0;                    // 0 until logInit(): write synchronously to stderr
+
+//
+// Rotation state.  Only the writer thread rotates; the compressor only renames its own output.
+//
+static char *theLogName=0;                    // 0 for stdout/stderr: never rotated
+static long long theLogMaxBytes=0;            // rotate when the file reaches this size (0=never)
+static int theLogHours=0;                     // rotate on every N hour wall clock boundary (0=never)
+static int theLogKeep=9;                      // rotated files kept: name.1 .. name.keep
+static int theLogCompress=0;                  // gzip rotated files in the background
+static long long theLogBytes=0;               // bytes in the current file
+static time_t theLogNextRotate=0;
+static long theLogRotations=0;                // rotations so far; tells the compressor where its file went (under theRotateLock)
+
+#ifdef __LINUX__
+static pthread_mutex_t theRotateLock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t theCompressWake=PTHREAD_COND_INITIALIZER;
+static std::vector<long> theCompressJobs;     // rotation numbers waiting to be gzipped
+#define rotate_lock()   pthread_mutex_lock(&theRotateLock)
+#define rotate_unlock() pthread_mutex_unlock(&theRotateLock)
+#else
+#define rotate_lock()
+#define rotate_unlock()
+#endif
+
+//
+// name.keep-1 -> name.keep ... name -> name.1, carrying compressed copies along.
+// Whatever falls off the end is deleted.
+//
+void logShiftFiles(const char *name, int keep) {
+  char from[1024], to[1024];
+  rotate_lock();
+  for(int i=keep;i>=0;i--) {
+    for(int gz=0;gz<2;gz++) {
+      const char *ext=gz ? ".gz" : "";
+      if(i) { snprintf(from,sizeof(from),"%s.%d%s",name,i,ext); } else if(gz) { continue; } else { snprintf(from,sizeof(from),"%s",name); }
+      if(i>=keep) { remove(from); continue; }
+      snprintf(to,sizeof(to),"%s.%d%s",name,i+1,ext);
+      remove(to);
+      rename(from,to);
+    }
+  }
+  rotate_unlock();
+}
+
+//
+// Local time of the next multiple of theLogHours since midnight
+//
+static time_t log_next_boundary(time_t now) {
+  struct tm lt=*localtime(&now);
+  lt.tm_hour=lt.tm_min=lt.tm_sec=0;
+  time_t midnight=mktime(&lt);
+  long step=theLogHours*3600L;
+  return midnight+((now-midnight)/step+1)*step;
+}
+
+#ifdef __LINUX__
+//
+// Background gzip of rotated files.  The file is compressed from an open handle so it
+// does not matter if further rotations rename it meanwhile; once done, the rotation
+// count says where it lives now.
+//
+static void *log_compressor(void *param) {
+  char src[1024], tmp[1040], dst[1040];
+  static char buf[65536];
+  for(;;) {
+    pthread_mutex_lock(&theRotateLock);
+    while(theCompressJobs.empty()) { pthread_cond_wait(&theCompressWake, &theRotateLock); }
+    long rot=theCompressJobs.front();
+    theCompressJobs.erase(theCompressJobs.begin());
+    int at=theLogRotations-rot+1;
+    FILE *in=0;
+    if(theLogName && at<=theLogKeep) {
+      snprintf(src,sizeof(src),"%s.%d",theLogName,at);
+      in=fopen(src,"r");
+    }
+    pthread_mutex_unlock(&theRotateLock);
+    if(!in) { continue; }
+
+    snprintf(tmp,sizeof(tmp),"%s.gz.tmp",src);
+    gzFile out=gzopen(tmp,"wb6");
+    size_t n;
+    int ok=out!=0;
+    while(ok && (n=fread(buf,1,sizeof(buf),in))>0) { ok=gzwrite(out,buf,(unsigned)n)==(int)n; }
+    fclose(in);
+    if(out && gzclose(out)!=Z_OK) { ok=0; }
+
+    pthread_mutex_lock(&theRotateLock);
+    at=theLogRotations-rot+1;
+    if(ok && theLogName && at<=theLogKeep) {
+      snprintf(src,sizeof(src),"%s.%d",theLogName,at);
+      snprintf(dst,sizeof(dst),"%s.%d.gz",theLogName,at);
+      rename(tmp,dst);
+      remove(src);
+    } else {
+      remove(tmp);
+    }
+    pthread_mutex_unlock(&theRotateLock);
+  }
+  return 0;
+}
+#endif
+
+//
+// Writer thread only.  Close the current file, shift the old ones and start a new one.
+//
+static void log_rotate(time_t now) {
+  fclose(theLogFile);
+  logShiftFiles(theLogName, theLogKeep);
+  FILE *f=fopen(theLogName,"w");
+  if(!f) {
+    //
+    // nowhere to log.  stop rotating and fall back to stderr
+    //
+    f=stderr;
+    free(theLogName);
+    theLogName=0;
+  }
+  theLogFile=f;
+  theLogBytes=0;
+  if(theLogHours) { theLogNextRotate=log_next_boundary(now); }
+  metricAdd(METRIC_LOG_ROTATIONS, 1);
+  rotate_lock();
+  theLogRotations++;
+#ifdef __LINUX__
+  if(theLogCompress && theLogName) {
+    theCompressJobs.push_back(theLogRotations);
+    pthread_cond_signal(&theCompressWake);
+  }
+#endif
+  rotate_unlock();
+}
+
+//
+// Writer thread only.  Rotate when the wall clock boundary passes.  Size is checked as
+// each message is written.
+//
+static void log_rotate_check() {
+  if(!theLogName || !theLogHours) { return; }
+  time_t now=time(0);
+  if(now>=theLogNextRotate) { log_rotate(now); }
+}
+
+//
+// Write out every filled slot in order.  Returns number written.
+//
+static int log_drain() {
+  int n=0;
+  long long bytes=0;
+  for(;;) {
+    long pos=theLogTail;
+    LogSlot *slot=&theLogRing[pos&(LOG_RING_SLOTS-1)];
+    if(slot->seq!=pos+1) { break; }
+    LOG_BARRIER();
+    fwrite(slot->text, 1, slot->len, theLogFile);
+    bytes+=slot->len;
+    theLogBytes+=slot->len;
+    LOG_BARRIER();
+    slot->seq=pos+LOG_RING_SLOTS;
+    theLogTail=pos+1;
+    n++;
+    if(theLogName && theLogMaxBytes && theLogBytes>=theLogMaxBytes) { log_rotate(time(0)); }
+  }
+  if(n) {
+    fflush(theLogFile);
+    metricAdd(METRIC_LOG_BYTES, bytes);
+  }
+  return n;
+}
+
+#ifdef __LINUX__
+static void *log_writer(void *param)
+{
+  //
+  // Idle by waiting for the level change signals, so they are only ever taken here
+  // (every thread has them blocked) and never interrupt a read elsewhere.
+  //
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  sigaddset(&sigs, SIGUSR2);
+  struct timespec idle={0, 50*1000000};
+  for(;;) {
+    int n=log_drain();
+    log_rotate_check();
+    if(n) { continue; }
+    int sig=sigtimedwait(&sigs, NULL, &idle);
+    if(sig==SIGUSR1 || sig==SIGUSR2) {
+      logBoost(sig==SIGUSR1);
+      logWrite(LOG_MAIN, LOG_INFO, "Log levels %s\n", sig==SIGUSR1 ? "raised to DEBUG" : "back to configured");
+    }
+  }
+  return 0;
+}
+#else
+static DWORD WINAPI log_writer(LPVOID param)
+{
+  for(;;) {
+    int n=log_drain();
+    log_rotate_check();
+    if(!n) { Sleep(50); }
+  }
+  return 0;
+}
+#endif
+
+//
+// Start the background writer.  Until this is called messages go straight to stderr.
+// Call before creating other threads (the shutdown watcher, which blocks SIGUSR1/SIGUSR2 itself,
+// is the one started earlier): they inherit SIGUSR1/SIGUSR2 blocked.
+//
+void logInit(FILE *f) {
+  if(theLogFile || !f) { return; }
+  for(int i=0;i<LOG_RING_SLOTS;i++) { theLogRing[i].seq=i; }
+  theLogFile=f;
+#ifdef __LINUX__
+  //
+  // SIGUSR1 turns every subsystem up to DEBUG, SIGUSR2 puts the configured levels back
+  //
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  sigaddset(&sigs, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  pthread_t tid;
+  pthread_create(&tid, NULL, log_writer, NULL);
+  pthread_detach(tid);
+#else
+  CloseHandle(CreateThread(NULL, 0, log_writer, NULL, 0, NULL));
+#endif
+}
+
+void logWrite(int sub, int lvl, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if(!theLogFile) {
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  //
+  // claim a slot
+  //
+  long pos;
+  LogSlot *slot;
+  for(pos=theLogHead;;) {
+    slot=&theLogRing[pos&(LOG_RING_SLOTS-1)];
+    long diff=slot->seq-pos;
+    if(diff==0) {
+      if(LOG_CAS(&theLogHead, pos, pos+1)) { break; }
+      pos=theLogHead;
+    } else if(diff<0) {
+      //
+      // ring full.  Drop it, but never lose an error.
+      //
+      metricAdd(METRIC_LOG_DROPPED, 1);
+      if(lvl==LOG_ERROR) { vfprintf(stderr, fmt, ap); }
+      va_end(ap);
+      return;
+    } else {
+      pos=theLogHead;
+    }
+  }
+
+  //
+  // format in place and publish it to the writer
+  //
+  int len=vsnprintf(slot->text, LOG_SLOT_TEXT, fmt, ap);
+  va_end(ap);
+  if(len<0) {
+    len=0;
+  } else if(len>=LOG_SLOT_TEXT) {
+    len=LOG_SLOT_TEXT-1;
+    slot->text[len-1]='\n';                   // keep truncated messages one per line
+  }
+  slot->len=len;
+  if(lvl==LOG_ERROR && theLogFile!=stderr) { fwrite(slot->text, 1, len, stderr); }
+  LOG_BARRIER();
+  slot->seq=pos+1;
+}
+
+//
+// Wait until everything logged before the call has been written
+//
+void logFlush() {
+  if(!theLogFile) { return; }
+  long until=theLogHead;
+  for(int i=0;i<1000 && theLogTail-until<0;i++) { Sleep(1); }
+}
+
+//
+// Rotate the log file (name as opened by the caller) once it reaches maxBytes and/or at
+// every hours wall clock boundary, keeping keep old files.  Call after logInit().
+//
+void logSetRotation(const char *name, long long maxBytes, int hours, int keep, int compress) {
+  if(!name || !strcmp(name,"stdout") || !strcmp(name,"stderr")) { return; }
+  if(!maxBytes && hours<=0) { return; }
+  theLogKeep=keep>0 ? keep : 1;
+  theLogMaxBytes=maxBytes;
+  theLogHours=hours>0 ? hours : 0;
+  if(theLogHours) { theLogNextRotate=log_next_boundary(time(0)); }
+#ifdef __LINUX__
+  theLogCompress=compress;
+  if(compress) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, log_compressor, NULL);
+    pthread_detach(tid);
+  }
+#else
+  if(compress) { fprintf(stderr,"LOG_COMPRESS is not supported on Windows\n"); }
+#endif
+  LOG_BARRIER();
+  theLogName=strdup(name);                   // the writer starts rotating once this is set
+}
+
+void logSetLevel(int sub, int lvl) {
+  theLogConfigured[sub]=lvl;
+  theLogLevel[sub]=lvl;
+}
+
+void logBoost(bool on) {
+  for(int i=0;i<LOG_SUBSYSTEMS;i++) { theLogLevel[i]=on ? LOG_DEBUG : theLogConfigured[i]; }
+}
+
+//
+// "ERROR", "WARN", "INFO", "DEBUG" or "OFF" (any case).  Returns -2 if not recognized.
+//
+int logLevelParse(const char *s) {
+#ifdef __LINUX__
+  if(!strcasecmp(s, "OFF")) { return LOG_OFF; }
+  for(int i=0;i<=LOG_DEBUG;i++) { if(!strcasecmp(s, LOG_LEVEL_NAMES[i])) { return i; } }
+#else
+  if(!_stricmp(s, "OFF")) { return LOG_OFF; }
+  for(int i=0;i<=LOG_DEBUG;i++) { if(!_stricmp(s, LOG_LEVEL_NAMES[i])) { return i; } }
+#endif
+  return -2;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _LOGH
+#define _LOGH
+
+#include <stdio.h>
+
+//
+// Subsystems with their own runtime log level
+//
+#define LOG_MAIN        0
+#define LOG_MQTT        1
+#define LOG_FLICD       2
+#define LOG_CONFIG      3
+#define LOG_SUBSYSTEMS  4
+
+static const char *LOG_SUBSYSTEM_NAMES[]={"MAIN", "MQTT", "FLICD", "CONFIG"};
+
+//
+// Levels.  A subsystem logs everything at or below its level.  LOG_OFF silences it.
+//
+#define LOG_OFF        -1
+#define LOG_ERROR       0   // also echoed to stderr straight away
+#define LOG_WARN        1
+#define LOG_INFO        2
+#define LOG_DEBUG       3
+
+static const char *LOG_LEVEL_NAMES[]={"ERROR", "WARN", "INFO", "DEBUG"};
+
+extern int volatile theLogLevel[LOG_SUBSYSTEMS];
+
+#ifdef __LINUX__
+#define LOG_UNLIKELY(x) __builtin_expect(!!(x),0)
+#else
+#define LOG_UNLIKELY(x) (x)
+#endif
+
+//
+// A disabled message costs one compare against theLogLevel.  Arguments are not evaluated.
+//
+#define LOG_ENABLED(sub, lvl) LOG_UNLIKELY((lvl)<=theLogLevel[sub])
+#define LOG(sub, lvl, ...) do { if(LOG_ENABLED(sub, lvl)) { logWrite(sub, lvl, __VA_ARGS__); } } while(0)
+
+extern void logInit(FILE *f);
+extern void logWrite(int sub, int lvl, const char *fmt, ...);
+extern void logFlush();
+extern void logSetRotation(const char *name, long long maxBytes, int hours, int keep, int compress);
+extern void logShiftFiles(const char *name, int keep);
+extern void logSetLevel(int sub, int lvl);
+extern void logBoost(bool on);
+extern int logLevelParse(const char *s);
+
+#endif
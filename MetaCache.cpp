@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Button metadata cache.  Fixed size records in a memory mapped file (header in record 0)
+// with an in memory Bdaddr -> record index built at open.  Written by the flicd reader
+// thread as answers arrive, read by the main thread when it publishes.  Without a file
+// (no META_CACHE, or Windows) the same records live on the heap and die with the process.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unordered_map>
+#include "global.h"
+#include "MetaCache.h"
+#include "Log.h"
+
+using namespace std;
+
+#define META_GROW 256                         // records added each time the file fills
+
+static uint8_t *theMetaMap=0;
+static size_t theMetaMapped=0;
+static unordered_map<uint64_t, uint32_t> theMetaIndex;
+
+#define META_HEADER ((MetaHeader *)theMetaMap)
+#define META_RECORD(n) ((MetaRecord *)(theMetaMap+(size_t)(n)*sizeof(MetaRecord)))
+
+#ifdef __LINUX__
+static int theMetaFd=-1;
+static pthread_mutex_t theMetaLock=PTHREAD_MUTEX_INITIALIZER;
+static void meta_lock()   { pthread_mutex_lock(&theMetaLock);   }
+static void meta_unlock() { pthread_mutex_unlock(&theMetaLock); }
+#else
+static CRITICAL_SECTION theMetaLock;
+static void meta_lock()   { EnterCriticalSection(&theMetaLock); }
+static void meta_unlock() { LeaveCriticalSection(&theMetaLock); }
+#endif
+
+static uint64_t meta_now_ms() {
+  return (uint64_t)time(0)*1000;
+}
+
+//
+// Make room for bytes, in whole META_GROW chunks.  New space reads as zero.
+//
+static int meta_map(size_t bytes) {
+  if(bytes<=theMetaMapped) { return 0; }
+  size_t chunk=META_GROW*sizeof(MetaRecord);
+  size_t want=(bytes+chunk-1)/chunk*chunk;
+#ifdef __LINUX__
+  if(theMetaFd>=0) {
+    if(ftruncate(theMetaFd, want)) { LOG(LOG_MAIN, LOG_ERROR, "meta cache grow: %s\n", strerror(errno)); return -1; }
+    if(theMetaMap) { munmap(theMetaMap, theMetaMapped); }
+    theMetaMap=(uint8_t*)mmap(0, want, PROT_READ|PROT_WRITE, MAP_SHARED, theMetaFd, 0);
+    if(theMetaMap==MAP_FAILED) {
+      LOG(LOG_MAIN, LOG_ERROR, "meta cache mmap: %s\n", strerror(errno));
+      theMetaMap=0;
+      theMetaMapped=0;
+      return -1;
+    }
+    theMetaMapped=want;
+    return 0;
+  }
+#endif
+  uint8_t *grown=(uint8_t*)realloc(theMetaMap, want);
+  if(!grown) { return -1; }
+  memset(grown+theMetaMapped, 0, want-theMetaMapped);
+  theMetaMap=grown;
+  theMetaMapped=want;
+  return 0;
+}
+
+//
+// Open (or create) the cache at path, 0 to keep it in memory only.  A file that is not a
+// cache this version understands is started over; it only holds what flicd will tell us
+// again.  Returns the number of buttons loaded.
+//
+int metaOpen(const char *path) {
+  size_t size=0;
+#ifdef __LINUX__
+  struct stat st;
+  if(path) {
+    theMetaFd=open(path, O_RDWR|O_CREAT, 0644);
+    if(theMetaFd<0 || fstat(theMetaFd,&st)) {
+      LOG(LOG_MAIN, LOG_ERROR, "Can not open meta cache %s: %s, keeping it in memory\n", path, strerror(errno));
+      if(theMetaFd>=0) { close(theMetaFd); }
+      theMetaFd=-1;
+    } else {
+      size=st.st_size;
+    }
+  }
+#else
+  InitializeCriticalSection(&theMetaLock);
+#endif
+  if(meta_map(size ? size : sizeof(MetaHeader))) { return 0; }
+  MetaHeader *hdr=META_HEADER;
+  if(size && (memcmp(hdr->magic, META_MAGIC, 8) || hdr->recordSize!=sizeof(MetaRecord) ||
+              (size_t)(hdr->count+1)*sizeof(MetaRecord)>size)) {
+    LOG(LOG_MAIN, LOG_WARN, "%s is not a meta cache this version understands, starting over\n", path);
+    size=0;
+  }
+  if(!size) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, META_MAGIC, 8);
+    hdr->recordSize=sizeof(MetaRecord);
+  }
+  for(uint32_t i=1;i<=hdr->count;i++) {
+    theMetaIndex[META_RECORD(i)->bdaddr]=i;
+  }
+  LOG(LOG_MAIN, LOG_INFO, "Meta cache %s: %u buttons\n", path ? path : "(memory)", hdr->count);
+  return (int)hdr->count;
+}
+
+//
+// "xx:xx:xx:xx:xx:xx" to the Bdaddr key
+//
+uint64_t metaKey(const char *mac) {
+  uint64_t k=0;
+  for(;mac && *mac;mac++) {
+    char c=*mac;
+    if(c>='0' && c<='9')      { k=(k<<4)|(c-'0');    }
+    else if(c>='a' && c<='f') { k=(k<<4)|(c-'a'+10); }
+    else if(c>='A' && c<='F') { k=(k<<4)|(c-'A'+10); }
+  }
+  return k;
+}
+
+bool metaGet(uint64_t bdaddr, MetaRecord *out) {
+  bool found=false;
+  meta_lock();
+  unordered_map<uint64_t, uint32_t>::iterator it=theMetaIndex.find(bdaddr);
+  if(theMetaMap && it!=theMetaIndex.end()) {
+    *out=*META_RECORD(it->second);
+    found=true;
+  }
+  meta_unlock();
+  return found;
+}
+
+//
+// Find or add the record for bdaddr.  Called locked; 0 if the cache could not grow.
+//
+static MetaRecord *meta_record(uint64_t bdaddr) {
+  unordered_map<uint64_t, uint32_t>::iterator it=theMetaIndex.find(bdaddr);
+  if(it!=theMetaIndex.end()) { return META_RECORD(it->second); }
+  if(!theMetaMap) { return 0; }
+  uint32_t n=META_HEADER->count+1;
+  if(meta_map((size_t)(n+1)*sizeof(MetaRecord))) { return 0; }
+  MetaRecord *rec=META_RECORD(n);
+  memset(rec, 0, sizeof(*rec));
+  rec->bdaddr=bdaddr;
+  META_HEADER->count=n;
+  theMetaIndex[bdaddr]=n;
+  return rec;
+}
+
+//
+// Store a getButtonInfo answer.  The verified flag is left as getInfo last set it.
+//
+void metaPut(const MetaRecord *rec) {
+  meta_lock();
+  MetaRecord *to=meta_record(rec->bdaddr);
+  if(to) {
+    uint8_t verified=to->verified;
+    *to=*rec;
+    to->verified=verified;
+    to->refreshedMs=meta_now_ms();
+  }
+  meta_unlock();
+}
+
+//
+// flicd's verified list from getInfo.  Buttons not in it are marked unverified.
+//
+void metaVerified(const uint64_t *bdaddrs, int count) {
+  meta_lock();
+  for(uint32_t i=1;theMetaMap && i<=META_HEADER->count;i++) {
+    META_RECORD(i)->verified=0;
+  }
+  for(int i=0;i<count;i++) {
+    MetaRecord *rec=meta_record(bdaddrs[i]);
+    if(rec) { rec->verified=1; }
+  }
+  meta_unlock();
+}
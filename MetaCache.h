@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _METACACHEH
+#define _METACACHEH
+
+#include <stdint.h>
+
+//
+// What flicd has told us about each button (getButtonInfo answers and the verified list
+// from getInfo), keyed by Bdaddr.  Kept in a memory mapped file so a restart can publish
+// it straight away and only refresh it in the background.
+//
+#define META_MAGIC         "F2MMETA1"
+
+struct MetaRecord {
+  uint64_t bdaddr;              // 48 bit address, xx:xx:xx:xx:xx:xx read as one hex number
+  uint64_t refreshedMs;         // wall clock of the last getButtonInfo answer, 0 never asked
+  uint32_t firmware;
+  uint8_t  flicVersion;
+  uint8_t  verified;            // in flicd's verified list at the last getInfo
+  uint8_t  known;               // flicd answered with details (it does not for unverified buttons)
+  uint8_t  unused;
+  uint8_t  uuid[16];
+  char     color[17];
+  char     serial[17];
+  char     pad[6];
+};
+
+struct MetaHeader {
+  char     magic[8];
+  uint32_t recordSize;
+  uint32_t count;               // records in use
+  char     unused[sizeof(MetaRecord)-16];
+};
+
+static_assert(sizeof(MetaRecord)==80, "meta records are 80 bytes on disk");
+static_assert(sizeof(MetaHeader)==sizeof(MetaRecord), "header fills record 0");
+
+extern int metaOpen(const char *path);
+extern uint64_t metaKey(const char *mac);
+extern bool metaGet(uint64_t bdaddr, MetaRecord *out);
+extern void metaPut(const MetaRecord *rec);
+extern void metaVerified(const uint64_t *bdaddrs, int count);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ * 
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#else
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include "global.h"
+#include "Metrics.h"
+
+static long long volatile theMetrics[METRIC_COUNT];
+
+void metricAdd(int id, long long v) {
+#ifdef __LINUX__
+  __sync_fetch_and_add(&theMetrics[id],v);
+#else
+  InterlockedExchangeAdd64(&theMetrics[id],v);
+#endif
+}
+
+void metricSet(int id, long long v) {
+#ifdef __LINUX__
+  __sync_lock_test_and_set(&theMetrics[id],v);
+#else
+  InterlockedExchange64(&theMetrics[id],v);
+#endif
+}
+
+void metricMax(int id, long long v) {
+  long long old;
+  for(old=theMetrics[id];v>old;old=theMetrics[id]) {
+#ifdef __LINUX__
+    if(__sync_bool_compare_and_swap(&theMetrics[id],old,v)) { return; }
+#else
+    if(InterlockedCompareExchange64(&theMetrics[id],v,old)==old) { return; }
+#endif
+  }
+}
+
+long long metricGet(int id) { return theMetrics[id]; }
+
+//
+// Render all metrics as a flat json object.  Returns length written.
+//
+int metricFormat(char *buf, int sz) {
+  int len=0;
+  len+=snprintf(buf+len,sz-len,"{");
+  for(int i=0;i<METRIC_COUNT && len<sz;i++) {
+    len+=snprintf(buf+len,sz-len,"%s\"%s\":%lld",i?",":"",METRIC_NAMES[i],theMetrics[i]);
+  }
+  if(len<sz) { len+=snprintf(buf+len,sz-len,"}"); }
+  if(len>=sz) { len=sz-1; }
+  return len;
+}
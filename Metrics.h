@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ * 
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _METRICSH
+#define _METRICSH
+
+//
+// Process wide counters and gauges.  Any thread may update them.  They are
+// published as one document to {base}/metrics by the main thread.
+//
+#define METRIC_FLICD_RELINKS             0   // number of times the flicd link was re-established
+#define METRIC_FLICD_RESYNC_MS           1   // time from link loss to all channels re-created (last relink)
+#define METRIC_FLICD_RESYNC_MAXMS        2   // worst resync seen
+#define METRIC_FLICD_CONNECT_READY_MS    3   // connect command to channel Ready (last channel)
+#define METRIC_FLICD_CONNECT_READY_MAXMS 4
+#define METRIC_FLICD_REQUEST_TIMEOUTS    5   // flicd requests that never got an answer
+#define METRIC_FLICD_RTT_US              6   // last flicd ping round trip
+#define METRIC_FLICD_PING_MISSES         7   // pings flicd never answered
+#define METRIC_FLICD_BAD_PACKETS         8   // flicd packets the decoder rejected
+#define METRIC_LOG_DROPPED               9   // log messages lost because the log writer fell behind
+#define METRIC_LOG_BYTES                10   // bytes written to the log file
+#define METRIC_LOG_ROTATIONS            11   // log files rotated while running
+#define METRIC_MQTT_UNCHANGED           12   // cached values not published because they had not changed
+#define METRIC_MQTT_REPUBLISHED         13   // cached values sent again after the broker connection came back
+#define METRIC_BUTTON_DISCONNECTS       14   // buttons that dropped off the radio after being Ready
+#define METRIC_PRESENCE_ADVERTS         15   // scanner advertisements taken into the presence table
+#define METRIC_PRESENCE_DROPPED         16   // advertisements from new buttons ignored as the table was full
+#define METRIC_BUTTON_THROTTLED         17   // button events dropped by the RATE_BURST/RATE_PER_MINUTE limit
+#define METRIC_BUTTON_REPAIRS           18   // impossible button sequences (lost up, stuck hold...) straightened out
+#define METRIC_PROC_CPU_US              19   // process cpu time, user+sys (see Resource.h)
+#define METRIC_PROC_MAX_RSS_KB          20   // peak resident set
+#define METRIC_PROC_CTX_SWITCHES        21   // voluntary+involuntary context switches
+#define METRIC_PROC_FDS                 22   // open descriptors (handles on Windows)
+#define METRIC_PROC_THREADS             23
+#define METRIC_PROC_CPU_US_PER_EVENT    24   // cpu per event handled, last sample interval
+#define METRIC_PROC_CSW_PER_KEVENT      25   // context switches per 1000 events handled, last sample interval
+#define METRIC_COUNT                    26
+
+static const char *METRIC_NAMES[]={"flicd_relinks",
+                                   "flicd_resync_ms",
+                                   "flicd_resync_max_ms",
+                                   "flicd_connect_ready_ms",
+                                   "flicd_connect_ready_max_ms",
+                                   "flicd_request_timeouts",
+                                   "flicd_rtt_us",
+                                   "flicd_ping_misses",
+                                   "flicd_bad_packets",
+                                   "log_dropped",
+                                   "log_bytes",
+                                   "log_rotations",
+                                   "mqtt_unchanged",
+                                   "mqtt_republished",
+                                   "button_disconnects",
+                                   "presence_adverts",
+                                   "presence_dropped",
+                                   "button_throttled",
+                                   "button_repairs",
+                                   "proc_cpu_us",
+                                   "proc_max_rss_kb",
+                                   "proc_ctx_switches",
+                                   "proc_fds",
+                                   "proc_threads",
+                                   "proc_cpu_us_per_event",
+                                   "proc_csw_per_kevent"};
+
+extern void metricAdd(int id, long long v);
+extern void metricSet(int id, long long v);
+extern void metricMax(int id, long long v);
+extern long long metricGet(int id);
+extern int metricFormat(char *buf, int sz);
+
+#endif
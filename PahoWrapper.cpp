@@ -20,6 +20,13 @@
 #include "global.h"
 #include "Config.h"
 #include "PahoWrapper.h"
+#include "Log.h"
+#include "Journal.h"
+#include "Metrics.h"
+#include "TimeFormat.h"
+#include "Sequence.h"
+#include "Watchdog.h"
+#include "Trace.h"
 
 extern "C" {
   //
@@ -27,23 +34,37 @@ extern "C" {
   //
   static void _pahoOnConnLost(void *context, char *cause)                           { ((PahoWrapper*)(context))->pahoOnConnLost(cause);          }
   static void _pahoOnConnectFailure(void* context, MQTTAsync_failureData* response) { ((PahoWrapper*)(context))->pahoOnConnectFailure(response); }
-  static void _pahoOnSendFailure(void* context, MQTTAsync_failureData* response)    { ((PahoWrapper*)(context))->pahoOnSendFailure(response);    }
+  static void _pahoOnSendFailure(void* context, MQTTAsync_failureData* response)    { ((PahoSendContext*)(context))->paho->pahoOnSendFailure((PahoSendContext*)context, response); }
   static void _pahoOnConnect(void* context, MQTTAsync_successData* response)        { ((PahoWrapper*)(context))->pahoOnConnect(response);        }
-  static void _pahoOnSend(void* context, MQTTAsync_successData* response)           { ((PahoWrapper*)(context))->pahoOnSend(response);           }
+  static void _pahoOnSend(void* context, MQTTAsync_successData* response)           { ((PahoSendContext*)(context))->paho->pahoOnSend((PahoSendContext*)context, response); }
+  static void _pahoOnDisconnect(void* context, MQTTAsync_successData* response)     { ((PahoWrapper*)(context))->pahoOnDisconnect(response);     }
 }
 
 LONG PahoWrapper::getOutstanding() { return pahoOutstanding; }
 bool PahoWrapper::isUp()           { return pahoUp;          }
 
-PahoWrapper::PahoWrapper(Config *config) {
+PahoWrapper::PahoWrapper(Config *config, void (*notify)()) {
   pahoClient=0;
   pahoOutstanding=0;
   pahoUp=false;
-  logfile=config->getLogfile();
-  mqttServer=config->getMqttServer();
-#ifdef DEBUG_PRINT_MQTT
-  if(logfile) { fprintf(logfile,"MQTT Server: %s\n",mqttServer); }
-#endif
+  pahoConnecting=false;
+  connectMs=0;
+  connectNotify=notify;
+  sendNext=0;
+  for(int i=0;i<PAHO_SEND_CONTEXTS;i++) {
+    sendContexts[i].paho=this;
+    sendContexts[i].busy=0;
+    sendContexts[i].journalSeq=0;
+  }
+  sendOverflow.paho=this;
+  sendOverflow.busy=1;
+  sendOverflow.journalSeq=0;
+  available[0]=0;
+  for(int i=0;i<FLICD_MODES;i++) { flicdCache[i][0]=0; }
+  payloadEvent=config->getPayloadEvent();
+  snprintf(source,sizeof(source),"%s:%d",config->getFlicdServer(),config->getFlicdPort());
+  mqttServer=strdup(config->getMqttServer());
+  LOG(LOG_MQTT, LOG_INFO, "MQTT Server: %s\n",mqttServer);
 
   //
   // Load enough config info to know the LWT
@@ -51,70 +72,267 @@ PahoWrapper::PahoWrapper(Config *config) {
   const char *base=config->getMqttTopicBase();
   topicLWT=(char*)malloc(strlen(base)+20);
   sprintf(topicLWT,"%s/LWT",base);
-#ifdef DEBUG_PRINT_MQTT
-  if(logfile) { fprintf(logfile,"LWT=%s\n",topicLWT); }
-#endif
+  LOG(LOG_MQTT, LOG_INFO, "LWT=%s\n",topicLWT);
+  topicFlicdLink=(char*)malloc(strlen(base)+20);
+  topicFlicdResync=(char*)malloc(strlen(base)+20);
+  topicMetrics=(char*)malloc(strlen(base)+20);
+  topicFlicdRtt=(char*)malloc(strlen(base)+20);
+  topicFlicdController=(char*)malloc(strlen(base)+24);
+  topicFlicdSpace=(char*)malloc(strlen(base)+20);
+  topicPresence=(char*)malloc(strlen(base)+20);
+  topicWatchdog=(char*)malloc(strlen(base)+20);
+  topicResources=(char*)malloc(strlen(base)+20);
+  sprintf(topicFlicdLink,"%s/flicd/link",base);
+  sprintf(topicFlicdResync,"%s/flicd/resync",base);
+  sprintf(topicMetrics,"%s/metrics",base);
+  sprintf(topicFlicdRtt,"%s/flicd/rtt",base);
+  sprintf(topicFlicdController,"%s/flicd/controller",base);
+  sprintf(topicFlicdSpace,"%s/flicd/space",base);
+  sprintf(topicPresence,"%s/presence",base);
+  sprintf(topicWatchdog,"%s/watchdog",base);
+  sprintf(topicResources,"%s/resources",base);
 
   //
-  // connect
+  // start connecting.  Until it is up, sends are skipped and the cached values wait for republish()
   //
   reconnect();
   //
-  for(int i=0;i<8;i++) {
-    const char *name=config->getFlicName(i);
+  for(int i=0;i<config->getFlicCount();i++) {
+    setButton(i, config->getFlicName(i), config->getFlicTopic(i), config->getFlicGestures(i));
+  }
+}
+
+//
+// (Re)build the topics for one button slot.  name 0 empties the slot.
+//
+void PahoWrapper::setButton(int bno, const char *name, const char *topic, unsigned int gestures) {
+  if(bno>=(int)buttons.size()) {
+    PahoButton empty={0};
+    empty.seq=-1;
+    buttons.resize(bno+1, empty);
+  }
+  PahoButton &b=buttons[bno];
+  if(!name || !b.name || strcmp(name,b.name)) {
+    //
+    // a different button: what we knew about the old one does not apply
     //
+    for(int f=0;f<CACHE_FIELDS;f++) { b.cache[f][0]=0; }
+    if(b.meta) { free(b.meta); b.meta=0; }
+    b.seq=seqFind(name);
+  }
+  if(b.name)   { free(b.name);   b.name=0;   }
+  if(b.prefix) { free(b.prefix); b.prefix=0; }
+  for(int m=0;m<BUTT_MODES;m++) {
+    if(b.topic[m]) { free(b.topic[m]); b.topic[m]=0; }
+    if(name && (gestures&(1u<<m))) {
+      b.topic[m]=(char*)malloc(strlen(topic)+strlen(FLIC_GESTURE_NAMES[m])+2);
+      sprintf(b.topic[m],"%s/%s",topic,FLIC_GESTURE_NAMES[m]);
+    }
+  }
+  for(int f=CACHE_GESTURE;f<CACHE_FIELDS;f++) {
+    if(b.cacheTopic[f]) { free(b.cacheTopic[f]); b.cacheTopic[f]=0; }
     if(name) {
-      topicState[i]=(char*)malloc(strlen(base)+strlen(name)+20);
-      topicStateClick[i]=(char*)malloc(strlen(base)+strlen(name)+24);
-      topicStateHold[i]=(char*)malloc(strlen(base)+strlen(name)+24);
-      topicStateHoldUp[i]=(char*)malloc(strlen(base)+strlen(name)+24);
-      topicStateClickClick[i]=(char*)malloc(strlen(base)+strlen(name)+24);
-      topicStateClickHold[i]=(char*)malloc(strlen(base)+strlen(name)+24);
-      topicStateClickHoldUp[i]=(char*)malloc(strlen(base)+strlen(name)+24);
-      sprintf(topicState[i],"%s/%s/state",base,name);
-      sprintf(topicStateClick[i],"%s/%s/click",base,name);
-      sprintf(topicStateHold[i],"%s/%s/hold",base,name);
-      sprintf(topicStateHoldUp[i],"%s/%s/holdup",base,name);
-      sprintf(topicStateClickClick[i],"%s/%s/clickclick",base,name);
-      sprintf(topicStateClickHold[i],"%s/%s/clickhold",base,name);
-      sprintf(topicStateClickHoldUp[i],"%s/%s/clickholdup",base,name);
-      //
-#ifdef DEBUG_PRINT_MQTT
-      if(logfile) {
-        fprintf(logfile,"Button(%d): %s state=%s click=%s hold=%s holdup=%s clickclick=%s clickhold=%s clickholdup=%s\n",i,name,topicState[i],topicStateClick[i],topicStateHold[i],topicStateHoldUp[i],topicStateClickClick[i],topicStateClickHold[i],topicStateClickHoldUp[i]);
-      }
-#endif
-    } else {
-      topicState[i]=0;
-      topicStateClick[i]=0;
-      topicStateHold[i]=0;
-      topicStateHoldUp[i]=0;
-      topicStateClickClick[i]=0;
-      topicStateClickHold[i]=0;
-      topicStateClickHoldUp[i]=0;
+      b.cacheTopic[f]=(char*)malloc(strlen(topic)+strlen(CACHE_TOPICS[f])+2);
+      sprintf(b.cacheTopic[f],"%s/%s",topic,CACHE_TOPICS[f]);
     }
   }
+  b.cacheTopic[CACHE_PRESSED]=b.topic[BUTT_STATE];
+  //
+  if(name) {
+    b.name=strdup(name);
+    b.prefix=strdup(topic);
+    LOG(LOG_MQTT, LOG_INFO, "Button(%d): %s topic=%s gestures=0x%02x\n",bno,name,topic,gestures);
+  }
 }
 
-void PahoWrapper::writeState(int bno, int mode, const char *msg) {
+//
+// The config was reloaded.  tmpl belongs to the new config.
+//
+void PahoWrapper::setPayload(const PayloadTemplate *tmpl) {
+  payloadEvent=tmpl;
+}
+
+//
+// msg is On/Off for BUTT_STATE, otherwise the timestamp, which PAYLOAD_EVENT (if set)
+// replaces.  queued says flicd held the event back while the button was out of reach.
+// Every gesture takes the button's next sequence number and the next global one, shown
+// or not, so the numbering does not depend on the template.
+//
+void PahoWrapper::writeState(int bno, int mode, const char *msg, bool queued, uint64_t ms) {
+  //
+  // Gestures the button was not configured for are dropped here, before they are journaled
+  //
+  if(bno<0 || bno>=(int)buttons.size() || !buttons[bno].topic[mode]) { return; }
+  if(mode==BUTT_STATE && !strcmp(buttons[bno].cache[CACHE_PRESSED],msg)) {
+    metricAdd(METRIC_MQTT_UNCHANGED, 1);
+    return;
+  }
+  uint64_t gseq=0, seq=mode!=BUTT_STATE ? seqNext(buttons[bno].seq, &gseq) : 0;
+  if(mode!=BUTT_STATE && payloadEvent) {
+    PayloadFields f;
+    f.name=buttons[bno].name;
+    f.event=FLIC_GESTURE_NAMES[mode];
+    f.ms=ms ? ms : timeNowMs();
+    f.queued=queued;
+    f.source=source;
+    f.seq=seq;
+    f.gseq=gseq;
+    f.time=msg;
+    f.slot=bno;
+    payloadEvent->render(payload, sizeof(payload), f);
+    msg=payload;
+  }
+  unsigned int journalSeq=journalAppend(bno, buttons[bno].name, mode, msg);
   if(mode==BUTT_STATE) {
-    send(topicState[bno], 0, msg);
-  } else if(mode==BUTT_CLICK) {
-    send(topicStateClick[bno], 0, msg);
-  } else if(mode==BUTT_HOLD) {
-    send(topicStateHold[bno], 0, msg);
-  } else if(mode==BUTT_HOLD_UP) {
-    send(topicStateHoldUp[bno], 0, msg);
-  } else if(mode==BUTT_CLICKCLICK) {
-    send(topicStateClickClick[bno], 0, msg);
-  } else if(mode==BUTT_CLICKHOLD) {
-    send(topicStateClickHold[bno], 0, msg);
+    writeCached(bno, CACHE_PRESSED, msg, journalSeq);
   } else {
-    send(topicStateClickHoldUp[bno], 0, msg);
+    send(buttons[bno].topic[mode], 0, msg, journalSeq);
+    writeCached(bno, CACHE_GESTURE, FLIC_GESTURE_NAMES[mode]);
+  }
+}
+
+//
+// paced when it goes out for every button at once (flicd link down)
+//
+void PahoWrapper::writeConnection(int bno, const char *status, bool paced) {
+  if(paced) { sendWait(); }
+  writeCached(bno, CACHE_CONNECTION, status);
+}
+
+//
+// heartbeat sends the value even if it has not changed.  Paced, as heartbeats for every
+// button fall due together.
+//
+void PahoWrapper::writeBattery(int bno, int percent, bool heartbeat) {
+  char msg[16];
+  sprintf(msg,"%d",percent);
+  if(heartbeat && bno>=0 && bno<(int)buttons.size() && buttons[bno].name) {
+    sendWait();
+    buttons[bno].cache[CACHE_BATTERY][0]=0;
+  }
+  writeCached(bno, CACHE_BATTERY, msg);
+}
+
+//
+// What flicd knows about the button, as json.  Retained, and like the cached values only
+// sent when it changes and again on republish.
+//
+void PahoWrapper::writeMeta(int bno, const char *json) {
+  char topic[256];
+  if(bno<0 || bno>=(int)buttons.size() || !buttons[bno].name) { return; }
+  PahoButton &b=buttons[bno];
+  if(b.meta && !strcmp(b.meta,json)) {
+    metricAdd(METRIC_MQTT_UNCHANGED, 1);
+    return;
+  }
+  if(b.meta) { free(b.meta); }
+  b.meta=strdup(json);
+  snprintf(topic,sizeof(topic),"%s/meta",b.prefix);
+  sendWait();
+  send(topic, 1, b.meta);
+}
+
+//
+// One off (not retained, not cached) message to {prefix}/suffix for a button.  Paced, as these
+// tend to go out for every button at once.
+//
+void PahoWrapper::writeButton(int bno, const char *suffix, const char *msg) {
+  char topic[256];
+  if(bno<0 || bno>=(int)buttons.size() || !buttons[bno].name) { return; }
+  snprintf(topic,sizeof(topic),"%s/%s",buttons[bno].prefix,suffix);
+  sendWait();
+  send(topic, 0, msg);
+}
+
+//
+// Publish (retained) a cached value if it differs from the last one.  The cache is updated even
+// when the broker is down so the value goes out with the republish once it is back.
+//
+void PahoWrapper::writeCached(int bno, int field, const char *value, unsigned int journalSeq) {
+  if(bno<0 || bno>=(int)buttons.size() || !buttons[bno].name) { return; }
+  PahoButton &b=buttons[bno];
+  if(!strncmp(b.cache[field],value,CACHE_VALUE_SIZE-1)) {
+    metricAdd(METRIC_MQTT_UNCHANGED, 1);
+    return;
+  }
+  snprintf(b.cache[field],CACHE_VALUE_SIZE,"%s",value);
+  send(b.cacheTopic[field], 1, b.cache[field], journalSeq);
+}
+
+//
+// Pace bulk sends: block until fewer than PAHO_REPUBLISH_WINDOW messages are in flight (or 2s pass)
+//
+void PahoWrapper::sendWait() {
+  for(int ms=0;pahoUp && pahoOutstanding>=PAHO_REPUBLISH_WINDOW && ms<2000;ms++) { Sleep(1); }
+}
+
+//
+// The broker connection is back (main thread, after connectNotify).  It may have lost its
+// retained messages (and subscribers what they knew) so send everything we know again in one
+// burst, paced so the in flight count stays under the send contexts.
+//
+void PahoWrapper::republish() {
+  int sent=0;
+  if(!pahoUp) { return; }
+  if(available[0]) { send(topicLWT, 1, available);      sent++; }
+  if(flicdCache[FLICD_LINK][0])       { send(topicFlicdLink, 1, flicdCache[FLICD_LINK]);             sent++; }
+  if(flicdCache[FLICD_CONTROLLER][0]) { send(topicFlicdController, 1, flicdCache[FLICD_CONTROLLER]); sent++; }
+  if(flicdCache[FLICD_SPACE][0])      { send(topicFlicdSpace, 1, flicdCache[FLICD_SPACE]);           sent++; }
+  for(int i=0;i<(int)buttons.size() && pahoUp;i++) {
+    PahoButton &b=buttons[i];
+    for(int f=0;f<CACHE_FIELDS && b.name;f++) {
+      if(!b.cache[f][0] || !b.cacheTopic[f]) { continue; }
+      sendWait();
+      if(!pahoUp) { break; }
+      send(b.cacheTopic[f], 1, b.cache[f]);
+      sent++;
+    }
+    if(b.name && b.meta && pahoUp) {
+      char topic[256];
+      snprintf(topic,sizeof(topic),"%s/meta",b.prefix);
+      sendWait();
+      send(topic, 1, b.meta);
+      sent++;
+    }
+  }
+  metricAdd(METRIC_MQTT_REPUBLISHED, sent);
+  LOG(LOG_MQTT, LOG_INFO, "PAHO - Republished %d cached values\n", sent);
+}
+
+void PahoWrapper::writeFlicd(int mode, const char *msg) {
+  if(mode==FLICD_LINK || mode==FLICD_CONTROLLER || mode==FLICD_SPACE) {
+    //
+    // availability: retained and only sent when it changes
+    //
+    if(!strcmp(flicdCache[mode],msg)) {
+      metricAdd(METRIC_MQTT_UNCHANGED, 1);
+      return;
+    }
+    snprintf(flicdCache[mode],sizeof(flicdCache[mode]),"%s",msg);
+  }
+  if(mode==FLICD_LINK) {
+    send(topicFlicdLink, 1, msg);
+  } else if(mode==FLICD_CONTROLLER) {
+    send(topicFlicdController, 1, msg);
+  } else if(mode==FLICD_SPACE) {
+    send(topicFlicdSpace, 1, msg);
+  } else if(mode==FLICD_RESYNC) {
+    send(topicFlicdResync, 0, msg);
+  } else if(mode==FLICD_RTT) {
+    send(topicFlicdRtt, 0, msg);
+  } else if(mode==FLICD_PRESENCE) {
+    send(topicPresence, 0, msg);
+  } else if(mode==FLICD_WATCHDOG) {
+    send(topicWatchdog, 1, msg);
+  } else if(mode==FLICD_RESOURCES) {
+    send(topicResources, 0, msg);
+  } else {
+    send(topicMetrics, 0, msg);
   }
 }
 
 void PahoWrapper::markAvailable(bool avail) {
+  strcpy(available, avail ? "Online" : "Offline");
   if(avail) {
     send(topicLWT, 1, "Online");
   } else {
@@ -122,13 +340,26 @@ void PahoWrapper::markAvailable(bool avail) {
   }
 }
 
-void PahoWrapper::send(const char *topic, int retain, const char *msg) {
-#ifdef DEBUG_PRINT_MQTT
-  if(logfile) { 
-    fprintf(logfile,"PAHO - Writing retain=%d message '%s' to topic '%s'\n", retain, msg, topic); 
-    fflush(logfile);
-  }
+//
+// Claim a free completion context.  Only the main thread sends; paho's threads release.
+//
+PahoSendContext *PahoWrapper::sendContextGet() {
+  for(int i=0;i<PAHO_SEND_CONTEXTS;i++) {
+    PahoSendContext *ctx=&sendContexts[(sendNext+i)%PAHO_SEND_CONTEXTS];
+    if(ctx->busy) { continue; }
+#ifdef __LINUX__
+    if(!__sync_bool_compare_and_swap(&ctx->busy,0,1)) { continue; }
+#else
+    if(InterlockedCompareExchange(&ctx->busy,1,0)!=0) { continue; }
 #endif
+    sendNext=(sendNext+i+1)%PAHO_SEND_CONTEXTS;
+    return ctx;
+  }
+  return &sendOverflow;
+}
+
+void PahoWrapper::send(const char *topic, int retain, const char *msg, unsigned int journalSeq) {
+  LOG(LOG_MQTT, LOG_DEBUG, "PAHO - Writing retain=%d message '%s' to topic '%s'\n", retain, msg, topic);
   //
   // https://eclipse.dev/paho/files/mqttdoc/MQTTAsync/html/publish.html
   //
@@ -137,7 +368,17 @@ void PahoWrapper::send(const char *topic, int retain, const char *msg) {
   int rc;
   opts.onSuccess = _pahoOnSend;
   opts.onFailure = _pahoOnSendFailure;
-  opts.context = (void*)this;
+  if(pahoConnecting || !pahoClient) {
+    //
+    // nothing to send on yet: cached values go out with the republish, events are lost
+    //
+    LOG(LOG_MQTT, LOG_DEBUG, "PAHO - Not connected, dropped message to topic '%s'\n", topic);
+    journalAck(journalSeq, JOURNAL_FAILED);
+    return;
+  }
+  PahoSendContext *ctx=sendContextGet();
+  ctx->journalSeq=(ctx==&sendOverflow) ? 0 : journalSeq;
+  opts.context = (void*)ctx;
   pubmsg.payload = (void*)msg;
   pubmsg.payloadlen = strlen(msg);
   pubmsg.qos = 1;
@@ -147,32 +388,55 @@ void PahoWrapper::send(const char *topic, int retain, const char *msg) {
 #else
   InterlockedIncrement(&pahoOutstanding);
 #endif
-  if ((rc = MQTTAsync_sendMessage(pahoClient, topic, &pubmsg, &opts)) != MQTTASYNC_SUCCESS) {
+  watchdogIn(WD_PAHO);
+  watchdogIn(WD_PUBLISH);
+  uint64_t t0=TRACE_ON() ? traceNow() : 0;
+  ctx->traceId=(t0 && ctx!=&sendOverflow) ? traceNextId() : 0;
+  if(ctx->traceId) { traceFlow(TRACE_ACK, 'b', ctx->traceId); }
+  rc = MQTTAsync_sendMessage(pahoClient, topic, &pubmsg, &opts);
+  if(t0) { traceSpan(TRACE_SEND, t0); }
+  watchdogOut(WD_PUBLISH);
+  if (rc != MQTTASYNC_SUCCESS) {
+    if(ctx->traceId) { traceFlow(TRACE_ACK, 'e', ctx->traceId, 0); }
+    watchdogOut(WD_PAHO);
     pahoUp=false;
-    fprintf(stderr,"PAHO_ERROR - Failed to start sendMessage, return code %d (%s : %s)\n", rc,topic,msg);
-#ifdef DEBUG_PRINT_MQTT
-    if(logfile && logfile!=stderr) {
-      fprintf(logfile,"PAHO_ERROR - Failed to start sendMessage, return code %d (%s: %s)\n", rc,topic,msg);
-    }
-#endif
+    LOG(LOG_MQTT, LOG_ERROR, "PAHO_ERROR - Failed to start sendMessage, return code %d (%s : %s)\n", rc,topic,msg);
+    journalAck(journalSeq, JOURNAL_FAILED);
+    if(ctx!=&sendOverflow) { ctx->busy=0; }
   }
 }
 
+//
+// Start a fresh connection to the broker and return straight away; the main thread carries on
+// with the flicd events meanwhile.  pahoOnConnect calls connectNotify, which gets the main
+// thread to republish().  Does nothing while an attempt is still running.
+//
 void PahoWrapper::reconnect() {
   MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
   MQTTAsync_willOptions will_opts= MQTTAsync_willOptions_initializer;
   int rc;
+  uint64_t now=timeNowMs();
+  if(pahoConnecting && now-connectMs<(PAHO_CONNECT_TIMEOUT+5)*1000) { return; }
   //
   // https://eclipse.dev/paho/files/mqttdoc/MQTTAsync/html/publish.html
   //
   if(pahoClient) { 
     MQTTAsync_destroy(&pahoClient); 
     pahoClient=0; 
-    Sleep(1000); 
+    //
+    // messages still in flight died with the client; their callbacks never come
+    //
+    for(int i=0;i<PAHO_SEND_CONTEXTS;i++) {
+      if(sendContexts[i].busy) {
+        journalAck(sendContexts[i].journalSeq, JOURNAL_FAILED);
+        sendContexts[i].busy=0;
+      }
+    }
   }
   MQTTAsync_create(&pahoClient, mqttServer, "Flic2MQTT/1.0", MQTTCLIENT_PERSISTENCE_NONE, NULL);
   MQTTAsync_setCallbacks(pahoClient, NULL, _pahoOnConnLost, NULL, NULL);
   conn_opts.keepAliveInterval = 20;
+  conn_opts.connectTimeout = PAHO_CONNECT_TIMEOUT;
   conn_opts.cleansession = 1;
   conn_opts.onSuccess = _pahoOnConnect;
   conn_opts.onFailure = _pahoOnConnectFailure;
@@ -183,92 +447,112 @@ void PahoWrapper::reconnect() {
   will_opts.retained=1;
   conn_opts.will = &will_opts;
   pahoUp=false;
+  pahoConnecting=true;
+  connectMs=now;
   if ((rc = MQTTAsync_connect(pahoClient, &conn_opts)) == MQTTASYNC_SUCCESS) {
-    for(int i=0;i<5;i++) {
-      if(!pahoUp) { 
-        Sleep(1000); 
-#ifdef DEBUG_PRINT_MQTT
-    if(logfile) { fprintf(logfile, "PAHO - Waiting for connection... %d/5\n", i+1); }
-#endif
-      }
-    }
+    LOG(LOG_MQTT, LOG_INFO, "PAHO - Connecting to %s\n", mqttServer);
   } else {
-    fprintf(stderr, "PAHO_ERROR - Failed to start connect, return code %d\n", rc);
-#ifdef DEBUG_PRINT_MQTT
-    if(logfile && logfile!=stderr) {
-      fprintf(logfile, "PAHO_ERROR - Failed to start connect, return code %d\n", rc);
+    pahoConnecting=false;
+    LOG(LOG_MQTT, LOG_ERROR, "PAHO_ERROR - Failed to start connect, return code %d\n", rc);
+  }
+}
+
+//
+// Stopping.  Give messages in flight up to drainMs to be acknowledged, say Offline ourselves
+// rather than leaving subscribers to wait out the keepalive for the will, and disconnect.
+// Returns how many messages were abandoned; flushed gets how many made it during the drain.
+//
+int PahoWrapper::shutdown(int drainMs, int *flushed) {
+  LONG before=pahoOutstanding;
+  for(int ms=0;pahoUp && pahoOutstanding>0 && ms<drainMs;ms+=10) { Sleep(10); }
+  LONG left=pahoOutstanding>0 ? pahoOutstanding : 0;
+  *flushed=before>left ? (int)(before-left) : 0;
+  if(pahoUp) {
+    writeFlicd(FLICD_LINK, "Offline");
+    markAvailable(false);
+    for(int ms=0;pahoUp && pahoOutstanding>left && ms<2000;ms+=10) { Sleep(10); }
+    MQTTAsync_disconnectOptions opts=MQTTAsync_disconnectOptions_initializer;
+    opts.timeout=1000;
+    opts.onSuccess=_pahoOnDisconnect;
+    opts.context=(void*)this;
+    if(MQTTAsync_disconnect(pahoClient, &opts)==MQTTASYNC_SUCCESS) {
+      for(int ms=0;pahoUp && ms<2000;ms+=10) { Sleep(10); }
     }
-#endif
   }
-  if(!pahoUp) {
-    fprintf(stderr, "PAHO_ERROR - Paho did not connect correctly after 5 seconds...\n", rc);
-#ifdef DEBUG_PRINT_MQTT
-    if(logfile && logfile!=stderr) {
-      fprintf(logfile, "PAHO_ERROR - Paho did not connect correctly after 5 seconds...\n", rc);
+  if(pahoClient) {
+    MQTTAsync_destroy(&pahoClient);
+    pahoClient=0;
+  }
+  for(int i=0;i<PAHO_SEND_CONTEXTS;i++) {
+    if(sendContexts[i].busy) {
+      journalAck(sendContexts[i].journalSeq, JOURNAL_FAILED);
+      sendContexts[i].busy=0;
     }
-#endif
   }
+  pahoUp=false;
+  pahoConnecting=false;
+  return (int)left;
+}
+
+void PahoWrapper::pahoOnDisconnect(MQTTAsync_successData* response) {
+  pahoUp=false;
+  LOG(LOG_MQTT, LOG_INFO, "PAHO - disconnected\n");
 }
 
 void PahoWrapper::pahoOnConnLost(char *cause) {
   pahoUp=false;
-  fprintf(stderr,"PAHO_ERROR - Connection Lost - cause %s\n", cause);
-#ifdef DEBUG_PRINT_MQTT
-    if(logfile && logfile!=stderr) {
-      fprintf(logfile, "PAHO_ERROR - Connection Lost - cause %s\n", cause);
-    }
-#endif
+  watchdogReset(WD_PAHO);
+  LOG(LOG_MQTT, LOG_ERROR, "PAHO_ERROR - Connection Lost - cause %s\n", cause);
 }
 
 void PahoWrapper::pahoOnConnectFailure(MQTTAsync_failureData* response) {
   pahoUp=false;
-  fprintf(stderr,"PAHO_ERROR - Connect failed, rc %d\n", response ? response->code : 0);
-#ifdef DEBUG_PRINT_MQTT
-    if(logfile && logfile!=stderr) {
-      fprintf(logfile, "PAHO_ERROR - Connect failed, rc %d\n", response ? response->code : 0);
-    }
-#endif
+  pahoConnecting=false;
+  LOG(LOG_MQTT, LOG_ERROR, "PAHO_ERROR - Connect failed, rc %d\n", response ? response->code : 0);
 }
 
-void PahoWrapper::pahoOnSendFailure(MQTTAsync_failureData* response) {
+void PahoWrapper::pahoOnSendFailure(PahoSendContext *ctx, MQTTAsync_failureData* response) {
   pahoUp=false;
-  fprintf(stderr,"PAHO_ERROR - Send failed, rc %d\n", response ? response->code : 0);
-#ifdef DEBUG_PRINT_MQTT
-    if(logfile && logfile!=stderr) {
-      fprintf(logfile, "PAHO_ERROR - Send failed, rc %d\n", response ? response->code : 0);
-    }
-#endif
+  LOG(LOG_MQTT, LOG_ERROR, "PAHO_ERROR - Send failed, rc %d\n", response ? response->code : 0);
+  journalAck(ctx->journalSeq, JOURNAL_FAILED);
+  if(ctx->traceId) {
+    traceThreadName("paho");
+    traceFlow(TRACE_ACK, 'e', ctx->traceId, 0);
+  }
+  if(ctx!=&sendOverflow) { ctx->busy=0; }
+  watchdogOut(WD_PAHO);
 }
 
 void PahoWrapper::pahoOnConnect(MQTTAsync_successData* response) {
   pahoOutstanding=0;
+  watchdogReset(WD_PAHO);
   pahoUp=true;
-#ifdef DEBUG_PRINT_MQTT
-  if(logfile) {
-    fprintf(logfile,"PAHO - onConnect complete\n");
-  }
-#endif
+  pahoConnecting=false;
+  LOG(LOG_MQTT, LOG_INFO, "PAHO - onConnect complete\n");
+  if(connectNotify) { connectNotify(); }
 }
 
-void PahoWrapper::pahoOnSend(MQTTAsync_successData* response)
+void PahoWrapper::pahoOnSend(PahoSendContext *ctx, MQTTAsync_successData* response)
 {
+  journalAck(ctx->journalSeq, JOURNAL_ACKED);
+  if(ctx->traceId) {
+    traceThreadName("paho");
+    traceFlow(TRACE_ACK, 'e', ctx->traceId, 1);
+  }
+  if(ctx!=&sendOverflow) { ctx->busy=0; }
+  watchdogOut(WD_PAHO);
 #ifdef __LINUX__
   __sync_fetch_and_sub(&pahoOutstanding,1);
 #else
   InterlockedDecrement(&pahoOutstanding);
 #endif
-  if(pahoOutstanding>16) {
-    pahoUp=false;
-    fprintf(stderr,"PAHO_ERROR - Outstanding Paho MQTT messages is high: %d\n", pahoOutstanding);
-#ifdef DEBUG_PRINT_MQTT
-    if(logfile && logfile!=stderr) {
-      fprintf(logfile,"PAHO_WARNING - Outstanding Paho MQTT messages is high: %d\n", pahoOutstanding);
-    }
-#endif
+  //
+  // a slow broker, not a dead one (that is connLost or a send failure), so only worth a note
+  //
+  if(pahoOutstanding>=PAHO_SEND_CONTEXTS) {
+    LOG(LOG_MQTT, LOG_WARN, "PAHO - Outstanding Paho MQTT messages is high: %d\n", pahoOutstanding);
   }
-#ifdef DEBUG_PRINT_MQTT
-  //if(logfile) { fprintf(logfile,"PAHO - onSend complete outstanding=%d\n",pahoOutstanding); }
-#endif
+  //LOG(LOG_MQTT, LOG_DEBUG, "PAHO - onSend complete outstanding=%d\n",pahoOutstanding);
 }
 
 
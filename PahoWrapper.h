@@ -16,42 +16,126 @@
 #define BUTT_CLICKCLICK   4
 #define BUTT_CLICKHOLD    5
 #define BUTT_CLICKHOLD_UP 6
+#define BUTT_MODES        7
+
+#define FLICD_LINK        0
+#define FLICD_RESYNC      1
+#define FLICD_METRICS     2
+#define FLICD_RTT         3
+#define FLICD_CONTROLLER  4   // bluetooth controller state (retained, on change)
+#define FLICD_SPACE       5   // Available/Full: room for more button connections (retained, on change)
+#define FLICD_PRESENCE    6   // presence snapshot json, see Presence.h
+#define FLICD_WATCHDOG    7   // stall report json (retained, on change), see Watchdog.h
+#define FLICD_RESOURCES   8   // process resource use json, see Resource.h
+#define FLICD_MODES       9
+
+//
+// Per button values kept so they are only published when they change and can be sent
+// again (retained) when the broker connection comes back
+//
+#define CACHE_PRESSED     0    // On/Off, on the state topic
+#define CACHE_GESTURE     1    // name of the last gesture
+#define CACHE_CONNECTION  2    // flicd connection status
+#define CACHE_BATTERY     3    // percent
+#define CACHE_FIELDS      4
+#define CACHE_VALUE_SIZE  32
+
+static const char *CACHE_TOPICS[]={"state", "gesture", "connection", "battery"};
+
+#define PAHO_SEND_CONTEXTS 64
+#define PAHO_REPUBLISH_WINDOW 8   // most republished messages in flight at once
+#define PAHO_CONNECT_TIMEOUT 10   // seconds paho gives a connect attempt before onFailure
+
+#include <vector>
+#include "Payload.h"
 
 class Config;
+class PahoWrapper;
+
+//
+// Per button topics, indexed by BUTT_xxx.  Gestures the button does not publish have no topic.
+// The pressed state is cached on topic[BUTT_STATE], the other cached values on cacheTopic.
+//
+struct PahoButton {
+  char *name;
+  char *prefix;                 // topic prefix, {base}/{name} unless the config says otherwise
+  char *topic[BUTT_MODES];
+  char *cacheTopic[CACHE_FIELDS];
+  char cache[CACHE_FIELDS][CACHE_VALUE_SIZE];   // last value written, "" for not known yet
+  char *meta;                   // last {prefix}/meta json written, 0 for none
+  int seq;                      // this button's sequence counter (seqFind), -1 none
+};
+
+//
+// One per message in flight, handed to paho as the callback context so the completion
+// knows which message it is about.
+//
+struct PahoSendContext {
+  PahoWrapper *paho;
+  LONG volatile busy;
+  unsigned int journalSeq;     // journal record to mark acked/failed (0 none)
+  uint32_t traceId;            // TRACE_ACK id (0 not traced)
+};
 
 class PahoWrapper {
 
 private:
-  FILE *logfile;
   MQTTAsync pahoClient;
-  const char *mqttServer;
+  char *mqttServer;
   char *topicLWT;
-  char *topicState[8];
-  char *topicStateClick[8];
-  char *topicStateHold[8];
-  char *topicStateHoldUp[8];
-  char *topicStateClickClick[8];
-  char *topicStateClickHold[8];
-  char *topicStateClickHoldUp[8];
+  char *topicFlicdLink;
+  char *topicFlicdResync;
+  char *topicMetrics;
+  char *topicFlicdRtt;
+  char *topicFlicdController;
+  char *topicFlicdSpace;
+  char *topicPresence;
+  char *topicWatchdog;
+  char *topicResources;
+  std::vector<PahoButton> buttons;
+  char available[8];              // last LWT value, republished with the buttons
+  char flicdCache[FLICD_MODES][16];   // last link/controller/space values, likewise
+  const PayloadTemplate *payloadEvent;  // 0 for the classic timestamp payload
+  char source[64];                // flicd host:port for ${source}
+  char payload[PAYLOAD_MAX];      // rendered gesture payload
+  PahoSendContext sendContexts[PAHO_SEND_CONTEXTS];
+  PahoSendContext sendOverflow;   // used (never released) if every context is busy
+  int sendNext;
   LONG volatile pahoOutstanding;
   bool volatile pahoUp;
+  bool volatile pahoConnecting;   // a connect is in progress, onConnect/onConnectFailure ends it
+  uint64_t connectMs;             // when it started
+  void (*connectNotify)();        // called on paho's thread once connected
   
   //
-  void send(const char *topic, int retain, const char *msg);
+  void send(const char *topic, int retain, const char *msg, unsigned int journalSeq=0);
+  void writeCached(int bno, int field, const char *value, unsigned int journalSeq=0);
+  void sendWait();
+  PahoSendContext *sendContextGet();
 
 public:
-  PahoWrapper(Config *config);
+  PahoWrapper(Config *config, void (*connectNotify)()=0);
   LONG getOutstanding();
   bool isUp();
   void markAvailable(bool avail);
-  void writeState(int butt, int mode, const char *msg);
+  void setButton(int butt, const char *name, const char *topic, unsigned int gestures);
+  void setPayload(const PayloadTemplate *tmpl);
+  void writeState(int butt, int mode, const char *msg, bool queued=false, uint64_t ms=0);
+  void writeConnection(int butt, const char *status, bool paced=false);
+  void writeBattery(int butt, int percent, bool heartbeat=false);
+  void writeMeta(int butt, const char *json);
+  void writeButton(int butt, const char *suffix, const char *msg);
+  void writeFlicd(int mode, const char *msg);
   void reconnect();
+  void republish();
+  int shutdown(int drainMs, int *flushed);
 
   void pahoOnConnLost(char *cause);
   void pahoOnConnectFailure(MQTTAsync_failureData* response);
   void pahoOnConnect(MQTTAsync_successData* response);
-  void pahoOnSend(MQTTAsync_successData* response);
-  void pahoOnSendFailure(MQTTAsync_failureData* response);
+  void pahoOnSend(PahoSendContext *ctx, MQTTAsync_successData* response);
+  void pahoOnSendFailure(PahoSendContext *ctx, MQTTAsync_failureData* response);
+  void pahoOnDisconnect(MQTTAsync_successData* response);
 
 };
 
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Payload templates.  compile() does all the parsing; render() only walks the op list
+// appending into the caller's buffer, numbers converted by hand.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#else
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include <stdio.h>
+#include "global.h"
+#include "Payload.h"
+
+using namespace std;
+
+//
+// Parse tmpl.  ${field} is replaced when rendering, anything else is copied as is.
+// On failure error says why and the template is left empty.
+//
+bool PayloadTemplate::compile(const char *tmpl, string &error) {
+  literals.clear();
+  ops.clear();
+  if(strlen(tmpl)>=PAYLOAD_MAX) {
+    error="template is too long";
+    return false;
+  }
+  for(const char *s=tmpl;*s;) {
+    const char *f=strstr(s,"${");
+    const char *lit_end=f ? f : s+strlen(s);
+    if(lit_end>s) {
+      if(!ops.empty() && ops.back().kind==PAYLOAD_OP_LITERAL && ops.back().off+ops.back().len==literals.size()) {
+        ops.back().len+=(uint16_t)(lit_end-s);
+      } else {
+        PayloadOp op={PAYLOAD_OP_LITERAL, (uint16_t)(lit_end-s), (uint32_t)literals.size()};
+        ops.push_back(op);
+      }
+      literals.append(s,lit_end-s);
+    }
+    if(!f) { break; }
+    const char *close=strchr(f+2,'}');
+    if(!close) {
+      error="${ without a closing }";
+      literals.clear();
+      ops.clear();
+      return false;
+    }
+    string field(f+2,close-f-2);
+    int k;
+    for(k=1;k<PAYLOAD_FIELDS && field!=PAYLOAD_FIELD_NAMES[k];k++) {}
+    if(k==PAYLOAD_FIELDS) {
+      error="unknown field ${"+field+"} (want name, event, ms, queued, source, seq, gseq, time or slot)";
+      literals.clear();
+      ops.clear();
+      return false;
+    }
+    PayloadOp op={(uint16_t)k, 0, 0};
+    ops.push_back(op);
+    s=close+1;
+  }
+  return true;
+}
+
+//
+// Appenders.  p never passes end, which leaves room for the terminating null.
+//
+static inline char *payload_put(char *p, char *end, const char *s, int len) {
+  if(len>end-p) { len=(int)(end-p); }
+  memcpy(p,s,len);
+  return p+len;
+}
+
+static inline char *payload_escaped(char *p, char *end, const char *s) {
+  for(;s && *s && p<end;s++) {
+    if(*s=='"' || *s=='\\') {
+      if(end-p<2) { break; }
+      *p++='\\';
+    }
+    *p++=*s;
+  }
+  return p;
+}
+
+static inline char *payload_number(char *p, char *end, uint64_t v) {
+  char digits[20];
+  int n=0;
+  do { digits[n++]=(char)('0'+v%10); v/=10; } while(v);
+  while(n && p<end) { *p++=digits[--n]; }
+  return p;
+}
+
+//
+// Render into buf (sz bytes, always null terminated).  Returns the length.
+//
+int PayloadTemplate::render(char *buf, int sz, const PayloadFields &f) const {
+  char *p=buf, *end=buf+sz-1;
+  const char *lit=literals.data();
+  for(size_t i=0;i<ops.size();i++) {
+    const PayloadOp &op=ops[i];
+    switch(op.kind) {
+      case PAYLOAD_OP_LITERAL:  p=payload_put(p, end, lit+op.off, op.len);                    break;
+      case PAYLOAD_OP_NAME:     p=payload_escaped(p, end, f.name);                            break;
+      case PAYLOAD_OP_EVENT:    p=payload_escaped(p, end, f.event);                           break;
+      case PAYLOAD_OP_MS:       p=payload_number(p, end, f.ms);                               break;
+      case PAYLOAD_OP_QUEUED:   p=f.queued ? payload_put(p, end, "true", 4) : payload_put(p, end, "false", 5); break;
+      case PAYLOAD_OP_SOURCE:   p=payload_escaped(p, end, f.source);                          break;
+      case PAYLOAD_OP_SEQ:      p=payload_number(p, end, f.seq);                              break;
+      case PAYLOAD_OP_TIME:     p=payload_escaped(p, end, f.time);                            break;
+      case PAYLOAD_OP_SLOT:     p=payload_number(p, end, (uint64_t)f.slot);                   break;
+      case PAYLOAD_OP_GSEQ:     p=payload_number(p, end, f.gseq);                             break;
+    }
+  }
+  *p=0;
+  return (int)(p-buf);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _PAYLOADH
+#define _PAYLOADH
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//
+// PAYLOAD_EVENT= template for gesture messages, e.g.
+//   {"button":"${name}","event":"${event}","ms":${ms},"queued":${queued},"seq":${seq}}
+// It is compiled once, when the config is read, into a list of ops (copy a literal or
+// append a field) so publishing an event is a run of appends into a buffer.
+//
+#define PAYLOAD_OP_LITERAL 0
+#define PAYLOAD_OP_NAME    1    // button name (json escaped)
+#define PAYLOAD_OP_EVENT   2    // click, hold, ... (BUTT_xxx name)
+#define PAYLOAD_OP_MS      3    // wall clock, ms since the epoch
+#define PAYLOAD_OP_QUEUED  4    // true/false: flicd held the event while the button was out of range
+#define PAYLOAD_OP_SOURCE  5    // flicd host:port
+#define PAYLOAD_OP_SEQ     6    // this button's event sequence number
+#define PAYLOAD_OP_TIME    7    // the timestamp, in the TIME_FORMAT
+#define PAYLOAD_OP_SLOT    8    // button slot
+#define PAYLOAD_OP_GSEQ    9    // sequence number across all buttons
+#define PAYLOAD_FIELDS     10
+
+static const char *PAYLOAD_FIELD_NAMES[]={"", "name", "event", "ms", "queued", "source", "seq", "time", "slot", "gseq"};
+
+#define PAYLOAD_MAX        1024 // longest rendered payload; longer ones are cut
+
+struct PayloadFields {
+  const char *name;
+  const char *event;
+  uint64_t ms;
+  bool queued;
+  const char *source;
+  uint64_t seq;
+  const char *time;
+  int slot;
+  uint64_t gseq;
+};
+
+struct PayloadOp {
+  uint16_t kind;                // PAYLOAD_OP_xxx
+  uint16_t len;                 // literal length
+  uint32_t off;                 // literal offset into literals
+};
+
+class PayloadTemplate {
+
+private:
+  std::string literals;
+  std::vector<PayloadOp> ops;
+
+public:
+  bool compile(const char *tmpl, std::string &error);
+  bool empty() const { return ops.empty(); }
+  int render(char *buf, int sz, const PayloadFields &f) const;
+};
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Presence table.  The flicd reader thread calls presenceAdd() for every advertisement, so
+// that path is a hash, a short linear probe and a few stores under an uncontended lock:
+// no strings, no allocation, no logging.  The main thread's snapshot copies the table out
+// under the lock and formats it after letting go.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#else
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include <stdio.h>
+#include "global.h"
+#include "Presence.h"
+#include "Metrics.h"
+
+static PresenceEntry theTable[PRESENCE_SLOTS];
+static PresenceEntry theSnapshot[PRESENCE_SLOTS];
+static int theUsed;
+static uint32_t theAdverts;            // this interval
+static uint32_t theDropped;            // this interval, table full
+static uint32_t theIntervalMs;         // 0 = presence off
+static uint32_t theDueTick;            // last time presenceAdd said a snapshot was due
+
+#ifdef __LINUX__
+static pthread_mutex_t thePresenceLock=PTHREAD_MUTEX_INITIALIZER;
+static void presence_lock()   { pthread_mutex_lock(&thePresenceLock);   }
+static void presence_unlock() { pthread_mutex_unlock(&thePresenceLock); }
+#else
+static CRITICAL_SECTION thePresenceLock;
+static void presence_lock()   { EnterCriticalSection(&thePresenceLock); }
+static void presence_unlock() { LeaveCriticalSection(&thePresenceLock); }
+#endif
+
+static inline uint32_t presence_hash(uint64_t bdaddr) {
+  return (uint32_t)((bdaddr*0x9E3779B97F4A7C15ULL)>>40) & (PRESENCE_SLOTS-1);
+}
+
+//
+// Slot holding bdaddr, or the empty slot it would go in.  Never loops forever as the table
+// is never allowed to fill.
+//
+static inline PresenceEntry *presence_find(PresenceEntry *table, uint64_t bdaddr) {
+  uint32_t i=presence_hash(bdaddr);
+  while(table[i].bdaddr && table[i].bdaddr!=bdaddr) { i=(i+1)&(PRESENCE_SLOTS-1); }
+  return &table[i];
+}
+
+void presenceSetInterval(int seconds) {
+#ifndef __LINUX__
+  static bool init=false;
+  if(!init) { InitializeCriticalSection(&thePresenceLock); init=true; }
+#endif
+  theIntervalMs=seconds>0 ? (uint32_t)seconds*1000 : 0;
+}
+
+//
+// True once per interval.  Called locked.
+//
+static bool presence_due(uint32_t tick) {
+  if(!theDueTick) { theDueTick=tick; }
+  if(tick-theDueTick<theIntervalMs) { return false; }
+  theDueTick=tick;
+  return true;
+}
+
+//
+// Called by the reader when flicd is quiet, so snapshots (and expiry) keep coming when
+// no button is advertising.  True if the main thread should take a snapshot.
+//
+bool presenceTick(uint32_t tick) {
+  if(!theIntervalMs) { return false; }
+  presence_lock();
+  bool due=presence_due(tick);
+  presence_unlock();
+  return due;
+}
+
+//
+// One advertisement.  Returns true (once per interval) when the main thread should take a snapshot.
+//
+bool presenceAdd(uint64_t bdaddr, int rssi, uint32_t tick) {
+  bool due=false;
+  if(!theIntervalMs || !bdaddr) { return false; }
+  presence_lock();
+  PresenceEntry *e=presence_find(theTable, bdaddr);
+  if(!e->bdaddr && theUsed>=PRESENCE_SLOTS*3/4) {
+    theDropped++;
+  } else {
+    if(!e->bdaddr) {
+      e->bdaddr=bdaddr;
+      e->ewma=(int16_t)(rssi*16);
+      e->count=0;
+      theUsed++;
+    }
+    if(!e->count) {
+      e->min=e->max=(int8_t)rssi;
+    } else {
+      if(rssi<e->min) { e->min=(int8_t)rssi; }
+      if(rssi>e->max) { e->max=(int8_t)rssi; }
+    }
+    e->ewma+=(int16_t)((rssi*16-e->ewma)/8);
+    e->count++;
+    e->lastSeen=tick;
+  }
+  theAdverts++;
+  due=presence_due(tick);
+  presence_unlock();
+  return due;
+}
+
+static int presence_mac(char *buf, uint64_t bdaddr) {
+  static const char hex[]="0123456789abcdef";
+  for(int i=0;i<6;i++) {
+    uint8_t b=(uint8_t)(bdaddr>>(40-8*i));
+    buf[i*3]=hex[b>>4];
+    buf[i*3+1]=hex[b&15];
+    buf[i*3+2]=i<5 ? ':' : 0;
+  }
+  return 17;
+}
+
+//
+// Snapshot the table as json and start a new interval.  Entries not heard from for
+// PRESENCE_EXPIRE intervals are dropped.  Each button is [mac, rssi average, min, max,
+// advertisements this interval, seconds since last heard]; min/max are null if it was
+// not heard this interval.
+//
+int presenceFormat(char *buf, int sz, uint32_t tick) {
+  int n=0, expired=0;
+  uint32_t adverts, dropped;
+  uint32_t expireMs=theIntervalMs*PRESENCE_EXPIRE;
+
+  presence_lock();
+  for(int i=0;i<PRESENCE_SLOTS;i++) {
+    PresenceEntry &e=theTable[i];
+    if(!e.bdaddr) { continue; }
+    if(tick-e.lastSeen>expireMs) { expired++; continue; }
+    theSnapshot[n++]=e;
+    e.count=0;
+  }
+  if(expired) {
+    //
+    // open addressing has no cheap delete, so put the survivors back into a clean table
+    //
+    memset(theTable, 0, sizeof(theTable));
+    for(int i=0;i<n;i++) {
+      PresenceEntry *to=presence_find(theTable, theSnapshot[i].bdaddr);
+      *to=theSnapshot[i];
+      to->count=0;
+    }
+    theUsed=n;
+  }
+  adverts=theAdverts;
+  dropped=theDropped;
+  theAdverts=theDropped=0;
+  presence_unlock();
+
+  metricAdd(METRIC_PRESENCE_ADVERTS, adverts);
+  metricAdd(METRIC_PRESENCE_DROPPED, dropped);
+  int len=snprintf(buf,sz,"{\"devices\":%d,\"adverts\":%u,\"dropped\":%u,\"buttons\":[",n,adverts,dropped);
+  for(int i=0;i<n && len<sz-64;i++) {
+    PresenceEntry &e=theSnapshot[i];
+    char mac[18];
+    presence_mac(mac, e.bdaddr);
+    int avg=e.ewma>=0 ? (e.ewma+8)/16 : -((8-e.ewma)/16);
+    if(e.count) {
+      len+=snprintf(buf+len,sz-len,"%s[\"%s\",%d,%d,%d,%u,%u]",i ? "," : "",mac,avg,e.min,e.max,e.count,(tick-e.lastSeen)/1000);
+    } else {
+      len+=snprintf(buf+len,sz-len,"%s[\"%s\",%d,null,null,0,%u]",i ? "," : "",mac,avg,(tick-e.lastSeen)/1000);
+    }
+  }
+  if(len<sz) { len+=snprintf(buf+len,sz-len,"]}"); }
+  if(len>=sz) { len=sz-1; }
+  return len;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _PRESENCEH
+#define _PRESENCEH
+
+#include <stdint.h>
+
+//
+// Which Flic buttons are in radio range, from flicd scanner advertisements.  Every
+// advertisement updates its button's entry in a fixed size open addressing table;
+// nothing is published per packet.  Once every PRESENCE_INTERVAL seconds the main
+// thread takes a snapshot, publishes it and starts the next interval.
+//
+#define PRESENCE_SLOTS     4096   // table size (power of 2), kept at most 3/4 full
+#define PRESENCE_SCAN_ID   1      // flicd scanner id used for presence (0 is the interactive startScan)
+#define PRESENCE_EXPIRE    3      // entries not heard from for this many intervals are dropped
+
+struct PresenceEntry {
+  uint64_t bdaddr;              // 48 bit address, 0 for an empty slot
+  uint32_t lastSeen;            // tick of the last advertisement
+  uint32_t count;               // advertisements this interval
+  int16_t  ewma;                // rssi moving average, 1/16 dB
+  int8_t   min;                 // rssi range this interval
+  int8_t   max;
+};
+
+extern void presenceSetInterval(int seconds);
+extern bool presenceAdd(uint64_t bdaddr, int rssi, uint32_t tick);
+extern bool presenceTick(uint32_t tick);
+extern int presenceFormat(char *buf, int sz, uint32_t tick);
+
+#endif
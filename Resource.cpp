@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Process resource samples.  Only the main thread samples, a few times an hour, so this
+// favours plain system calls over anything clever.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#else
+#include <windows.h>
+#include <psapi.h>
+#include <tlhelp32.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include <stdio.h>
+#include "global.h"
+#include "Resource.h"
+#include "Metrics.h"
+
+#ifdef __LINUX__
+//
+// Entries in /proc/self/fd, less . and .. and the descriptor opendir itself holds
+//
+static int resource_fds() {
+  DIR *d=opendir("/proc/self/fd");
+  if(!d) { return -1; }
+  int n=0;
+  while(readdir(d)) { n++; }
+  closedir(d);
+  return n-3;
+}
+
+//
+// Threads: and VmRSS: from /proc/self/status
+//
+static void resource_status(ResourceSample *s) {
+  char line[128];
+  FILE *f=fopen("/proc/self/status","r");
+  if(!f) { return; }
+  while(fgets(line,sizeof(line),f)) {
+    if(!strncmp(line,"Threads:",8))    { s->threads=atoi(line+8); }
+    else if(!strncmp(line,"VmRSS:",6)) { s->rssKb=strtoull(line+6,0,10); }
+  }
+  fclose(f);
+}
+#else
+static uint64_t resource_us(const FILETIME &ft) {
+  return ((((uint64_t)ft.dwHighDateTime)<<32)|ft.dwLowDateTime)/10;      // 100ns units
+}
+
+static int resource_threads() {
+  HANDLE snap=CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+  if(snap==INVALID_HANDLE_VALUE) { return -1; }
+  THREADENTRY32 te;
+  te.dwSize=sizeof(te);
+  int n=0;
+  DWORD pid=GetCurrentProcessId();
+  for(BOOL ok=Thread32First(snap,&te);ok;ok=Thread32Next(snap,&te)) {
+    if(te.th32OwnerProcessID==pid) { n++; }
+  }
+  CloseHandle(snap);
+  return n;
+}
+#endif
+
+void resourceSample(ResourceSample *s) {
+  memset(s, 0, sizeof(*s));
+  s->fds=s->threads=-1;
+#ifdef __LINUX__
+  struct rusage ru;
+  if(!getrusage(RUSAGE_SELF, &ru)) {
+    s->userUs=(uint64_t)ru.ru_utime.tv_sec*1000000+ru.ru_utime.tv_usec;
+    s->sysUs=(uint64_t)ru.ru_stime.tv_sec*1000000+ru.ru_stime.tv_usec;
+    s->vcsw=ru.ru_nvcsw;
+    s->ivcsw=ru.ru_nivcsw;
+    s->maxRssKb=ru.ru_maxrss;
+  }
+  s->fds=resource_fds();
+  resource_status(s);
+#else
+  HANDLE me=GetCurrentProcess();
+  FILETIME created, exited, kernel, user;
+  if(GetProcessTimes(me, &created, &exited, &kernel, &user)) {
+    s->userUs=resource_us(user);
+    s->sysUs=resource_us(kernel);
+  }
+  PROCESS_MEMORY_COUNTERS pmc;
+  if(GetProcessMemoryInfo(me, &pmc, sizeof(pmc))) {
+    s->maxRssKb=pmc.PeakWorkingSetSize/1024;
+    s->rssKb=pmc.WorkingSetSize/1024;
+  }
+  DWORD handles;
+  if(GetProcessHandleCount(me, &handles)) { s->fds=(int)handles; }
+  s->threads=resource_threads();
+#endif
+}
+
+//
+// cur against prev as json, and the proc_xxx metrics from it.  events is what the main
+// thread handled in between, for the per event costs (null with no events).
+//
+int resourceFormat(char *buf, int sz, const ResourceSample *prev, const ResourceSample *cur, uint32_t intervalMs, uint32_t events) {
+  uint64_t cpuUs=(cur->userUs-prev->userUs)+(cur->sysUs-prev->sysUs);
+  uint64_t csw=(cur->vcsw-prev->vcsw)+(cur->ivcsw-prev->ivcsw);
+  char perEvent[64];
+
+  metricSet(METRIC_PROC_CPU_US, cur->userUs+cur->sysUs);
+  metricSet(METRIC_PROC_MAX_RSS_KB, cur->maxRssKb);
+  metricSet(METRIC_PROC_CTX_SWITCHES, cur->vcsw+cur->ivcsw);
+  metricSet(METRIC_PROC_FDS, cur->fds);
+  metricSet(METRIC_PROC_THREADS, cur->threads);
+  if(events) {
+    metricSet(METRIC_PROC_CPU_US_PER_EVENT, cpuUs/events);
+    metricSet(METRIC_PROC_CSW_PER_KEVENT, csw*1000/events);
+    snprintf(perEvent,sizeof(perEvent),"%.1f,\"csw_per_event\":%.2f",(double)cpuUs/events,(double)csw/events);
+  } else {
+    strcpy(perEvent,"null,\"csw_per_event\":null");
+  }
+  int len=snprintf(buf,sz,"{\"interval_ms\":%u,\"events\":%u,\"cpu_user_us\":%llu,\"cpu_sys_us\":%llu,\"cpu_pct\":%.2f,"
+                   "\"max_rss_kb\":%llu,\"rss_kb\":%llu,\"vcsw\":%llu,\"ivcsw\":%llu,\"fds\":%d,\"threads\":%d,\"cpu_us_per_event\":%s}",
+                   intervalMs,events,(unsigned long long)(cur->userUs-prev->userUs),(unsigned long long)(cur->sysUs-prev->sysUs),
+                   intervalMs ? cpuUs/(intervalMs*10.0) : 0.0,(unsigned long long)cur->maxRssKb,(unsigned long long)cur->rssKb,
+                   (unsigned long long)(cur->vcsw-prev->vcsw),(unsigned long long)(cur->ivcsw-prev->ivcsw),cur->fds,cur->threads,perEvent);
+  if(len>=sz) { len=sz-1; }
+  return len;
+}
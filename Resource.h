@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _RESOURCEH
+#define _RESOURCEH
+
+#include <stdint.h>
+
+//
+// What the process itself is using: getrusage() and /proc/self on Linux, the process
+// and toolhelp APIs on Windows.  The main thread samples at the end of every epoch and
+// every STATS_INTERVAL, publishes the difference from the previous sample to
+// {base}/resources and keeps the proc_xxx metrics current.
+//
+struct ResourceSample {
+  uint64_t userUs;              // cpu time, totals since start
+  uint64_t sysUs;
+  uint64_t vcsw;                // voluntary context switches (0 on Windows)
+  uint64_t ivcsw;               // involuntary
+  uint64_t maxRssKb;            // peak resident set
+  uint64_t rssKb;               // resident set now
+  int fds;                      // open descriptors (handles on Windows), -1 unknown
+  int threads;                  // -1 unknown
+};
+
+extern void resourceSample(ResourceSample *s);
+extern int resourceFormat(char *buf, int sz, const ResourceSample *prev, const ResourceSample *cur, uint32_t intervalMs, uint32_t events);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Sequence counters.  Only the main thread publishes, so there is no lock: taking a number
+// is two increments in the mapped file, and every SEQ_CHECKPOINT numbers an msync makes
+// sure the disk is no further behind than that.  Without a file (no SEQ_FILE, or Windows)
+// the counters live on the heap and start again from 1 with each run.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include "global.h"
+#include "Sequence.h"
+#include "Log.h"
+
+#define SEQ_GROW  64                          // records added each time the file fills
+#define SEQ_FIRST 2                           // records 0 and 1 are the header
+
+static uint8_t *theSeqMap=0;
+static size_t theSeqMapped=0;
+static int theSeqCheckpoint=100;
+static int theSeqUnsynced=0;                  // numbers handed out since the last sync
+#ifdef __LINUX__
+static int theSeqFd=-1;
+#endif
+
+#define SEQ_HEADER ((SeqHeader *)theSeqMap)
+#define SEQ_RECORD(n) ((SeqRecord *)(theSeqMap+(size_t)(n)*sizeof(SeqRecord)))
+
+//
+// Make room for bytes, in whole SEQ_GROW chunks.  New space reads as zero.
+//
+static int seq_map(size_t bytes) {
+  if(bytes<=theSeqMapped) { return 0; }
+  size_t chunk=SEQ_GROW*sizeof(SeqRecord);
+  size_t want=(bytes+chunk-1)/chunk*chunk;
+#ifdef __LINUX__
+  if(theSeqFd>=0) {
+    if(ftruncate(theSeqFd, want)) { LOG(LOG_MAIN, LOG_ERROR, "sequence file grow: %s\n", strerror(errno)); return -1; }
+    if(theSeqMap) { munmap(theSeqMap, theSeqMapped); }
+    theSeqMap=(uint8_t*)mmap(0, want, PROT_READ|PROT_WRITE, MAP_SHARED, theSeqFd, 0);
+    if(theSeqMap==MAP_FAILED) {
+      LOG(LOG_MAIN, LOG_ERROR, "sequence file mmap: %s\n", strerror(errno));
+      theSeqMap=0;
+      theSeqMapped=0;
+      return -1;
+    }
+    theSeqMapped=want;
+    return 0;
+  }
+#endif
+  uint8_t *grown=(uint8_t*)realloc(theSeqMap, want);
+  if(!grown) { return -1; }
+  memset(grown+theSeqMapped, 0, want-theSeqMapped);
+  theSeqMap=grown;
+  theSeqMapped=want;
+  return 0;
+}
+
+static void seq_sync() {
+  if(theSeqMap) { SEQ_HEADER->checkpoint=(uint32_t)theSeqCheckpoint; }
+#ifdef __LINUX__
+  if(theSeqFd>=0 && theSeqMap) { msync(theSeqMap, theSeqMapped, MS_SYNC); }
+#endif
+  theSeqUnsynced=0;
+}
+
+//
+// Open (or create) the counters at path, 0 to keep them in memory only.  Returns the
+// number of buttons that already had a counter.
+//
+int seqOpen(const char *path, int checkpoint) {
+  size_t size=0;
+  seqSetCheckpoint(checkpoint);
+#ifdef __LINUX__
+  struct stat st;
+  if(path) {
+    theSeqFd=open(path, O_RDWR|O_CREAT, 0644);
+    if(theSeqFd<0 || fstat(theSeqFd,&st)) {
+      LOG(LOG_MAIN, LOG_ERROR, "Can not open sequence file %s: %s, numbering from 1\n", path, strerror(errno));
+      if(theSeqFd>=0) { close(theSeqFd); }
+      theSeqFd=-1;
+    } else {
+      size=st.st_size;
+    }
+  }
+#endif
+  if(seq_map(size ? size : SEQ_FIRST*sizeof(SeqRecord))) { return 0; }
+  SeqHeader *hdr=SEQ_HEADER;
+  if(size && (memcmp(hdr->magic, SEQ_MAGIC, 8) || hdr->recordSize!=sizeof(SeqRecord) ||
+              (size_t)(hdr->count+SEQ_FIRST)*sizeof(SeqRecord)>size)) {
+    //
+    // unlike the meta cache this can not just be started over without reusing numbers
+    //
+    LOG(LOG_MAIN, LOG_ERROR, "%s is not a sequence file this version understands, keeping counters in memory\n", path);
+#ifdef __LINUX__
+    munmap(theSeqMap, theSeqMapped);
+    close(theSeqFd);
+    theSeqFd=-1;
+#endif
+    theSeqMap=0;
+    theSeqMapped=0;
+    size=0;
+    if(seq_map(SEQ_FIRST*sizeof(SeqRecord))) { return 0; }
+    hdr=SEQ_HEADER;
+  }
+  if(!size) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, SEQ_MAGIC, 8);
+    hdr->recordSize=sizeof(SeqRecord);
+  } else if(!hdr->clean) {
+    //
+    // the last run did not stop cleanly: up to a checkpoint's worth of numbers may have
+    // been handed out without reaching the disk, by its checkpoint rather than ours
+    //
+    uint64_t skip=hdr->checkpoint>(uint32_t)theSeqCheckpoint ? hdr->checkpoint : (uint32_t)theSeqCheckpoint;
+    LOG(LOG_MAIN, LOG_WARN, "%s was not closed cleanly, skipping sequence numbers ahead by %llu\n", path, (unsigned long long)skip);
+    hdr->global+=skip;
+    for(uint32_t i=0;i<hdr->count;i++) {
+      SEQ_RECORD(SEQ_FIRST+i)->seq+=skip;
+    }
+  }
+  hdr->clean=0;
+  seq_sync();
+#ifdef __LINUX__
+  if(theSeqFd<0) { path=0; }
+#else
+  path=0;
+#endif
+  LOG(LOG_MAIN, LOG_INFO, "Sequence %s: %u buttons, global at %llu\n", path ? path : "(memory)", hdr->count, (unsigned long long)hdr->global);
+  return (int)hdr->count;
+}
+
+//
+// Also syncs, so the header never claims a smaller checkpoint than the numbers handed out
+// since the last sync (a reload can raise or lower it mid-run)
+//
+void seqSetCheckpoint(int checkpoint) {
+  theSeqCheckpoint=checkpoint>0 ? checkpoint : 1;
+  if(theSeqMap) { seq_sync(); }
+}
+
+//
+// FNV-1a; names are short and there are few of them
+//
+static uint64_t seq_key(const char *name) {
+  uint64_t h=0xcbf29ce484222325ULL;
+  for(;*name;name++) { h=(h^(uint8_t)*name)*0x100000001b3ULL; }
+  return h ? h : 1;
+}
+
+//
+// Counter for the button called name, added if it has none.  -1 if the file could not grow.
+//
+int seqFind(const char *name) {
+  if(!theSeqMap || !name) { return -1; }
+  uint64_t key=seq_key(name);
+  uint32_t n=SEQ_HEADER->count;
+  for(uint32_t i=0;i<n;i++) {
+    if(SEQ_RECORD(SEQ_FIRST+i)->key==key) { return SEQ_FIRST+i; }
+  }
+  if(seq_map((size_t)(SEQ_FIRST+n+1)*sizeof(SeqRecord))) { return -1; }
+  SEQ_RECORD(SEQ_FIRST+n)->key=key;
+  SEQ_RECORD(SEQ_FIRST+n)->seq=0;
+  SEQ_HEADER->count=n+1;
+  return SEQ_FIRST+n;
+}
+
+//
+// Take the next number for button rec (from seqFind) and, if global is given, the next
+// global one.  Returns 0 if there are no counters.
+//
+uint64_t seqNext(int rec, uint64_t *global) {
+  if(!theSeqMap || rec<SEQ_FIRST || rec>=SEQ_FIRST+(int)SEQ_HEADER->count) {
+    if(global) { *global=0; }
+    return 0;
+  }
+  uint64_t seq=++SEQ_RECORD(rec)->seq;
+  uint64_t g=++SEQ_HEADER->global;
+  if(global) { *global=g; }
+  if(++theSeqUnsynced>=theSeqCheckpoint) { seq_sync(); }
+  return seq;
+}
+
+//
+// Stopping cleanly: the next start can carry on without skipping
+//
+void seqClose() {
+  if(!theSeqMap) { return; }
+  SEQ_HEADER->clean=1;
+  seq_sync();
+#ifdef __LINUX__
+  if(theSeqFd>=0) {
+    munmap(theSeqMap, theSeqMapped);
+    close(theSeqFd);
+    theSeqFd=-1;
+    theSeqMap=0;
+    theSeqMapped=0;
+  }
+#endif
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _SEQUENCEH
+#define _SEQUENCEH
+
+#include <stdint.h>
+
+//
+// Event sequence numbers: one counter per button (keyed by name, as that is what the
+// topics are) and one across all buttons, both 64 bit and never reused.  They live in a
+// small memory mapped file (SEQ_FILE) that is synced every SEQ_CHECKPOINT events; a
+// start after an unclean stop skips every counter ahead by the larger of the checkpoint
+// the stopped run had in force (kept in the header) and the current one, so numbers the
+// disk may not have seen are not handed out again.
+//
+#define SEQ_MAGIC          "F2MSEQ01"
+
+struct SeqRecord {
+  uint64_t key;                 // hash of the button name
+  uint64_t seq;                 // last number used, 0 none yet
+};
+
+struct SeqHeader {
+  char     magic[8];
+  uint32_t recordSize;
+  uint32_t count;               // records in use
+  uint64_t global;              // last number used across all buttons
+  uint32_t clean;               // 1 while stopped cleanly, 0 while running
+  uint32_t checkpoint;          // SEQ_CHECKPOINT in force when last synced, 0 in older files
+};
+
+static_assert(sizeof(SeqRecord)==16, "sequence records are 16 bytes on disk");
+static_assert(sizeof(SeqHeader)==2*sizeof(SeqRecord), "header fills records 0 and 1");
+
+extern int seqOpen(const char *path, int checkpoint);
+extern void seqSetCheckpoint(int checkpoint);
+extern int seqFind(const char *name);
+extern uint64_t seqNext(int rec, uint64_t *global);
+extern void seqClose();
+
+#endif
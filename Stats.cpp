@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Usage statistics.  Everything but statsTick() runs on the main thread, which is the only
+// one that sees gestures, so the counters are plain integers with no lock or atomics.  The
+// flicd reader calls statsTick() from its idle path so publishing happens on time even
+// when no button is pressed; it only touches the due tick, which nothing else writes.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#else
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include <stdio.h>
+#include <vector>
+#include "global.h"
+#include "Stats.h"
+
+// BUTT_xxx, without pulling in paho
+#define STATS_CLICK      1
+#define STATS_HOLD       2
+#define STATS_CLICKCLICK 4
+#define STATS_CLICKHOLD  5
+
+static std::vector<ButtonStats> theStats;
+static uint32_t volatile theIntervalMs;       // 0 = stats off
+static uint32_t theDueTick;                   // reader thread only
+
+void statsSetInterval(int seconds) {
+  theIntervalMs=seconds>0 ? (uint32_t)seconds*1000 : 0;
+}
+
+//
+// True once per interval.  Called by the flicd reader, about once a second.
+//
+bool statsTick(uint32_t tick) {
+  uint32_t interval=theIntervalMs;
+  if(!interval) { theDueTick=0; return false; }
+  if(!theDueTick) { theDueTick=tick; }
+  if(tick-theDueTick<interval) { return false; }
+  theDueTick=tick;
+  return true;
+}
+
+static inline ButtonStats *stats_button(int bno) {
+  if(bno<0) { return 0; }
+  if(bno>=(int)theStats.size()) {
+    ButtonStats empty;
+    memset(&empty, 0, sizeof(empty));
+    theStats.resize(bno+1, empty);
+  }
+  return &theStats[bno];
+}
+
+static inline int stats_bucket(const uint32_t *bounds, int32_t ms) {
+  int i=0;
+  while(i<STATS_BUCKETS-1 && (uint32_t)ms>bounds[i]) { i++; }
+  return i;
+}
+
+void statsGesture(int bno, int mode, bool queued) {
+  ButtonStats *s=stats_button(bno);
+  if(!s || mode<0 || mode>=STATS_MODES) { return; }
+  s->gestures[mode]++;
+  if(queued) { s->queued++; }
+}
+
+//
+// Press timing.  Queued presses arrive in a burst long after the fact, so they are not timed.
+//
+void statsDown(int bno, uint32_t tick, bool queued) {
+  ButtonStats *s=stats_button(bno);
+  if(s) { s->downTick=queued ? 0 : tick|1; }
+}
+
+void statsUp(int bno, uint32_t tick, bool held) {
+  ButtonStats *s=stats_button(bno);
+  if(!s || !s->downTick) { return; }
+  int32_t ms=(int32_t)(tick-s->downTick);      // downTick may be 1 ahead (tick|1)
+  if(ms<0) { ms=0; }
+  if(held) { s->hold[stats_bucket(STATS_HOLD_MS, ms)]++;   }
+  else     { s->press[stats_bucket(STATS_PRESS_MS, ms)]++; }
+  s->downTick=0;
+}
+
+//
+// The slot now holds a different button (or none)
+//
+void statsReset(int bno) {
+  if(bno>=0 && bno<(int)theStats.size()) { memset(&theStats[bno], 0, sizeof(ButtonStats)); }
+}
+
+static int stats_histogram(char *buf, int sz, const char *name, const uint32_t *counts) {
+  int len=snprintf(buf, sz, ",\"%s\":[", name);
+  for(int i=0;i<STATS_BUCKETS && len<sz;i++) {
+    len+=snprintf(buf+len, sz-len, "%s%u", i ? "," : "", counts[i]);
+  }
+  if(len<sz) { len+=snprintf(buf+len, sz-len, "]"); }
+  return len;
+}
+
+//
+// Button bno's stats for the interval just ended (intervalMs long) as json, then start
+// the next interval.  Returns the length.
+//
+int statsFormat(char *buf, int sz, int bno, uint32_t intervalMs) {
+  ButtonStats *s=stats_button(bno);
+  if(!s) { buf[0]=0; return 0; }
+  uint32_t clicks=s->gestures[STATS_CLICK], doubles=s->gestures[STATS_CLICKCLICK];
+  uint32_t events=clicks+doubles+s->gestures[STATS_HOLD]+s->gestures[STATS_CLICKHOLD];
+  int len=snprintf(buf, sz, "{\"interval\":%u,\"events\":%u,\"per_hour\":%.1f,\"click\":%u,\"clickclick\":%u,\"hold\":%u,\"clickhold\":%u,"
+                   "\"queued\":%u,\"double_ratio\":%.3f",
+                   (intervalMs+500)/1000, events, intervalMs ? events*3600000.0/intervalMs : 0.0, clicks, doubles,
+                   s->gestures[STATS_HOLD], s->gestures[STATS_CLICKHOLD], s->queued, clicks+doubles ? (double)doubles/(clicks+doubles) : 0.0);
+  if(len<sz) { len+=stats_histogram(buf+len, sz-len, "press_ms", s->press); }
+  if(len<sz) { len+=stats_histogram(buf+len, sz-len, "hold_ms", s->hold); }
+  if(len<sz) { len+=snprintf(buf+len, sz-len, "}"); }
+  if(len>=sz) { len=sz-1; }
+  //
+  // a press in progress carries over into the next interval
+  //
+  uint32_t downTick=s->downTick;
+  memset(s, 0, sizeof(*s));
+  s->downTick=downTick;
+  return len;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _STATSH
+#define _STATSH
+
+#include <stdint.h>
+
+//
+// Per button usage counts, kept by the main thread as gestures go by and published to
+// {topic}/stats every STATS_INTERVAL seconds.  Recording an event is a couple of
+// increments; publishing walks the buttons, however busy they were.
+//
+#define STATS_MODES        7    // gesture counts, indexed by BUTT_xxx (see PahoWrapper.h)
+#define STATS_BUCKETS      6
+
+//
+// Histogram upper bounds in ms; the last bucket takes anything longer
+//
+static const uint32_t STATS_PRESS_MS[STATS_BUCKETS-1]={100, 200, 300, 500, 1000};
+static const uint32_t STATS_HOLD_MS[STATS_BUCKETS-1] ={1500, 2000, 3000, 5000, 10000};
+
+struct ButtonStats {
+  uint32_t gestures[STATS_MODES];
+  uint32_t queued;              // gestures flicd held while the button was out of range
+  uint32_t press[STATS_BUCKETS];    // down to up, presses that did not become holds
+  uint32_t hold[STATS_BUCKETS];     // down to up, presses that did
+  uint32_t downTick;            // tick of the press in progress, 0 none (or queued)
+};
+
+extern void statsSetInterval(int seconds);
+extern bool statsTick(uint32_t tick);
+extern void statsGesture(int bno, int mode, bool queued);
+extern void statsDown(int bno, uint32_t tick, bool queued);
+extern void statsUp(int bno, uint32_t tick, bool held);
+extern void statsReset(int bno);
+extern int statsFormat(char *buf, int sz, int bno, uint32_t intervalMs);
+
+#endif
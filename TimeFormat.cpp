@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Timestamp formatting for published events.  localtime (timezone lookups, a lock in some
+// C libraries) and the sprintf behind it run once per second per formatter; in between
+// only the milliseconds are written.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#else
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include <stdio.h>
+#include "global.h"
+#include "TimeFormat.h"
+
+uint64_t timeNowMs() {
+#ifdef __LINUX__
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+#else
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  uint64_t t=((uint64_t)ft.dwHighDateTime<<32)|ft.dwLowDateTime;
+  return t/10000-11644473600000ULL;        // 100ns ticks since 1601 to ms since 1970
+#endif
+}
+
+//
+// asctime, iso or epoch to TIME_FORMAT_xxx; -1 if it is none of them
+//
+int timeFormatParse(const char *name) {
+  for(int i=0;i<TIME_FORMATS;i++) {
+#ifdef __LINUX__
+    if(!strcasecmp(name, TIME_FORMAT_NAMES[i])) { return i; }
+#else
+    if(!_stricmp(name, TIME_FORMAT_NAMES[i])) { return i; }
+#endif
+  }
+  return -1;
+}
+
+TimeFormatter::TimeFormatter(int format) {
+  setFormat(format);
+}
+
+void TimeFormatter::setFormat(int f) {
+  format=f>=0 && f<TIME_FORMATS ? f : TIME_FORMAT_ASCTIME;
+  second=-1;
+  headLen=tailLen=0;
+}
+
+//
+// Rebuild the cached text for sec
+//
+void TimeFormatter::fill(int64_t sec) {
+  static const char *days[]={"Sun","Mon","Tue","Wed","Thu","Fri","Sat"};
+  static const char *months[]={"Jan","Feb","Mar","Apr","May","Jun","Jul","Aug","Sep","Oct","Nov","Dec"};
+  time_t clock=(time_t)sec;
+  struct tm lt;
+#ifdef __LINUX__
+  localtime_r(&clock, &lt);
+#else
+  localtime_s(&lt, &clock);
+#endif
+  second=sec;
+  tailLen=0;
+  if(format==TIME_FORMAT_ASCTIME) {
+    headLen=snprintf(head, sizeof(head), "%.3s %.3s%3d %.2d:%.2d:%.2d %d",
+                     days[lt.tm_wday], months[lt.tm_mon], lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec, 1900+lt.tm_year);
+    return;
+  }
+  headLen=snprintf(head, sizeof(head), "%04d-%02d-%02dT%02d:%02d:%02d",
+                   1900+lt.tm_year, lt.tm_mon+1, lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec);
+#ifdef __LINUX__
+  long off=lt.tm_gmtoff;
+#else
+  long tz=0, dst=0;
+  _get_timezone(&tz);
+  _get_dstbias(&dst);
+  long off=-(tz+(lt.tm_isdst>0 ? dst : 0));
+#endif
+  if(!off) {
+    tail[0]='Z';
+    tail[1]=0;
+    tailLen=1;
+  } else {
+    long a=off<0 ? -off : off;
+    tailLen=snprintf(tail, sizeof(tail), "%c%02ld:%02ld", off<0 ? '-' : '+', a/3600, a/60%60);
+  }
+}
+
+//
+// Format ms (since 1970) into buf, always null terminated.  Returns the length.
+//
+int TimeFormatter::render(char *buf, int sz, uint64_t ms) {
+  char tmp[TIME_MAX];
+  char *p=tmp;
+  if(format==TIME_FORMAT_EPOCH) {
+    char digits[20];
+    int n=0;
+    do { digits[n++]=(char)('0'+ms%10); ms/=10; } while(ms);
+    while(n) { *p++=digits[--n]; }
+  } else {
+    int64_t sec=(int64_t)(ms/1000);
+    if(sec!=second) { fill(sec); }
+    memcpy(p, head, headLen);
+    p+=headLen;
+    if(format==TIME_FORMAT_ISO) {
+      unsigned frac=(unsigned)(ms%1000);
+      *p++='.';
+      *p++=(char)('0'+frac/100);
+      *p++=(char)('0'+frac/10%10);
+      *p++=(char)('0'+frac%10);
+      memcpy(p, tail, tailLen);
+      p+=tailLen;
+    }
+  }
+  int len=(int)(p-tmp);
+  if(len>sz-1) { len=sz-1; }
+  memcpy(buf, tmp, len);
+  buf[len]=0;
+  return len;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _TIMEFORMATH
+#define _TIMEFORMATH
+
+#include <stdint.h>
+#include <time.h>
+
+//
+// TIME_FORMAT= for the timestamps published with gestures
+//
+#define TIME_FORMAT_ASCTIME 0   // Sat Oct 18 18:15:02 2026 (the original, one second resolution)
+#define TIME_FORMAT_ISO     1   // 2026-10-18T18:15:02.123+02:00
+#define TIME_FORMAT_EPOCH   2   // 1792347302123 (ms since 1970)
+#define TIME_FORMATS        3
+
+static const char *TIME_FORMAT_NAMES[]={"asctime", "iso", "epoch"};
+
+#define TIME_MAX            40  // longest formatted time, with its null
+
+//
+// Formats wall clock times.  The part that only changes once a second (everything but
+// the milliseconds) is built with localtime when the second changes and copied after
+// that, so most calls are a memcpy and three digits.  Not thread safe; each thread that
+// formats times keeps its own.
+//
+class TimeFormatter {
+
+private:
+  int format;
+  int64_t second;               // second the cached text is for, -1 for none
+  char head[TIME_MAX];          // up to the seconds
+  int headLen;
+  char tail[8];                 // ISO zone offset, after the milliseconds
+  int tailLen;
+
+  void fill(int64_t sec);
+
+public:
+  TimeFormatter(int format=TIME_FORMAT_ASCTIME);
+  void setFormat(int format);
+  int getFormat() const { return format; }
+  int render(char *buf, int sz, uint64_t ms);
+};
+
+extern uint64_t timeNowMs();
+extern int timeFormatParse(const char *name);
+
+#endif
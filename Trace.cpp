@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Trace rings.  Each thread appends to its own ring and then publishes the new head with
+// a release store, so recording never waits on anything.  traceDump() copies each ring
+// while it is being written: events the writer may have lapped during the copy are
+// dropped by comparing against the head again afterwards.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <time.h>
+#define TRACE_RELEASE(ptr,v) __atomic_store_n(ptr,v,__ATOMIC_RELEASE)
+#define TRACE_ADD(ptr,v)     __sync_add_and_fetch(ptr,v)
+#define TRACE_ACQUIRE()      __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#define TRACE_RELEASE(ptr,v) (*(ptr)=(v))            // msvc volatile stores are releases
+#define TRACE_ADD(ptr,v)     InterlockedExchangeAdd((LONG volatile*)(ptr),v)+(v)
+#define TRACE_ACQUIRE()      _ReadBarrier()                 // x86 does not reorder loads with loads
+#endif
+#include <stdio.h>
+#include "global.h"
+#include "Trace.h"
+#include "Log.h"
+
+struct TraceBuffer {
+  uint64_t volatile head;       // events ever written; the ring holds the last TRACE_EVENTS
+  char thread[24];
+  TraceEvent events[TRACE_EVENTS];
+};
+
+int volatile theTraceOn=0;
+static TraceBuffer *theBuffers[TRACE_THREADS];
+static int volatile theBufferCount=0;
+static uint32_t volatile theTraceIds=0;
+static char theTracePath[512];
+static thread_local TraceBuffer *theMine=0;
+static thread_local bool theMineFailed=false;
+
+#ifdef __LINUX__
+static pthread_mutex_t theTraceLock=PTHREAD_MUTEX_INITIALIZER;
+static void trace_lock()   { pthread_mutex_lock(&theTraceLock);   }
+static void trace_unlock() { pthread_mutex_unlock(&theTraceLock); }
+#else
+static CRITICAL_SECTION theTraceLock;
+static void trace_lock()   { EnterCriticalSection(&theTraceLock); }
+static void trace_unlock() { LeaveCriticalSection(&theTraceLock); }
+#endif
+
+uint64_t traceNow() {
+#ifdef __LINUX__
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+#else
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if(!freq.QuadPart) { QueryPerformanceFrequency(&freq); }
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart/freq.QuadPart*1000000+(now.QuadPart%freq.QuadPart)*1000000/freq.QuadPart);
+#endif
+}
+
+//
+// This thread's ring, made on its first event.  0 once TRACE_THREADS rings are taken.
+//
+static TraceBuffer *trace_mine() {
+  if(theMine || theMineFailed) { return theMine; }
+  trace_lock();
+  if(theBufferCount<TRACE_THREADS) {
+    theMine=(TraceBuffer*)calloc(1,sizeof(TraceBuffer));
+    if(theMine) {
+      snprintf(theMine->thread,sizeof(theMine->thread),"thread %d",theBufferCount+1);
+      theBuffers[theBufferCount]=theMine;
+      TRACE_RELEASE(&theBufferCount,theBufferCount+1);
+    }
+  }
+  trace_unlock();
+  if(!theMine) {
+    theMineFailed=true;
+    LOG(LOG_MAIN, LOG_WARN, "trace: more than %d threads, not tracing this one\n", TRACE_THREADS);
+  }
+  return theMine;
+}
+
+static inline void trace_put(int name, char ph, uint64_t ts, uint32_t dur, uint32_t id, uint32_t arg) {
+  TraceBuffer *b=trace_mine();
+  if(!b) { return; }
+  uint64_t h=b->head;
+  TraceEvent &e=b->events[h&(TRACE_EVENTS-1)];
+  e.ts=ts;
+  e.dur=dur;
+  e.arg=arg;
+  e.id=id;
+  e.name=(uint8_t)name;
+  e.ph=ph;
+  TRACE_RELEASE(&b->head,h+1);
+}
+
+//
+// A span from start to now, on this thread
+//
+void traceSpan(int name, uint64_t start, uint32_t arg) {
+  uint64_t now=traceNow();
+  trace_put(name, 'X', start, (uint32_t)(now-start), 0, arg);
+}
+
+//
+// One end of something that crosses threads: s/f for a flow (pipe write/read), b/e for
+// an async span (send/ack).  Both ends use the same id, from traceNextId().
+//
+void traceFlow(int name, char ph, uint32_t id, uint32_t arg) {
+  trace_put(name, ph, traceNow(), 0, id, arg);
+}
+
+uint32_t traceNextId() {
+  uint32_t id=TRACE_ADD(&theTraceIds,1);
+  return id ? id : TRACE_ADD(&theTraceIds,1);            // 0 means untraced
+}
+
+void traceThreadName(const char *name) {
+  TraceBuffer *b=trace_mine();
+  if(b && strcmp(b->thread,name)) { snprintf(b->thread,sizeof(b->thread),"%s",name); }
+}
+
+//
+// Trace to path from now on, 0 to stop (writing out what was recorded first)
+//
+void traceSetFile(const char *path) {
+#ifndef __LINUX__
+  static bool init=false;
+  if(!init) { InitializeCriticalSection(&theTraceLock); init=true; }
+#endif
+  if(!path) {
+    if(theTraceOn) { traceDump(); }
+    theTraceOn=0;
+    return;
+  }
+  trace_lock();
+  snprintf(theTracePath,sizeof(theTracePath),"%s",path);
+  trace_unlock();
+  if(!theTraceOn) { LOG(LOG_MAIN, LOG_INFO, "Tracing to %s on SIGQUIT\n", path); }
+  theTraceOn=1;
+}
+
+static const char *TRACE_ARG_NAMES[]={"bytes", "opcode", "op", "op", "mode", "", "acked"};
+
+//
+// Write every ring to the trace file as Chrome trace json.  Safe from any thread, while
+// the rings are being written.  Returns the number of events written, -1 on error.
+//
+int traceDump() {
+  char tmp[520];
+  int count=0, dropped=0;
+  if(!theTracePath[0]) { return -1; }                     // never traced
+  trace_lock();
+  snprintf(tmp,sizeof(tmp),"%s.tmp",theTracePath);
+  FILE *f=fopen(tmp,"w");
+  if(!f) {
+    LOG(LOG_MAIN, LOG_ERROR, "trace: can not write %s\n", tmp);
+    trace_unlock();
+    return -1;
+  }
+  TraceEvent *copy=(TraceEvent*)malloc(sizeof(TraceEvent)*TRACE_EVENTS);
+  fprintf(f,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(f,"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Flic2MQTT\"}}");
+  for(int t=0;copy && t<theBufferCount;t++) {
+    TraceBuffer *b=theBuffers[t];
+    fprintf(f,",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",t+1,b->thread);
+    uint64_t head=b->head;
+    //
+    // the slot after the newest event may already be taking the next one, so a full ring
+    // gives TRACE_EVENTS-1 events
+    //
+    uint64_t base=head>=TRACE_EVENTS ? head+1-TRACE_EVENTS : 0, from=base;
+    for(uint64_t i=from;i<head;i++) { copy[i-base]=b->events[i&(TRACE_EVENTS-1)]; }
+    //
+    // anything the writer reached again while we copied is not what we think it is: with
+    // the head at lapped it has overwritten up to event lapped-TRACE_EVENTS and may be part
+    // way through writing that slot, so only events after it are good
+    //
+    TRACE_ACQUIRE();
+    uint64_t lapped=b->head;
+    if(lapped+1>TRACE_EVENTS && lapped+1-TRACE_EVENTS>from) {
+      uint64_t good=lapped+1-TRACE_EVENTS<head ? lapped+1-TRACE_EVENTS : head;
+      dropped+=(int)(good-from);
+      from=good;
+    }
+    for(uint64_t i=from;i<head;i++) {
+      TraceEvent &e=copy[i-base];
+      if(e.name>=TRACE_NAMES) { continue; }
+      fprintf(f,",\n{\"name\":\"%s\",\"cat\":\"f2m\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%d",
+              TRACE_NAME_STRINGS[e.name],e.ph,(unsigned long long)e.ts,t+1);
+      if(e.ph=='X') { fprintf(f,",\"dur\":%u",e.dur); }
+      else          { fprintf(f,",\"id\":%u",e.id);   }
+      if(e.ph=='f') { fprintf(f,",\"bp\":\"e\""); }
+      if(TRACE_ARG_NAMES[e.name][0]) { fprintf(f,",\"args\":{\"%s\":%u}",TRACE_ARG_NAMES[e.name],e.arg); }
+      fprintf(f,"}");
+      count++;
+    }
+  }
+  fprintf(f,"\n]}\n");
+  free(copy);
+  bool bad=ferror(f)!=0;
+  if(fclose(f) || bad) {
+    LOG(LOG_MAIN, LOG_ERROR, "trace: writing %s failed\n", tmp);
+    trace_unlock();
+    return -1;
+  }
+#ifndef __LINUX__
+  remove(theTracePath);
+#endif
+  if(rename(tmp,theTracePath)) {
+    LOG(LOG_MAIN, LOG_ERROR, "trace: can not rename %s to %s\n", tmp, theTracePath);
+    trace_unlock();
+    return -1;
+  }
+  LOG(LOG_MAIN, LOG_INFO, "trace: %d events from %d threads written to %s%s\n", count, (int)theBufferCount, theTracePath, dropped ? " (some overwritten while writing)" : "");
+  trace_unlock();
+  return count;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _TRACEH
+#define _TRACEH
+
+#include <stdint.h>
+#include "Log.h"
+
+//
+// Event lifecycle tracing.  With TRACE_FILE set every thread that records anything gets
+// its own ring of the last TRACE_EVENTS events, written by that thread alone with no locks
+// and no read-modify-writes, just a release store of the ring's head after each event.
+// SIGQUIT (Ctrl-\, or Ctrl-Break on Windows), a clean stop, or taking TRACE_FILE out of
+// the config writes the rings to TRACE_FILE as Chrome trace json, which loads in Perfetto
+// (ui.perfetto.dev) or chrome://tracing.
+//
+// Off, a trace point is one load of theTraceOn:
+//
+//   uint64_t t0=TRACE_ON() ? traceNow() : 0;
+//   ... work ...
+//   if(t0) { traceSpan(TRACE_DECODE, t0, opcode); }
+//
+#define TRACE_RECV       0    // flicd socket recv that returned data (arg bytes)
+#define TRACE_DECODE     1    // one flicd packet decoded and handled (arg opcode)
+#define TRACE_PIPE       2    // pipe message, a flow from write to read (id rides in the message, see flicd_client.h)
+#define TRACE_DISPATCH   3    // looper handling one pipe message (arg op)
+#define TRACE_GESTURE    4    // gesture evaluated and published (arg BUTT_xxx)
+#define TRACE_SEND       5    // MQTTAsync_sendMessage call
+#define TRACE_ACK        6    // sendMessage to pahoOnSend/pahoOnSendFailure, async (arg 1 acked, 0 failed)
+#define TRACE_NAMES      7
+
+static const char *TRACE_NAME_STRINGS[]={"flicd recv", "decode", "pipe", "dispatch", "gesture", "MQTTAsync_sendMessage", "broker ack"};
+
+#define TRACE_EVENTS     65536  // per thread ring (power of 2)
+#define TRACE_THREADS    16     // most threads traced
+
+struct TraceEvent {
+  uint64_t ts;                  // us, traceNow()
+  uint32_t dur;                 // us, spans
+  uint32_t arg;
+  uint32_t id;                  // flow/async id
+  uint8_t name;                 // TRACE_xxx
+  char ph;                      // chrome trace phase: X span, s/f flow, b/e async
+  uint16_t unused;
+};
+
+extern int volatile theTraceOn;
+
+#define TRACE_ON() LOG_UNLIKELY(theTraceOn)
+
+extern uint64_t traceNow();
+extern void traceSpan(int name, uint64_t start, uint32_t arg=0);
+extern void traceFlow(int name, char ph, uint32_t id, uint32_t arg=0);
+extern uint32_t traceNextId();
+extern void traceThreadName(const char *name);
+extern void traceSetFile(const char *path);
+extern int traceDump();
+
+#endif
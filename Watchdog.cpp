@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Stall watchdog.  The stages only ever store a tick or bump a counter in their own slot,
+// so a heartbeat costs an atomic add and never waits on the watchdog.  The watchdog thread
+// reads the slots without a lock; a torn view only delays a report by one check.  Reports
+// are published by the main thread, like everything else that goes to paho: the watchdog
+// thread keeps the latest one under a lock and asks for it to be sent.
+//
+
+#ifdef __LINUX__
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define Sleep(xxx) usleep(xxx*1000)
+#define WD_ADD(ptr,v) __sync_fetch_and_add(ptr,v)
+#else
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#define WD_ADD(ptr,v) InterlockedExchangeAdd((LONG volatile*)(ptr),v)
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include "global.h"
+#include "Watchdog.h"
+#include "Log.h"
+
+static WatchdogSlot theSlots[WD_STAGES];
+static uint32_t volatile theThresholdMs;       // 0 = no stall checks (sd_notify still runs)
+static uint32_t theNotifyMs;                    // WATCHDOG=1 period, half of systemd's WATCHDOG_USEC, 0 none
+static void (*theReportDue)();
+static bool theStarted=false;
+static char theReport[512];                     // latest stall report json, under theReportLock
+static bool theReportPosted=false;              // theReportDue called, watchdogFormat not yet
+
+#ifdef __LINUX__
+static pthread_mutex_t theReportLock=PTHREAD_MUTEX_INITIALIZER;
+static void report_lock()   { pthread_mutex_lock(&theReportLock);   }
+static void report_unlock() { pthread_mutex_unlock(&theReportLock); }
+#else
+static CRITICAL_SECTION theReportLock;
+static void report_lock()   { EnterCriticalSection(&theReportLock); }
+static void report_unlock() { LeaveCriticalSection(&theReportLock); }
+#endif
+
+static uint32_t watchdog_tick() {
+#ifdef __LINUX__
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint32_t)(ts.tv_sec*1000+(ts.tv_nsec/1000000));
+#else
+  return (uint32_t)GetTickCount();
+#endif
+}
+
+//
+// Progress without a queue (the reader's once a second wake up)
+//
+void watchdogBeat(int stage) {
+  theSlots[stage].tick=watchdog_tick();
+}
+
+//
+// Work handed to stage.  An idle stage's clock starts now, not at its last progress.
+//
+void watchdogIn(int stage) {
+  WatchdogSlot &s=theSlots[stage];
+  if(s.in==s.out) { s.tick=watchdog_tick(); }
+  WD_ADD(&s.in,1);
+}
+
+void watchdogOut(int stage) {
+  WatchdogSlot &s=theSlots[stage];
+  s.tick=watchdog_tick();
+  WD_ADD(&s.out,1);
+}
+
+//
+// Forget the work handed to stage, e.g. paho's in flight messages when the broker
+// connection drops: waiting on a dead connection is not a stall.
+//
+void watchdogReset(int stage) {
+  WatchdogSlot &s=theSlots[stage];
+  s.tick=watchdog_tick();
+  s.out=s.in;
+}
+
+void watchdogSetThreshold(int seconds) {
+  theThresholdMs=seconds>0 ? (uint32_t)seconds*1000 : 0;
+}
+
+//
+// sd_notify(3) without libsystemd: one datagram to $NOTIFY_SOCKET.  A no-op when not run
+// by systemd with Type=notify, and on Windows.
+//
+void watchdogNotify(const char *state) {
+#ifdef __LINUX__
+  const char *path=getenv("NOTIFY_SOCKET");
+  if(!path || (path[0]!='/' && path[0]!='@')) { return; }
+  struct sockaddr_un sa;
+  size_t len=strlen(path);
+  if(len>=sizeof(sa.sun_path)) { return; }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family=AF_UNIX;
+  memcpy(sa.sun_path, path, len);
+  if(sa.sun_path[0]=='@') { sa.sun_path[0]=0; }         // abstract namespace
+  int fd=socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+  if(fd<0) { return; }
+  if(sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr*)&sa, offsetof(struct sockaddr_un, sun_path)+len)<0) {
+    LOG(LOG_MAIN, LOG_WARN, "sd_notify %s: %s\n", state, strerror(errno));
+  }
+  close(fd);
+#endif
+}
+
+//
+// One look at every stage.  Stalls and recoveries are logged and reported as they happen;
+// true while nothing is stalled.
+//
+static bool watchdog_check(uint32_t now) {
+  uint32_t limit=theThresholdMs;
+  uint32_t idle[WD_STAGES], depth[WD_STAGES];
+  bool stalled[WD_STAGES];
+  bool healthy=true, changed=false;
+
+  for(int i=0;i<WD_STAGES;i++) {
+    WatchdogSlot &s=theSlots[i];
+    depth[i]=s.in-s.out;
+    if(depth[i]>0x80000000u) { depth[i]=0; }            // late completions after a reset
+    idle[i]=now-s.tick;
+    if(idle[i]>0x80000000u) { idle[i]=0; }              // beat after now was read
+    stalled[i]=limit && idle[i]>limit && (i==WD_READER || depth[i]);
+    if(stalled[i]) {
+      healthy=false;
+      if(!s.stalledTick) {
+        LOG(LOG_MAIN, LOG_ERROR, "Watchdog: %s stalled, no progress for %ums with %u waiting\n", WD_STAGE_NAMES[i], idle[i], depth[i]);
+        s.stalledTick=now|1;
+        changed=true;
+      }
+    } else if(s.stalledTick) {
+      LOG(LOG_MAIN, LOG_WARN, "Watchdog: %s moving again after %ums\n", WD_STAGE_NAMES[i], now-s.stalledTick+limit);
+      s.stalledTick=0;
+      changed=true;
+    }
+  }
+  //
+  // only the newest report matters, so one request to the main thread at a time; while it
+  // is stuck the report waits and goes out with whatever the state is when it is not
+  //
+  if(changed && theReportDue) {
+    char json[sizeof(theReport)];
+    int len=snprintf(json, sizeof(json), "{\"healthy\":%s,\"stages\":[", healthy ? "true" : "false");
+    for(int i=0;i<WD_STAGES;i++) {
+      len+=snprintf(json+len, sizeof(json)-len, "%s{\"stage\":\"%s\",\"idle_ms\":%u,\"depth\":%u,\"stalled\":%s}",
+                    i ? "," : "", WD_STAGE_NAMES[i], idle[i], depth[i], stalled[i] ? "true" : "false");
+    }
+    snprintf(json+len, sizeof(json)-len, "]}");
+    report_lock();
+    memcpy(theReport, json, sizeof(theReport));
+    bool post=!theReportPosted;
+    theReportPosted=true;
+    report_unlock();
+    if(post) { theReportDue(); }
+  }
+  return healthy;
+}
+
+#ifdef __LINUX__
+static void *watchdog_thread(void *param)
+#else
+static DWORD WINAPI watchdog_thread(LPVOID param)
+#endif
+{
+  int sleepMs=theNotifyMs && theNotifyMs<1000 ? (int)theNotifyMs : 1000;
+  uint32_t notifyTick=watchdog_tick();
+  for(;;) {
+    Sleep(sleepMs);
+    uint32_t now=watchdog_tick();
+    bool healthy=watchdog_check(now);
+    if(theNotifyMs && healthy && now-notifyTick>=theNotifyMs-sleepMs) {
+      watchdogNotify("WATCHDOG=1");
+      notifyTick=now;
+    }
+  }
+  return 0;
+}
+
+//
+// The latest stall report json, for the main thread once reportDue has asked for it.
+// Returns its length, 0 before the first report.
+//
+int watchdogFormat(char *buf, int sz) {
+  if(!theStarted || sz<=0) { return 0; }
+  report_lock();
+  int len=snprintf(buf, sz, "%s", theReport);
+  theReportPosted=false;
+  report_unlock();
+  return len<sz ? len : sz-1;
+}
+
+//
+// Start watching, stall threshold seconds (0 = only keep systemd informed).  reportDue is
+// called on the watchdog thread whenever a stage stalls or recovers; it should only hand
+// off to the main thread, which fetches the report with watchdogFormat().  Call once the
+// reader is running and the broker connection has been started.
+//
+bool watchdogStart(int seconds, void (*reportDue)()) {
+  if(theStarted) { return true; }
+  uint32_t now=watchdog_tick();
+  for(int i=0;i<WD_STAGES;i++) {
+    theSlots[i].tick=now;
+    theSlots[i].stalledTick=0;
+  }
+  watchdogSetThreshold(seconds);
+  theReportDue=reportDue;
+#ifndef __LINUX__
+  InitializeCriticalSection(&theReportLock);
+#endif
+#ifdef __LINUX__
+  const char *usec=getenv("WATCHDOG_USEC");
+  const char *pid=getenv("WATCHDOG_PID");
+  if(usec && (!pid || atol(pid)==(long)getpid())) {
+    theNotifyMs=(uint32_t)(strtoull(usec, 0, 10)/2000);
+    if(theNotifyMs<100) { theNotifyMs=100; }
+  }
+  pthread_t tid;
+  if(pthread_create(&tid, NULL, watchdog_thread, NULL)) { return false; }
+  pthread_detach(tid);
+#else
+  HANDLE h=CreateThread(NULL, 0, watchdog_thread, NULL, 0, NULL);
+  if(!h) { return false; }
+  CloseHandle(h);
+#endif
+  theStarted=true;
+  watchdogNotify("READY=1");
+  if(theThresholdMs || theNotifyMs) {
+    LOG(LOG_MAIN, LOG_INFO, "Watchdog: stall after %ds%s\n", seconds, theNotifyMs ? ", systemd watchdog on" : "");
+  }
+  return true;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _WATCHDOGH
+#define _WATCHDOGH
+
+#include <stdint.h>
+
+//
+// Stall watchdog.  Each stage of the event path keeps a heartbeat slot: the tick of its
+// last progress plus counts of work handed to it and work it finished.  A watchdog
+// thread checks the slots every second or so and reports a stage that has work waiting
+// (or, for the reader, any stage at all) but has not moved for WATCHDOG seconds.  Under
+// systemd (NOTIFY_SOCKET set) it also sends READY=1, and WATCHDOG=1 only while healthy.
+//
+#define WD_READER     0   // flicd reader thread; wakes at least once a second, so must always beat
+#define WD_DISPATCH   1   // looper: pipe messages from the reader waiting to be handled
+#define WD_PUBLISH    2   // main thread inside a paho send call
+#define WD_PAHO       3   // paho callback thread: messages waiting for the broker's ack
+#define WD_STAGES     4
+
+static const char *WD_STAGE_NAMES[]={"reader", "dispatch", "publish", "paho"};
+
+//
+// One cache line each so the stages, which run on different threads, never share one
+//
+struct alignas(64) WatchdogSlot {
+  uint32_t volatile tick;       // last progress, or when work arrived at an idle stage
+  uint32_t volatile in;         // work handed to the stage
+  uint32_t volatile out;        // work it has finished
+  uint32_t stalledTick;         // watchdog thread only: when the stall was reported, 0 none
+};
+
+extern void watchdogBeat(int stage);
+extern void watchdogIn(int stage);
+extern void watchdogOut(int stage);
+extern void watchdogReset(int stage);
+extern bool watchdogStart(int seconds, void (*reportDue)());
+extern int watchdogFormat(char *buf, int sz);
+extern void watchdogSetThreshold(int seconds);
+extern void watchdogNotify(const char *state);
+
+#endif
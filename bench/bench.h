@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _BENCHH
+#define _BENCHH
+
+//
+// Shared bits for the microbenchmarks in this directory (make bench).  Each case is run
+// BENCH_ROUNDS times, interleaved with the others, and the best round is reported so a
+// busy machine shows up as noise in one round rather than in the result.
+//
+
+#ifdef __LINUX__
+#include <time.h>
+#else
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <stdint.h>
+
+#define BENCH_ROUNDS 15
+
+static inline double benchNow() {
+#ifdef __LINUX__
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+#else
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if(!freq.QuadPart) { QueryPerformanceFrequency(&freq); }
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart/freq.QuadPart;
+#endif
+}
+
+//
+// Best (shortest) ns per iteration of each case
+//
+struct BenchCase {
+  const char *name;
+  void (*run)(int iters);
+  double best;
+};
+
+static inline void benchRun(BenchCase *cases, int ncases, int iters) {
+  for(int c=0;c<ncases;c++) { cases[c].best=1e30; cases[c].run(iters/10); }    // warm up
+  for(int r=0;r<BENCH_ROUNDS;r++) {
+    for(int c=0;c<ncases;c++) {
+      double t0=benchNow();
+      cases[c].run(iters);
+      double ns=(benchNow()-t0)*1e9/iters;
+      if(ns<cases[c].best) { cases[c].best=ns; }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// flicd event decoding: the table decoder (flicd_client_decoder.h) against the pointer
+// casts it replaced, on a stream of button events with all four button opcodes mixed.
+//
+//   cast   the old reader: switch on the opcode, cast the buffer to EvtButtonEvent
+//   table  decodeEvent(), one indirect call through the opcode table per packet
+//   hot    decodeEventHot(), the button opcodes decoded inline as flicd_client.cpp does
+//
+// Every case hands the same three fields to the same sink.  table and hot also check the
+// packet length and click_type range, which cast never did.
+//
+
+#include <string.h>
+#include "../flicd_client_decoder.h"
+#include "bench.h"
+
+using namespace FlicClientProtocol;
+
+#define PACKETS 1024                        // power of 2
+
+static uint8_t thePackets[PACKETS][sizeof(EvtButtonEvent)];
+static uint64_t volatile theSink;
+
+static void on_button(const EvtButtonEvent &evt, const uint8_t *tail, int tailCount) {
+  theSink+=evt.base.conn_id+evt.click_type+evt.time_diff;
+}
+
+static int on_other(const uint8_t *pkt, int len) { return DECODE_BAD_OPCODE; }
+
+#define BUTTON EVENT(EvtButtonEvent, EvtButtonEventFields, on_button)
+
+static const EventDecoder TABLE[]={
+  on_other, on_other, on_other, on_other, BUTTON, BUTTON, BUTTON, BUTTON,
+  on_other, on_other, on_other, on_other, on_other, on_other, on_other, on_other,
+  on_other, on_other, on_other, on_other, on_other
+};
+
+static void run_cast(int iters) {
+  for(int i=0;i<iters;i++) {
+    const uint8_t *pkt=thePackets[i&(PACKETS-1)];
+    switch(pkt[0]) {
+      case EVT_BUTTON_UP_OR_DOWN_OPCODE:
+      case EVT_BUTTON_CLICK_OR_HOLD_OPCODE:
+      case EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OPCODE:
+      case EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OR_HOLD_OPCODE: {
+        const EvtButtonEvent *evt=(const EvtButtonEvent*)pkt;
+        theSink+=evt->base.conn_id+evt->click_type+evt->time_diff;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
+
+static void run_table(int iters) {
+  for(int i=0;i<iters;i++) {
+    decodeEvent(TABLE, (int)(sizeof(TABLE)/sizeof(EventDecoder)), thePackets[i&(PACKETS-1)], sizeof(EvtButtonEvent));
+  }
+}
+
+static void run_hot(int iters) {
+  for(int i=0;i<iters;i++) {
+    decodeEventHot<EVT_BUTTON_UP_OR_DOWN_OPCODE, EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OR_HOLD_OPCODE, BUTTON>
+                  (TABLE, (int)(sizeof(TABLE)/sizeof(EventDecoder)), thePackets[i&(PACKETS-1)], sizeof(EvtButtonEvent));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  for(int i=0;i<PACKETS;i++) {
+    uint8_t *p=thePackets[i];
+    memset(p, 0, sizeof(EvtButtonEvent));
+    p[0]=EVT_BUTTON_UP_OR_DOWN_OPCODE+(i&3);
+    p[1]=(uint8_t)(i%12);                   // conn_id
+    p[5]=(uint8_t)(i%6);                    // click_type
+    p[7]=(uint8_t)i;                        // time_diff
+  }
+  BenchCase cases[]={{"cast", run_cast}, {"table", run_table}, {"hot", run_hot}};
+  int n=(int)(sizeof(cases)/sizeof(cases[0]));
+  benchRun(cases, n, 20000000);
+  printf("decoder, %d byte button events, best of %d:\n", (int)sizeof(EvtButtonEvent), BENCH_ROUNDS);
+  for(int c=0;c<n;c++) {
+    printf("  %-6s %6.2f ns/pkt %7.1f Mpkt/s  %5.2fx cast\n", cases[c].name, cases[c].best, 1e3/cases[c].best, cases[0].best/cases[c].best);
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Gesture payload rendering: a compiled PAYLOAD_EVENT template (Payload.cpp) against the
+// snprintf it saves, for the same six field json.
+//
+//   snprintf  one format string, parsed on every call
+//   template  PayloadTemplate::render(), the op list walked with numbers converted by hand
+//
+// snprintf does not json escape the button name; template does.
+//
+
+#include <string.h>
+#include <string>
+#include "../Payload.h"
+#include "bench.h"
+
+#define TEMPLATE "{\"button\":\"${name}\",\"event\":\"${event}\",\"ms\":${ms},\"queued\":${queued},\"seq\":${seq},\"time\":\"${time}\"}"
+
+static PayloadTemplate theTemplate;
+static char theBuf[PAYLOAD_MAX];
+static uint64_t volatile theSink;
+
+static const char *NAMES[]={"butt0", "kitchen", "hall \"left\""};
+static const char *EVENTS[]={"click", "double_click", "hold"};
+
+static void run_snprintf(int iters) {
+  for(int i=0;i<iters;i++) {
+    int n=snprintf(theBuf, sizeof(theBuf),
+                   "{\"button\":\"%s\",\"event\":\"%s\",\"ms\":%llu,\"queued\":%s,\"seq\":%llu,\"time\":\"%s\"}",
+                   NAMES[i%3], EVENTS[i%3], 1792347302123ULL+i, (i&7) ? "false" : "true",
+                   (unsigned long long)i, "Sun Oct 18 18:15:02 2026");
+    theSink+=n;
+  }
+}
+
+static void run_template(int iters) {
+  PayloadFields f;
+  memset(&f, 0, sizeof(f));
+  f.source="127.0.0.1:5551";
+  f.time="Sun Oct 18 18:15:02 2026";
+  for(int i=0;i<iters;i++) {
+    f.name=NAMES[i%3];
+    f.event=EVENTS[i%3];
+    f.ms=1792347302123ULL+i;
+    f.queued=(i&7)==0;
+    f.seq=i;
+    theSink+=theTemplate.render(theBuf, sizeof(theBuf), f);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::string error;
+  if(!theTemplate.compile(TEMPLATE, error)) {
+    printf("template: %s\n", error.c_str());
+    return 1;
+  }
+  BenchCase cases[]={{"snprintf", run_snprintf}, {"template", run_template}};
+  int n=(int)(sizeof(cases)/sizeof(cases[0]));
+  benchRun(cases, n, 2000000);
+  printf("gesture payload, six field json, best of %d:\n", BENCH_ROUNDS);
+  for(int c=0;c<n;c++) {
+    printf("  %-9s %7.1f ns/event  %5.2fx snprintf\n", cases[c].name, cases[c].best, cases[0].best/cases[c].best);
+  }
+  return 0;
+}
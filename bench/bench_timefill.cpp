@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Gesture timestamps: timeFill() as it was against the TimeFormatter (TimeFormat.cpp)
+// that replaced it, in each TIME_FORMAT.
+//
+//   old      time(), localtime(), asctime() and sprintf on every call
+//   asctime  TimeFormatter, the default format (same text as old)
+//   iso      TimeFormatter, 2026-10-18T18:15:02.123+02:00
+//   epoch    TimeFormatter, ms since 1970
+//
+// Every case reads the clock once per call, as timeFill() does.
+//
+
+#include <string.h>
+#include "../TimeFormat.h"
+#include "bench.h"
+
+static char theBuf[TIME_MAX];
+static uint64_t volatile theSink;
+
+static void run_old(int iters) {
+  for(int i=0;i<iters;i++) {
+    time_t clock;
+    time(&clock);
+    sprintf(theBuf,"%.24s", asctime(localtime(&clock)));
+    theSink+=theBuf[23];
+  }
+}
+
+static void run_format(int format, int iters) {
+  TimeFormatter tf(format);
+  for(int i=0;i<iters;i++) {
+    theSink+=tf.render(theBuf, TIME_MAX, timeNowMs());
+  }
+}
+
+static void run_asctime(int iters) { run_format(TIME_FORMAT_ASCTIME, iters); }
+static void run_iso(int iters) { run_format(TIME_FORMAT_ISO, iters); }
+static void run_epoch(int iters) { run_format(TIME_FORMAT_EPOCH, iters); }
+
+int main(int argc, char *argv[]) {
+  BenchCase cases[]={{"old", run_old}, {"asctime", run_asctime}, {"iso", run_iso}, {"epoch", run_epoch}};
+  int n=(int)(sizeof(cases)/sizeof(cases[0]));
+  benchRun(cases, n, 200000);
+  printf("gesture timestamp, best of %d:\n", BENCH_ROUNDS);
+  for(int c=0;c<n;c++) {
+    printf("  %-8s %7.1f ns/call  %5.2fx old\n", cases[c].name, cases[c].best, cases[0].best/cases[c].best);
+  }
+  return 0;
+}
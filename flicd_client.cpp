@@ -20,8 +20,17 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string>
+#include <map>
 #include <sys/types.h>
+#include "global.h"
 #include "flicd_client.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "MetaCache.h"
+#include "Presence.h"
+#include "Stats.h"
+#include "Watchdog.h"
+#include "Trace.h"
 
 #ifdef __GNUC__
 #include <unistd.h>
@@ -46,6 +55,7 @@
 #endif
 
 #include "flicd_client_protocol_packets.h"
+#include "flicd_client_decoder.h"
 extern int thePipeW;     // the pipe to use to send flic info to the main thread
 
 using namespace std;
@@ -53,16 +63,59 @@ using namespace FlicClientProtocol;
 
 #ifdef __LINUX__
 #include <pthread.h>
+#include <time.h>
 #define __LOOPWHILE EAGAIN
 static pthread_t theFlicdReaderHandle;    // Handle of Flicd reader
+static pthread_mutex_t theFlicdWriteLock=PTHREAD_MUTEX_INITIALIZER;  // serializes writes and socket swaps
 #define _write write
 #define DWORD unsigned long
+#define Sleep(xxx) usleep(xxx*1000)
+static DWORD GetTickCount() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000+(ts.tv_nsec/1000000);
+}
+static uint64_t flicd_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000000+(ts.tv_nsec/1000);
+}
+static void write_lock()   { pthread_mutex_lock(&theFlicdWriteLock);   }
+static void write_unlock() { pthread_mutex_unlock(&theFlicdWriteLock); }
 #else
 #define __LOOPWHILE WSAETIMEDOUT
 static DWORD theFlicdReaderTid;             // Thread identifier of Flicd reader
 static HANDLE theFlicdReaderHandle;         // Handle of Flicd reader
+static CRITICAL_SECTION theFlicdWriteLock;  // serializes writes and socket swaps
+static uint64_t flicd_usec() {
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart/freq.QuadPart)*1000000+((now.QuadPart%freq.QuadPart)*1000000)/freq.QuadPart;
+}
+static void write_lock()   { EnterCriticalSection(&theFlicdWriteLock); }
+static void write_unlock() { LeaveCriticalSection(&theFlicdWriteLock); }
 #endif
 
+static const char *theFlicdHost=0;          // where flicd lives (kept for reconnects)
+static int theFlicdPort=0;
+static int volatile theFlicdSock=-1;        // current flicd socket (-1 while relinking)
+
+//
+// Every connection channel we asked for, keyed by conn_id.  Replayed on reconnect.
+//
+static map<uint32_t, CmdCreateConnectionChannel> theChannels;
+
+//
+// Same for battery listeners, keyed by listener_id
+//
+static map<uint32_t, CmdCreateBatteryStatusListener> theBatteryListeners;
+
+//
+// And scanners, keyed by scan_id
+//
+static map<uint32_t, CmdCreateScanner> theScanners;
+
 static const char* CreateConnectionChannelErrorStrings[] = {
   "NoError",
   "MaxPendingConnectionsReached"
@@ -208,31 +261,6 @@ struct Bdaddr {
   bool operator<(const Bdaddr& o) const { return memcmp(addr, o.addr, 6) < 0; }
 };
 
-static void write_packet(int fd, void* buf, int len) {
-  //uint8_t new_buf[2 + len];  // bogus code from upstream
-  uint8_t new_buf[4096];
-  assert(len<4094);
-  new_buf[0] = len & 0xff;
-  new_buf[1] = len >> 8;
-  memcpy(new_buf + 2, buf, len);
-  fprintf(stderr,"Sending flicd client command : %s\n",FLICD_CMDS[*(unsigned char *)buf]);
-  
-  int pos = 0;
-  int left = 2 + len;
-  while(left) {
-    int res = send(fd, (const char *)(new_buf + pos), left, 0);
-    if (res < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-      perror("write");
-      exit(1);
-    }
-    pos += res;
-    left -= res;
-  }
-}
-
 static Bdaddr read_bdaddr(const char *buf) {
   char addr[32];
   sscanf(buf, "%s", addr);
@@ -242,6 +270,403 @@ static Bdaddr read_bdaddr(const char *buf) {
   return Bdaddr(addr);
 }
 
+//
+// Outstanding requests waiting on an answer from flicd, keyed by kind and conn_id /
+// listener_id / ping_id / Bdaddr.  getInfo has no key so those are answered in order
+// using a sequence number.  Guarded by the write lock.
+//
+struct FlicdRequest {
+  FlicdCallback cb;
+  void *context;
+  DWORD issued;
+  DWORD timeoutMs;           // 0 = wait forever
+};
+static map<uint64_t, FlicdRequest> theRequests;
+static uint64_t theGetInfoSeq=0;
+
+#define REQ_KEY(kind,key) ((((uint64_t)(kind))<<56) | ((uint64_t)(key) & 0x00ffffffffffffffULL))
+
+static uint64_t bdaddr_key(const uint8_t *addr) {
+  uint64_t k=0;
+  for(int i=5;i>=0;i--) { k=(k<<8)|addr[i]; }
+  return k;
+}
+
+//
+// Remember a request.  A duplicate key supersedes the older request which is failed.
+//
+static void flicd_request_add(int kind, uint64_t key, FlicdCallback cb, void *context, int timeoutMs) {
+  FlicdRequest req, old;
+  bool superseded=false;
+  req.cb=cb;
+  req.context=context;
+  req.issued=GetTickCount();
+  req.timeoutMs=timeoutMs;
+  write_lock();
+  if(kind==FLICD_REQ_GETINFO) { key=theGetInfoSeq++; }
+  map<uint64_t, FlicdRequest>::iterator it=theRequests.find(REQ_KEY(kind,key));
+  if(it!=theRequests.end()) {
+    old=it->second;
+    superseded=true;
+  }
+  theRequests[REQ_KEY(kind,key)]=req;
+  write_unlock();
+  if(superseded && old.cb) { old.cb(old.context, FLICD_RESULT_ERROR, 0, 0, req.issued-old.issued); }
+}
+
+//
+// flicd answered.  Pop the matching request (the oldest one for getInfo) and run its callback.
+//
+static void flicd_request_complete(int kind, uint64_t key, int result, const void *evt, int len) {
+  FlicdRequest req;
+  write_lock();
+  map<uint64_t, FlicdRequest>::iterator it;
+  if(kind==FLICD_REQ_GETINFO) {
+    it=theRequests.lower_bound(REQ_KEY(kind,0));
+    if(it!=theRequests.end() && (it->first>>56)!=(uint64_t)kind) { it=theRequests.end(); }
+  } else {
+    it=theRequests.find(REQ_KEY(kind,key));
+  }
+  if(it==theRequests.end()) {
+    write_unlock();
+    return;
+  }
+  req=it->second;
+  theRequests.erase(it);
+  write_unlock();
+
+  DWORD latency=GetTickCount()-req.issued;
+  if(kind==FLICD_REQ_CONNECT && result==FLICD_RESULT_OK) {
+    metricSet(METRIC_FLICD_CONNECT_READY_MS,latency);
+    metricMax(METRIC_FLICD_CONNECT_READY_MAXMS,latency);
+  }
+  if(result==FLICD_RESULT_TIMEOUT) { metricAdd(METRIC_FLICD_REQUEST_TIMEOUTS,1); }
+  if(req.cb) { req.cb(req.context, result, evt, len, latency); }
+}
+
+//
+// Time out overdue requests.  Cheap to call often; only looks at the table every 250ms.
+//
+static void flicd_request_expire() {
+  static DWORD nextSweep=0;
+  DWORD now=GetTickCount();
+  if((long)(now-nextSweep)<0) { return; }
+  nextSweep=now+250;
+
+  vector<uint64_t> expired;
+  write_lock();
+  for(map<uint64_t, FlicdRequest>::iterator it=theRequests.begin();it!=theRequests.end();++it) {
+    if(it->second.timeoutMs && now-it->second.issued>=it->second.timeoutMs) { expired.push_back(it->first); }
+  }
+  write_unlock();
+  for(size_t i=0;i<expired.size();i++) {
+    flicd_request_complete((int)(expired[i]>>56), expired[i] & 0x00ffffffffffffffULL, FLICD_RESULT_TIMEOUT, 0, 0);
+  }
+}
+
+//
+// The link dropped.  Everything but connects is lost with it.  Connect requests stay since
+// the resync re-creates their channels, so connect-to-ready latency spans the relink.
+//
+static void flicd_request_fail_all() {
+  vector<uint64_t> lost;
+  write_lock();
+  for(map<uint64_t, FlicdRequest>::iterator it=theRequests.begin();it!=theRequests.end();++it) {
+    if((it->first>>56)!=FLICD_REQ_CONNECT) { lost.push_back(it->first); }
+  }
+  write_unlock();
+  for(size_t i=0;i<lost.size();i++) {
+    flicd_request_complete((int)(lost[i]>>56), lost[i] & 0x00ffffffffffffffULL, FLICD_RESULT_LINKDOWN, 0, 0);
+  }
+}
+
+//
+// FlicdFuture - lets a caller poll or wait for a single result instead of supplying a callback
+//
+FlicdFuture::FlicdFuture() {
+  done=false;
+  result=FLICD_RESULT_OK;
+  latencyMs=0;
+  len=0;
+}
+
+void FlicdFuture::callback(void *context, int result, const void *evt, int evtLen, unsigned long latencyMs) {
+  FlicdFuture *f=(FlicdFuture*)context;
+  if(evtLen>(int)sizeof(f->evt)) { evtLen=sizeof(f->evt); }
+  if(evt) { memcpy(f->evt, evt, evtLen); }
+  f->len=evt ? evtLen : 0;
+  f->result=result;
+  f->latencyMs=latencyMs;
+  f->done=true;
+}
+
+bool FlicdFuture::ready() { return done; }
+
+bool FlicdFuture::wait(int ms) {
+  for(int waited=0;!done && waited<ms;waited+=10) { Sleep(10); }
+  return done;
+}
+
+//
+// FlicdBatch - typed flicd commands.  Framed packets are appended into 4KB chunks and a
+// flush() hands every chunk to the kernel with a single sendmsg (WSASend on windows).
+//
+#define FLICD_CHUNK 4096
+
+FlicdBatch::FlicdBatch() {
+  used=FLICD_CHUNK;
+  packets=0;
+  bytes=0;
+}
+
+FlicdBatch::~FlicdBatch() {
+  clear();
+}
+
+void FlicdBatch::clear() {
+  for(size_t i=0;i<chunks.size();i++) { free(chunks[i]); }
+  chunks.clear();
+  used=FLICD_CHUNK;
+  packets=0;
+  bytes=0;
+}
+
+int FlicdBatch::count() { return packets; }
+
+void FlicdBatch::append(const void *pkt, int len) {
+  assert(len<FLICD_CHUNK-2);
+  if(used+2+len>FLICD_CHUNK) {
+    chunks.push_back((unsigned char*)malloc(FLICD_CHUNK));
+    used=0;
+  }
+  unsigned char *p=chunks.back()+used;
+  p[0] = len & 0xff;
+  p[1] = len >> 8;
+  memcpy(p + 2, pkt, len);
+  used+=2+len;
+  bytes+=2+len;
+  packets++;
+}
+
+//
+// Write the whole batch to fd.  Caller holds the write lock.  Returns 0 on success.
+//
+int FlicdBatch::writeTo(int fd) {
+  if(!packets) { return 0; }
+  int n=(int)chunks.size();
+#ifdef __LINUX__
+  struct iovec *iov=(struct iovec*)malloc(n*sizeof(struct iovec));
+  for(int i=0;i<n;i++) {
+    iov[i].iov_base=chunks[i];
+    iov[i].iov_len=(i==n-1) ? used : FLICD_CHUNK;
+  }
+  //
+  // sendmsg rather than writev for MSG_NOSIGNAL: a dead flicd socket is an EPIPE for the
+  // relink logic, not a SIGPIPE that ends the process.  It may stop short (or hit IOV_MAX)
+  // so walk forward until everything is out.
+  //
+  int first=0;
+  while(first<n) {
+    int cnt=n-first;
+    if(cnt>IOV_MAX) { cnt=IOV_MAX; }
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov=iov+first;
+    mh.msg_iovlen=cnt;
+    ssize_t res=sendmsg(fd, &mh, MSG_NOSIGNAL);
+    if(res<0) {
+      if(errno==EINTR) { continue; }
+      perror("sendmsg");
+      free(iov);
+      return -1;
+    }
+    while(first<n && res>=(ssize_t)iov[first].iov_len) {
+      res-=iov[first].iov_len;
+      first++;
+    }
+    if(first<n) {
+      iov[first].iov_base=(char*)iov[first].iov_base+res;
+      iov[first].iov_len-=res;
+    }
+  }
+  free(iov);
+#else
+  WSABUF *wsa=(WSABUF*)malloc(n*sizeof(WSABUF));
+  for(int i=0;i<n;i++) {
+    wsa[i].buf=(CHAR*)chunks[i];
+    wsa[i].len=(i==n-1) ? used : FLICD_CHUNK;
+  }
+  DWORD sent=0;
+  int res=WSASend(fd, wsa, n, &sent, 0, NULL, NULL);
+  free(wsa);
+  if(res!=0) {
+    fprintf(stderr,"WSASend failed: %d\n",WSAGetLastError());
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+//
+// Send everything queued to the current flicd socket and empty the batch.
+// Returns 0 on success, -1 if the link is down (the reader replays channels once relinked).
+//
+int FlicdBatch::flush() {
+  int ret=0;
+  if(!packets) { return 0; }
+  LOG(LOG_FLICD, LOG_DEBUG, "flicd batch: %d commands %d bytes\n",packets,bytes);
+  write_lock();
+  int fd=theFlicdSock;
+  if(fd<0) {
+    LOG(LOG_FLICD, LOG_WARN, "flicd link is down, dropped %d commands\n",packets);
+    ret=-1;
+  } else if(writeTo(fd)) {
+    if(!thePipeW) { exit(1); }
+    //
+    // Wake the reader so it notices and relinks
+    //
+    shutdown(fd, 2);
+    ret=-1;
+  }
+  write_unlock();
+  clear();
+  return ret;
+}
+
+void FlicdBatch::getInfo(FlicdCallback cb, void *context, int timeoutMs) {
+  CmdGetInfo cmd;
+  cmd.opcode = CMD_GET_INFO_OPCODE;
+  flicd_request_add(FLICD_REQ_GETINFO, 0, cb, context, timeoutMs);
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::createScanner(unsigned int scanId) {
+  CmdCreateScanner cmd;
+  cmd.opcode = CMD_CREATE_SCANNER_OPCODE;
+  cmd.scan_id = scanId;
+  write_lock();
+  theScanners[cmd.scan_id]=cmd;
+  write_unlock();
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::removeScanner(unsigned int scanId) {
+  CmdRemoveScanner cmd;
+  cmd.opcode = CMD_REMOVE_SCANNER_OPCODE;
+  cmd.scan_id = scanId;
+  write_lock();
+  theScanners.erase(cmd.scan_id);
+  write_unlock();
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::connect(const char *mac, unsigned int connId, int latencyMode, int autoDisconnectTime, FlicdCallback cb, void *context, int timeoutMs) {
+  CmdCreateConnectionChannel cmd;
+  cmd.opcode = CMD_CREATE_CONNECTION_CHANNEL_OPCODE;
+  memcpy(cmd.bd_addr, read_bdaddr(mac).addr, 6);
+  cmd.conn_id = connId;
+  cmd.latency_mode = (enum LatencyMode)latencyMode;
+  cmd.auto_disconnect_time = autoDisconnectTime;
+  write_lock();
+  theChannels[cmd.conn_id]=cmd;
+  write_unlock();
+  flicd_request_add(FLICD_REQ_CONNECT, connId, cb, context, timeoutMs);
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::disconnect(unsigned int connId) {
+  CmdRemoveConnectionChannel cmd;
+  cmd.opcode = CMD_REMOVE_CONNECTION_CHANNEL_OPCODE;
+  cmd.conn_id = connId;
+  write_lock();
+  theChannels.erase(cmd.conn_id);
+  write_unlock();
+  flicd_request_complete(FLICD_REQ_CONNECT, connId, FLICD_RESULT_ERROR, 0, 0);
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::forceDisconnect(const char *mac) {
+  CmdForceDisconnect cmd;
+  cmd.opcode = CMD_FORCE_DISCONNECT_OPCODE;
+  memcpy(cmd.bd_addr, read_bdaddr(mac).addr, 6);
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::changeModeParameters(unsigned int connId, int latencyMode, int autoDisconnectTime) {
+  CmdChangeModeParameters cmd;
+  cmd.opcode = CMD_CHANGE_MODE_PARAMETERS_OPCODE;
+  cmd.conn_id = connId;
+  cmd.latency_mode = (enum LatencyMode)latencyMode;
+  cmd.auto_disconnect_time = autoDisconnectTime;
+  write_lock();
+  if(theChannels.count(cmd.conn_id)) {
+    theChannels[cmd.conn_id].latency_mode = cmd.latency_mode;
+    theChannels[cmd.conn_id].auto_disconnect_time = cmd.auto_disconnect_time;
+  }
+  write_unlock();
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::ping(unsigned int pingId, FlicdCallback cb, void *context, int timeoutMs) {
+  CmdPing cmd;
+  cmd.opcode = CMD_PING_OPCODE;
+  cmd.ping_id = pingId;
+  flicd_request_add(FLICD_REQ_PING, pingId, cb, context, timeoutMs);
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::getButtonInfo(const char *mac, FlicdCallback cb, void *context, int timeoutMs) {
+  CmdGetButtonInfo cmd;
+  cmd.opcode = CMD_GET_BUTTON_INFO_OPCODE;
+  memcpy(cmd.bd_addr, read_bdaddr(mac).addr, 6);
+  flicd_request_add(FLICD_REQ_BUTTONINFO, bdaddr_key(cmd.bd_addr), cb, context, timeoutMs);
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::createScanWizard(unsigned int scanWizardId) {
+  CmdCreateScanWizard cmd;
+  cmd.opcode = CMD_CREATE_SCAN_WIZARD_OPCODE;
+  cmd.scan_wizard_id = scanWizardId;
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::cancelScanWizard(unsigned int scanWizardId) {
+  CmdCancelScanWizard cmd;
+  cmd.opcode = CMD_CANCEL_SCAN_WIZARD_OPCODE;
+  cmd.scan_wizard_id = scanWizardId;
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::deleteButton(const char *mac) {
+  CmdDeleteButton cmd;
+  cmd.opcode = CMD_DELETE_BUTTON_OPCODE;
+  memcpy(cmd.bd_addr, read_bdaddr(mac).addr, 6);
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::createBatteryStatusListener(const char *mac, unsigned int listenerId, FlicdCallback cb, void *context, int timeoutMs) {
+  CmdCreateBatteryStatusListener cmd;
+  cmd.opcode = CMD_CREATE_BATTERY_STATUS_LISTENER_OPCODE;
+  memcpy(cmd.bd_addr, read_bdaddr(mac).addr, 6);
+  cmd.listener_id = listenerId;
+  write_lock();
+  theBatteryListeners[cmd.listener_id]=cmd;
+  write_unlock();
+  flicd_request_add(FLICD_REQ_BATTERY, listenerId, cb, context, timeoutMs);
+  append(&cmd, sizeof(cmd));
+}
+
+void FlicdBatch::removeBatteryStatusListener(unsigned int listenerId) {
+  CmdRemoveBatteryStatusListener cmd;
+  cmd.opcode = CMD_REMOVE_BATTERY_STATUS_LISTENER_OPCODE;
+  cmd.listener_id = listenerId;
+  write_lock();
+  theBatteryListeners.erase(cmd.listener_id);
+  write_unlock();
+  flicd_request_complete(FLICD_REQ_BATTERY, listenerId, FLICD_RESULT_ERROR, 0, 0);
+  append(&cmd, sizeof(cmd));
+}
+
 static void print_help() {
   static const char help_text[] =
   "Available commands:\n"
@@ -264,21 +689,544 @@ static void print_help() {
   fprintf(stderr, help_text);
 }
 
-static void pipe_send(char operation, char status, char button, const char *str) {
+static void pipe_send(char operation, char status, unsigned int button, const char *str) {
   int i;
-  char piper[32];
+  char piper[FLIC_BUFSIZE];
   //
   // assemble a packet and write it to the main thread pipe
   //
   piper[0]=operation;
   piper[1]=status;
-  piper[2]=button;
-  for(i=0;str[i] && i<28;i++) { piper[i+3]=str[i]; }  // copy up to 28 bytes of incoming string
-  for(i=i+3;i<32;i++)         { piper[i]=0;        }  // fill remainder of message with nulls
+  piper[2]=(char)(button&0xff);
+  piper[3]=(char)(button>>8);
+  for(i=0;str[i] && i<FLIC_TRACE_OFF-5;i++) { piper[i+4]=str[i]; }  // copy up to 31 bytes of incoming string
+  for(i=i+4;i<FLIC_BUFSIZE;i++)             { piper[i]=0;        }  // fill remainder of message with nulls
+  if(TRACE_ON()) {
+    uint32_t id=traceNextId();
+    for(i=0;i<4;i++) { piper[FLIC_TRACE_OFF+i]=(char)(id>>(8*i)); }
+    traceFlow(TRACE_PIPE, 's', id, (unsigned char)operation);
+  }
   //
-  _write(thePipeW,piper,32);
+  watchdogIn(WD_DISPATCH);
+  _write(thePipeW,piper,FLIC_BUFSIZE);
+}
+
+//
+// For request callbacks, which run on the reader thread, to hand their result to the main thread
+//
+void flicd_client_pipe_send(char operation, char status, unsigned int button, const char *str) {
+  pipe_send(operation, status, button, str);
+}
+
+//
+// Link liveness.  The reader sends CMD_PING every thePingInterval ms and times each answer.
+// thePingMisses unanswered pings in a row and the link is declared dead and relinked.
+// RTTs go into a log2 histogram: bucket i counts RTTs in [2^i, 2^(i+1)) microseconds.
+//
+#define RTT_BUCKETS 24
+#define PING_SENT   8                       // power of 2; a ping expires long before 8 more are sent
+static DWORD thePingInterval=0;             // 0 = no pings
+static int thePingMisses=3;
+static uint32_t thePingId=0;
+static uint64_t thePingSentUs[PING_SENT];   // by ping_id: a late answer is timed from its own ping
+static DWORD thePingSentTick=0;
+static int thePingMissed=0;                 // consecutive misses
+static bool thePingDead=false;
+static uint64_t theRttHist[RTT_BUCKETS];
+static uint64_t theRttCount=0;
+static uint64_t theRttLast=0;
+static uint64_t theRttMax=0;
+
+static void flicd_ping_done(void *context, int result, const void *evt, int evtLen, unsigned long latencyMs) {
+  if(result==FLICD_RESULT_OK) {
+    uint64_t rtt=flicd_usec()-thePingSentUs[(uint32_t)(size_t)context&(PING_SENT-1)];
+    int b;
+    for(b=0;b<RTT_BUCKETS-1 && (rtt>>(b+1));b++) {}
+    write_lock();
+    theRttHist[b]++;
+    theRttCount++;
+    theRttLast=rtt;
+    if(rtt>theRttMax) { theRttMax=rtt; }
+    write_unlock();
+    thePingMissed=0;
+    metricSet(METRIC_FLICD_RTT_US,rtt);
+    if(thePipeW) {
+      char msg[24];
+      sprintf(msg,"%lu",(unsigned long)rtt);
+      pipe_send(FLIC_LINK, FLIC_STATUS_LINK_RTT, FLIC_BUTTON_ALL, msg);
+    }
+  } else if(result==FLICD_RESULT_TIMEOUT) {
+    thePingMissed++;
+    metricAdd(METRIC_FLICD_PING_MISSES,1);
+    LOG(LOG_FLICD, LOG_WARN, "flicd ping %u missed (%d in a row)\n",(unsigned)(size_t)context,thePingMissed);
+    if(thePingMissed>=thePingMisses) { thePingDead=true; }
+  }
+}
+
+//
+// Called from the reader loop at least once a second.  Sends the next ping when due.
+//
+static void flicd_ping_check() {
+  if(!thePingInterval || !thePipeW) { return; }
+  DWORD now=GetTickCount();
+  if(now-thePingSentTick<thePingInterval) { return; }
+  thePingSentTick=now;
+  thePingId++;
+  thePingSentUs[thePingId&(PING_SENT-1)]=flicd_usec();
+  FlicdBatch batch;
+  batch.ping(thePingId, flicd_ping_done, (void*)(size_t)thePingId, thePingInterval);
+  batch.flush();
 }
 
+void flicd_client_set_ping(int intervalSec, int misses) {
+  thePingInterval=intervalSec*1000;
+  thePingMisses=misses;
+}
+
+//
+// Summarize the RTT histogram as json.  Percentiles are bucket upper bounds.
+//
+int flicd_client_rtt_format(char *buf, int sz) {
+  uint64_t hist[RTT_BUCKETS], count, last, max;
+  uint64_t p50=0, p99=0, seen=0;
+  write_lock();
+  memcpy(hist, theRttHist, sizeof(hist));
+  count=theRttCount;
+  last=theRttLast;
+  max=theRttMax;
+  write_unlock();
+  for(int b=0;b<RTT_BUCKETS;b++) {
+    seen+=hist[b];
+    if(!p50 && seen*2>=count && count) { p50=(uint64_t)2<<b; }
+    if(!p99 && seen*100>=count*99 && count) { p99=(uint64_t)2<<b; }
+  }
+  return snprintf(buf,sz,"{\"count\":%llu,\"last_us\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu,\"missed\":%d}",
+                  (unsigned long long)count,(unsigned long long)last,(unsigned long long)p50,(unsigned long long)p99,(unsigned long long)max,thePingMissed);
+}
+
+//
+// Open a TCP connection to flicd with a one second receive timeout.  Returns socket or -1.
+//
+static int flicd_client_connect(const char *host, int port) {
+  // check for valid host
+  //
+  struct hostent* server = gethostbyname(host);
+  if (server == NULL) {
+    fprintf(stderr, "ERROR: no such host: %s\n",host);
+    return -1;
+  }
+
+  // create socket and check for validity
+  //
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd < 0) {
+    fprintf(stderr, "ERROR: failure creating socket\n");
+    perror("socket");
+    return sockfd;
+  }
+
+  // connect and check for valid connection
+  //
+  struct sockaddr_in serv_addr;
+  memset(&serv_addr, 0, sizeof(serv_addr));
+  serv_addr.sin_family = AF_INET;
+  memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+  serv_addr.sin_port = htons(port);
+  
+  if (connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+    fprintf(stderr, "ERROR: failure connecting socket\n");
+    perror("connect");
+    close(sockfd);
+    return -1;
+  }
+
+  //
+  // Set up one second timeout on flicd socket so the reader can expire requests
+  //
+#ifdef __LINUX__
+  struct timeval tv;
+  tv.tv_sec=1;
+  tv.tv_usec=0;
+  if(setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))<0) 
+#else
+  DWORD to=1000;
+  if(setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&to, sizeof(to))<0) 
+#endif
+  {
+    fprintf(stderr, "ERROR: setting recieve timeout on socket\n");
+    perror("setsockopt");
+    close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
+//
+// The flicd link died.  Tell the main thread, then reconnect.  Retries back off
+// exponentially (1s doubling to 32s).  Once connected, getInfo and every known connection channel are
+// re-issued as one pipelined write so all buttons come back together.  MQTT is untouched.
+// Returns the new socket.
+//
+static int flicd_client_relink(int oldfd, const char *why) {
+  DWORD lostTick=GetTickCount();
+  int backoff=1000;
+  int sockfd;
+  char msg[32];
+
+  LOG(LOG_FLICD, LOG_ERROR, "flicd link lost (%s).  Relinking...\n",why);
+  pipe_send(FLIC_LINK, FLIC_STATUS_LINK_DOWN, FLIC_BUTTON_ALL, why);
+
+  write_lock();
+  theFlicdSock=-1;
+  write_unlock();
+  close(oldfd);
+  flicd_request_fail_all();
+  thePingMissed=0;
+  thePingDead=false;
+
+  for(;;) {
+    sockfd=flicd_client_connect(theFlicdHost, theFlicdPort);
+    if(sockfd>=0) {
+      //
+      // Build the whole resync as one batch of framed packets
+      //
+      FlicdBatch batch;
+      CmdGetInfo info;
+      info.opcode = CMD_GET_INFO_OPCODE;
+      batch.append(&info, sizeof(info));
+      write_lock();
+      for(map<uint32_t, CmdCreateConnectionChannel>::iterator it=theChannels.begin();it!=theChannels.end();++it) {
+        batch.append(&it->second, sizeof(CmdCreateConnectionChannel));
+        if(!theRequests.count(REQ_KEY(FLICD_REQ_CONNECT,it->first))) {
+          //
+          // track connect-to-ready for the re-created channel too
+          //
+          FlicdRequest req;
+          req.cb=0;
+          req.context=0;
+          req.issued=GetTickCount();
+          req.timeoutMs=0;
+          theRequests[REQ_KEY(FLICD_REQ_CONNECT,it->first)]=req;
+        }
+      }
+      for(map<uint32_t, CmdCreateBatteryStatusListener>::iterator it=theBatteryListeners.begin();it!=theBatteryListeners.end();++it) {
+        batch.append(&it->second, sizeof(CmdCreateBatteryStatusListener));
+      }
+      for(map<uint32_t, CmdCreateScanner>::iterator it=theScanners.begin();it!=theScanners.end();++it) {
+        batch.append(&it->second, sizeof(CmdCreateScanner));
+      }
+      int bad=batch.writeTo(sockfd);
+      if(!bad) { theFlicdSock=sockfd; }
+      write_unlock();
+      if(!bad) { break; }
+      close(sockfd);
+    }
+    for(int slept=0;slept<backoff;slept+=1000) {
+      watchdogBeat(WD_READER);              // backing off is not a stall
+      Sleep(1000);
+    }
+    if(backoff<32000) { backoff=backoff*2; }
+  }
+
+  DWORD resync=GetTickCount()-lostTick;
+  metricAdd(METRIC_FLICD_RELINKS,1);
+  metricSet(METRIC_FLICD_RESYNC_MS,resync);
+  metricMax(METRIC_FLICD_RESYNC_MAXMS,resync);
+  LOG(LOG_FLICD, LOG_WARN, "flicd relinked, %d channels and %d battery listeners resynced in %lums\n",(int)theChannels.size(),(int)theBatteryListeners.size(),resync);
+  sprintf(msg,"%lu",resync);
+  pipe_send(FLIC_LINK, FLIC_STATUS_LINK_UP, FLIC_BUTTON_ALL, msg);
+  return sockfd;
+}
+
+//
+// Event handlers.  Called by decodeEvent() with a decoded, range checked event.
+//
+static void on_advertisement(const EvtAdvertisementPacket &evt, const uint8_t *tail, int tailCount) {
+  if(thePipeW) {
+    //
+    // can be tens of thousands a second with many buttons around: aggregate, don't format
+    //
+    if(evt.scan_id==PRESENCE_SCAN_ID && presenceAdd(bdaddr_key(evt.bd_addr), evt.rssi, GetTickCount())) {
+      pipe_send(FLIC_PRESENCE, FLIC_STATUS_OK, FLIC_BUTTON_ALL, "");
+    }
+    return;
+  }
+  printf("ADV: %s %s %d %s %s%s%s\n",
+         Bdaddr(evt.bd_addr).to_string().c_str(),
+         string(evt.name, (size_t)evt.name_length).c_str(),
+         evt.rssi,
+         (evt.is_private ? "private" : "public"),
+         (evt.already_verified ? "verified" : "unverified"),
+         (evt.already_connected_to_this_device ? " already connected to this device" : ""),
+         (evt.already_connected_to_other_device ? " already connected to other device" : "")
+  );
+}
+
+static void on_create_connection_channel_response(const EvtCreateConnectionChannelResponse &evt, const uint8_t *tail, int tailCount) {
+  if(evt.error!=NoError) {
+    flicd_request_complete(FLICD_REQ_CONNECT, evt.base.conn_id, FLICD_RESULT_ERROR, &evt, sizeof(evt));
+  } else if(evt.connection_status==Ready) {
+    flicd_request_complete(FLICD_REQ_CONNECT, evt.base.conn_id, FLICD_RESULT_OK, &evt, sizeof(evt));
+  }
+  if(thePipeW) {
+    if(evt.error==NoError) {
+      pipe_send(FLIC_CONNECT, evt.connection_status, evt.base.conn_id, ConnectionStatusStrings[evt.connection_status]);
+    } else {
+      pipe_send(FLIC_CONNECT, FLIC_STATUS_CONN_FAILED, evt.base.conn_id, CreateConnectionChannelErrorStrings[evt.error]);
+    }
+  } else {
+    printf("Create conn: %d %s %s\n", evt.base.conn_id, CreateConnectionChannelErrorStrings[evt.error], ConnectionStatusStrings[evt.connection_status]);
+  }
+}
+
+static void on_connection_status_changed(const EvtConnectionStatusChanged &evt, const uint8_t *tail, int tailCount) {
+  if(evt.connection_status==Ready) {
+    flicd_request_complete(FLICD_REQ_CONNECT, evt.base.conn_id, FLICD_RESULT_OK, &evt, sizeof(evt));
+  }
+  if(thePipeW) {
+    pipe_send(FLIC_STATUS, evt.connection_status, evt.base.conn_id, evt.connection_status==Disconnected ? DisconnectReasonStrings[evt.disconnect_reason] : ConnectionStatusStrings[evt.connection_status]);
+  } else {
+    printf("Connection status changed: %d %s", evt.base.conn_id, ConnectionStatusStrings[evt.connection_status]);
+    if (evt.connection_status == Disconnected) {
+      printf(" %s\n", DisconnectReasonStrings[evt.disconnect_reason]);
+    } else {
+      printf("\n");
+    }
+  }
+}
+
+static void on_connection_channel_removed(const EvtConnectionChannelRemoved &evt, const uint8_t *tail, int tailCount) {
+  flicd_request_complete(FLICD_REQ_CONNECT, evt.base.conn_id, FLICD_RESULT_ERROR, &evt, sizeof(evt));
+  if(thePipeW) {
+    pipe_send(FLIC_REMOVED, evt.removed_reason, evt.base.conn_id, RemovedReasonStrings[evt.removed_reason]);
+  } else {
+    printf("Connection removed: %d %s\n", evt.base.conn_id, RemovedReasonStrings[evt.removed_reason]);
+  }
+}
+
+static void on_button_event(const EvtButtonEvent &evt, const uint8_t *tail, int tailCount) {
+  uint8_t op=evt.base.opcode;
+  if(thePipeW) {
+    if((op==EVT_BUTTON_UP_OR_DOWN_OPCODE) ||
+       (op==EVT_BUTTON_CLICK_OR_HOLD_OPCODE && evt.click_type==ButtonHold) ||
+       (op==EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OPCODE && (evt.click_type==ButtonSingleClick || evt.click_type==ButtonDoubleClick))) {
+      if(evt.was_queued) {
+        char msg[32];
+        snprintf(msg, sizeof(msg), "%s queued %u", ClickTypeStrings[evt.click_type], (unsigned int)evt.time_diff);
+        pipe_send(FLIC_UPDOWN, evt.click_type, evt.base.conn_id, msg);
+      } else {
+        pipe_send(FLIC_UPDOWN, evt.click_type, evt.base.conn_id, ClickTypeStrings[evt.click_type]);
+      }
+    }
+  } else {
+    static const char* types[] = {"Button up/down", "Button click/hold", "Button single/double click", "Button single/double click/hold"};
+    printf("%s: %d, %s, %s, %d seconds ago\n", types[op-EVT_BUTTON_UP_OR_DOWN_OPCODE], evt.base.conn_id, ClickTypeStrings[evt.click_type], (evt.was_queued ? "queued" : "not queued"), evt.time_diff);
+  }
+}
+
+static void on_new_verified_button(const EvtNewVerifiedButton &evt, const uint8_t *tail, int tailCount) {
+  printf("New verified button: %s\n", Bdaddr(evt.bd_addr).to_string().c_str());
+}
+
+static void on_get_info_response(const EvtGetInfoResponse &evt, const uint8_t *tail, int tailCount) {
+  //
+  // hand callers the decoded header followed by the verified button addresses
+  //
+  int len=sizeof(evt)+tailCount*6;
+  uint8_t *full=(uint8_t*)malloc(len);
+  memcpy(full, &evt, sizeof(evt));
+  memcpy(full+sizeof(evt), tail, tailCount*6);
+  flicd_request_complete(FLICD_REQ_GETINFO, 0, FLICD_RESULT_OK, full, len);
+  free(full);
+  if(thePipeW) {
+    vector<uint64_t> verified(tailCount);
+    for(int i=0;i<tailCount;i++) { verified[i]=bdaddr_key(tail+i*6); }
+    metaVerified(tailCount ? &verified[0] : 0, tailCount);
+    pipe_send(FLIC_INFO_GENERAL, evt.bluetooth_controller_state, FLIC_BUTTON_ALL, BluetoothControllerStateStrings[evt.bluetooth_controller_state]);
+    char max[8];
+    sprintf(max, "%d", evt.max_concurrently_connected_buttons);
+    pipe_send(FLIC_SPACE, evt.currently_no_space_for_new_connection ? FLIC_STATUS_NO_SPACE : FLIC_STATUS_GOT_SPACE, FLIC_BUTTON_ALL, max);
+  } else {
+    printf("Got info: %s, %s (%s), max pending connections: %d, max conns: %d, current pending conns: %d, currently no space: %c\n",
+         BluetoothControllerStateStrings[evt.bluetooth_controller_state],
+         Bdaddr(evt.my_bd_addr).to_string().c_str(),
+         BdAddrTypeStrings[evt.my_bd_addr_type],
+         evt.max_pending_connections,
+         evt.max_concurrently_connected_buttons,
+         evt.current_pending_connections,
+         evt.currently_no_space_for_new_connection ? 'y' : 'n');
+    puts(tailCount > 0 ? "Verified buttons:" : "No verified buttons yet");
+    for(int i = 0; i < tailCount; i++) {
+      printf("%s\n", Bdaddr(tail+i*6).to_string().c_str());
+    }
+  }
+}
+
+static void on_no_space_for_new_connection(const EvtNoSpaceForNewConnection &evt, const uint8_t *tail, int tailCount) {
+  if(thePipeW) {
+    char max[8];
+    sprintf(max, "%d", evt.max_concurrently_connected_buttons);
+    pipe_send(FLIC_SPACE, FLIC_STATUS_NO_SPACE, FLIC_BUTTON_ALL, max);
+  } else {
+    printf("No space for new connection, max: %d\n", evt.max_concurrently_connected_buttons);
+  }
+}
+
+static void on_got_space_for_new_connection(const EvtGotSpaceForNewConnection &evt, const uint8_t *tail, int tailCount) {
+  if(thePipeW) {
+    char max[8];
+    sprintf(max, "%d", evt.max_concurrently_connected_buttons);
+    pipe_send(FLIC_SPACE, FLIC_STATUS_GOT_SPACE, FLIC_BUTTON_ALL, max);
+  } else {
+    printf("Got space for new connection, max: %d\n", evt.max_concurrently_connected_buttons);
+  }
+}
+
+static void on_bluetooth_controller_state_change(const EvtBluetoothControllerStateChange &evt, const uint8_t *tail, int tailCount) {
+  if(thePipeW) {
+    pipe_send(FLIC_CONTROLLER, evt.state, FLIC_BUTTON_ALL, BluetoothControllerStateStrings[evt.state]);
+  } else {
+    printf("Bluetooth state change: %s\n", BluetoothControllerStateStrings[evt.state]);
+  }
+}
+
+static void on_ping_response(const EvtPingResponse &evt, const uint8_t *tail, int tailCount) {
+  flicd_request_complete(FLICD_REQ_PING, evt.ping_id, FLICD_RESULT_OK, &evt, sizeof(evt));
+}
+
+static void on_get_button_info_response(const EvtGetButtonInfoResponse &evt, const uint8_t *tail, int tailCount) {
+  if(thePipeW) {
+    //
+    // cache it before the requester hears back.  flicd zeroes everything for a button it has not verified.
+    //
+    MetaRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.bdaddr=bdaddr_key(evt.bd_addr);
+    rec.firmware=evt.firmware_version;
+    rec.flicVersion=evt.flic_version;
+    memcpy(rec.uuid, evt.uuid, sizeof(rec.uuid));
+    memcpy(rec.color, evt.color, evt.color_length<=16 ? evt.color_length : 16);
+    memcpy(rec.serial, evt.serial_number, evt.serial_number_length<=16 ? evt.serial_number_length : 16);
+    rec.known=evt.serial_number_length || evt.firmware_version;
+    metaPut(&rec);
+  }
+  flicd_request_complete(FLICD_REQ_BUTTONINFO, bdaddr_key(evt.bd_addr), FLICD_RESULT_OK, &evt, sizeof(evt));
+  if(thePipeW) { return; }
+  printf("Button info response: %s %s %s %s %d %d\n",
+         Bdaddr(evt.bd_addr).to_string().c_str(),
+         bytes_to_hex_string(evt.uuid, sizeof(evt.uuid)).c_str(),
+         string(evt.color, (size_t)evt.color_length).c_str(),
+         string(evt.serial_number, (size_t)evt.serial_number_length).c_str(),
+         evt.flic_version,
+         evt.firmware_version
+  );
+}
+
+static void on_scan_wizard_found_private_button(const EvtScanWizardBase &evt, const uint8_t *tail, int tailCount) {
+  printf("Found private button. Please hold down it for 7 seconds to make it public.\n");
+}
+
+static void on_scan_wizard_found_public_button(const EvtScanWizardFoundPublicButton &evt, const uint8_t *tail, int tailCount) {
+  printf("Found public button %s %s, connecting...\n", Bdaddr(evt.bd_addr).to_string().c_str(), string(evt.name, (size_t)evt.name_length).c_str());
+}
+
+static void on_scan_wizard_button_connected(const EvtScanWizardBase &evt, const uint8_t *tail, int tailCount) {
+  printf("Connected, now pairing and verifying...\n");
+}
+
+static void on_scan_wizard_completed(const EvtScanWizardCompleted &evt, const uint8_t *tail, int tailCount) {
+  printf("Scan wizard done with status %s\n", ScanWizardResultStrings[evt.result]);
+}
+
+static void on_button_deleted(const EvtButtonDeleted &evt, const uint8_t *tail, int tailCount) {
+  printf("Button %s deleted %s\n", Bdaddr(evt.bd_addr).to_string().c_str(), evt.deleted_by_this_client ? "by this client" : "not by this client");
+}
+
+static void on_battery_status(const EvtBatteryStatus &evt, const uint8_t *tail, int tailCount) {
+  time_t when=(time_t)evt.timestamp;
+  flicd_request_complete(FLICD_REQ_BATTERY, evt.listener_id, FLICD_RESULT_OK, &evt, sizeof(evt));
+  if(thePipeW) {
+    //
+    // percentage is -1 while flicd has not heard from the button yet
+    //
+    char msg[32];
+    snprintf(msg, sizeof(msg), "%d %lld", (int)evt.battery_percentage, (long long)evt.timestamp);
+    pipe_send(FLIC_BATTERY, FLIC_STATUS_OK, evt.listener_id, msg);
+    return;
+  }
+  printf("Battery status report for id %d, percentage: %d%%, timestamp: %s\n", evt.listener_id, evt.battery_percentage, ctime(&when));
+}
+
+//
+// Dispatch table indexed by event opcode
+//
+static const EventDecoder EVENT_TABLE[]={
+  EVENT(EvtAdvertisementPacket,             EvtAdvertisementPacketFields,             on_advertisement),                      // EVT_ADVERTISEMENT_PACKET_OPCODE
+  EVENT(EvtCreateConnectionChannelResponse, EvtCreateConnectionChannelResponseFields, on_create_connection_channel_response), // EVT_CREATE_CONNECTION_CHANNEL_RESPONSE_OPCODE
+  EVENT(EvtConnectionStatusChanged,         EvtConnectionStatusChangedFields,         on_connection_status_changed),          // EVT_CONNECTION_STATUS_CHANGED_OPCODE
+  EVENT(EvtConnectionChannelRemoved,        EvtConnectionChannelRemovedFields,        on_connection_channel_removed),         // EVT_CONNECTION_CHANNEL_REMOVED_OPCODE
+  EVENT(EvtButtonEvent,                     EvtButtonEventFields,                     on_button_event),                       // EVT_BUTTON_UP_OR_DOWN_OPCODE
+  EVENT(EvtButtonEvent,                     EvtButtonEventFields,                     on_button_event),                       // EVT_BUTTON_CLICK_OR_HOLD_OPCODE
+  EVENT(EvtButtonEvent,                     EvtButtonEventFields,                     on_button_event),                       // EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OPCODE
+  EVENT(EvtButtonEvent,                     EvtButtonEventFields,                     on_button_event),                       // EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OR_HOLD_OPCODE
+  EVENT(EvtNewVerifiedButton,               EvtNewVerifiedButtonFields,               on_new_verified_button),                // EVT_NEW_VERIFIED_BUTTON_OPCODE
+  EVENT_TAIL(EvtGetInfoResponse,            EvtGetInfoResponseFields, 6, nb_verified_buttons, on_get_info_response),        // EVT_GET_INFO_RESPONSE_OPCODE
+  EVENT(EvtNoSpaceForNewConnection,         EvtNoSpaceForNewConnectionFields,         on_no_space_for_new_connection),        // EVT_NO_SPACE_FOR_NEW_CONNECTION_OPCODE
+  EVENT(EvtGotSpaceForNewConnection,        EvtGotSpaceForNewConnectionFields,        on_got_space_for_new_connection),       // EVT_GOT_SPACE_FOR_NEW_CONNECTION_OPCODE
+  EVENT(EvtBluetoothControllerStateChange,  EvtBluetoothControllerStateChangeFields,  on_bluetooth_controller_state_change),  // EVT_BLUETOOTH_CONTROLLER_STATE_CHANGE_OPCODE
+  EVENT(EvtPingResponse,                    EvtPingResponseFields,                    on_ping_response),                      // EVT_PING_RESPONSE_OPCODE
+  EVENT(EvtGetButtonInfoResponse,           EvtGetButtonInfoResponseFields,           on_get_button_info_response),           // EVT_GET_BUTTON_INFO_RESPONSE_OPCODE
+  EVENT(EvtScanWizardBase,                  EvtScanWizardBaseFields,                  on_scan_wizard_found_private_button),   // EVT_SCAN_WIZARD_FOUND_PRIVATE_BUTTON_OPCODE
+  EVENT(EvtScanWizardFoundPublicButton,     EvtScanWizardFoundPublicButtonFields,     on_scan_wizard_found_public_button),    // EVT_SCAN_WIZARD_FOUND_PUBLIC_BUTTON_OPCODE
+  EVENT(EvtScanWizardBase,                  EvtScanWizardBaseFields,                  on_scan_wizard_button_connected),       // EVT_SCAN_WIZARD_BUTTON_CONNECTED_OPCODE
+  EVENT(EvtScanWizardCompleted,             EvtScanWizardCompletedFields,             on_scan_wizard_completed),              // EVT_SCAN_WIZARD_COMPLETED_OPCODE
+  EVENT(EvtButtonDeleted,                   EvtButtonDeletedFields,                   on_button_deleted),                     // EVT_BUTTON_DELETED_OPCODE
+  EVENT(EvtBatteryStatus,                   EvtBatteryStatusFields,                   on_battery_status)                      // EVT_BATTERY_STATUS_OPCODE
+};
+
+CHECK_STRINGS(CreateConnectionChannelErrorStrings, EvtCreateConnectionChannelResponse, EvtCreateConnectionChannelResponseFields, error);
+CHECK_STRINGS(ConnectionStatusStrings,             EvtCreateConnectionChannelResponse, EvtCreateConnectionChannelResponseFields, connection_status);
+CHECK_STRINGS(ConnectionStatusStrings,             EvtConnectionStatusChanged,         EvtConnectionStatusChangedFields,         connection_status);
+CHECK_STRINGS(DisconnectReasonStrings,             EvtConnectionStatusChanged,         EvtConnectionStatusChangedFields,         disconnect_reason);
+CHECK_STRINGS(RemovedReasonStrings,                EvtConnectionChannelRemoved,        EvtConnectionChannelRemovedFields,        removed_reason);
+CHECK_STRINGS(ClickTypeStrings,                    EvtButtonEvent,                     EvtButtonEventFields,                     click_type);
+CHECK_STRINGS(BluetoothControllerStateStrings,     EvtGetInfoResponse,                 EvtGetInfoResponseFields,                 bluetooth_controller_state);
+CHECK_STRINGS(BdAddrTypeStrings,                   EvtGetInfoResponse,                 EvtGetInfoResponseFields,                 my_bd_addr_type);
+CHECK_STRINGS(ScanWizardResultStrings,             EvtScanWizardCompleted,             EvtScanWizardCompletedFields,             result);
+static_assert(sizeof(EVENT_TABLE)/sizeof(EventDecoder)==EVT_BATTERY_STATUS_OPCODE+1, "EVENT_TABLE must have one entry per event opcode");
+
+//
+// Decode every complete frame (2 byte little endian length + payload) at the front of
+// data and return the number of bytes consumed.  A trailing partial frame is left for
+// the caller to complete.  Any byte sequence is safe to feed in, so this is also the
+// entry point for fuzzing the framing and event decoders.  *badRun counts frames in a
+// row that failed to decode (reset by a good one).
+//
+int flicd_client_decode_stream(const uint8_t *data, int len, int *badRun) {
+  int pos=0;
+  while(len-pos>=2) {
+    int packet_len=data[pos] | (data[pos+1]<<8);
+    if(len-pos-2<packet_len) { break; }
+    const uint8_t *pkt=data+pos+2;
+    pos+=2+packet_len;
+
+    uint64_t t0=TRACE_ON() ? traceNow() : 0;
+    int ret=decodeEventHot<EVT_BUTTON_UP_OR_DOWN_OPCODE, EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OR_HOLD_OPCODE, EVENT(EvtButtonEvent, EvtButtonEventFields, on_button_event)>
+                          (EVENT_TABLE, (int)(sizeof(EVENT_TABLE)/sizeof(EventDecoder)), pkt, packet_len);
+    if(t0) { traceSpan(TRACE_DECODE, t0, packet_len ? pkt[0] : 0); }
+    if(ret!=DECODE_OK) {
+      metricAdd(METRIC_FLICD_BAD_PACKETS,1);
+      LOG(LOG_FLICD, LOG_WARN, "Dropped flicd packet opcode=%d len=%d: %s\n",packet_len ? pkt[0] : -1,packet_len,DECODE_ERRORS[ret]);
+      if(badRun) { (*badRun)++; }
+    } else if(badRun) {
+      *badRun=0;
+    }
+  }
+  return pos;
+}
+
+#define READBUF_SIZE (2*65536)
+
 #ifdef __LINUX__
 #define __BADRET (void*)1
 static void *flicd_client_reader(void *param) 
@@ -289,212 +1237,97 @@ static DWORD WINAPI flicd_client_reader(LPVOID param)
 {
   int sockfd=*((int*)param);
   free(param);
-  char *readbuf=(char *)malloc(65536+4);
+  //
+  // room for the largest frame flicd can send plus whatever follows it in the same recv
+  //
+  uint8_t *readbuf=(uint8_t *)malloc(READBUF_SIZE);
   assert(readbuf);
+  int have=0;           // bytes in readbuf not yet decoded
+  int stalls=0;         // receive timeouts in a row while part of a frame is buffered
+  int badRun=0;         // undecodable frames in a row
+  DWORD lastPipePing=GetTickCount();
 
   while(1) {
-    int nbytes;
+    const char *fatal=0;
 
-    int err=__LOOPWHILE;
-    for(;err==__LOOPWHILE;) {
-      err=0;
-      nbytes = recv(sockfd, readbuf, 2, 0);
-      if (nbytes < 0) {
+    watchdogBeat(WD_READER);
+    uint64_t t0=TRACE_ON() ? traceNow() : 0;
+    int nbytes = recv(sockfd, (char *)readbuf + have, READBUF_SIZE - have, 0);
+    if(t0 && nbytes>0) {
+      traceThreadName("flicd reader");
+      traceSpan(TRACE_RECV, t0, nbytes);
+    }
+    if (nbytes < 0) {
 #ifdef __LINUX__
-        err=errno;
-	if(err==EWOULDBLOCK) { err=__LOOPWHILE; }  // EAGAIN and EWOULDBLOCK both acceptable
+      int err=errno;
+      if(err==EWOULDBLOCK) { err=__LOOPWHILE; }  // EAGAIN and EWOULDBLOCK both acceptable
 #else
-        err=WSAGetLastError();
+      int err=WSAGetLastError();
 #endif
-        if(err==__LOOPWHILE) {
-          if(thePipeW) {
-            pipe_send(FLIC_PING, FLIC_STATUS_OK, FLIC_BUTTON_ALL, "NO_UPDATE");
-          } else {
-            //fprintf(stderr,"Expected timeout receiving header from flicd!\n");
-          }
-        } else {
-          if(thePipeW) {
-            pipe_send(FLIC_PING, FLIC_STATUS_FATAL, FLIC_BUTTON_ALL, "BAD_HEADER");
-          }
-          perror("FATAL: read sockfd header");
-          return __BADRET;
+      if(err!=__LOOPWHILE) {
+        LOG(LOG_FLICD, LOG_ERROR, "FATAL: read sockfd: error %d\n",err);
+        fatal="BAD_READ";
+      } else if(have && ++stalls>=5) {
+        LOG(LOG_FLICD, LOG_ERROR, "FATAL: flicd stalled mid packet\n");
+        fatal="BAD_PAYLOAD";
+      } else {
+        flicd_request_expire();
+        flicd_ping_check();
+        if(thePipeW && presenceTick(GetTickCount())) {
+          pipe_send(FLIC_PRESENCE, FLIC_STATUS_OK, FLIC_BUTTON_ALL, "");
         }
-      }
-      if (nbytes == 1) {
-          if(thePipeW) {
-            pipe_send(FLIC_PING, FLIC_STATUS_FATAL, FLIC_BUTTON_ALL, "SHORT_HEADER");
-          }
-          fprintf(stderr,"FATAL: just one byte came");
-          return __BADRET;
-      }
-    }
-
-    int packet_len = readbuf[0] | (readbuf[1] << 8);
-    int read_pos = 0;
-    int bytes_left = packet_len;
-    //fprintf(stderr,"flicd wants to send %d bytes\n",packet_len);
-    
-    while (bytes_left > 0) {
-      nbytes = recv(sockfd, readbuf + read_pos, bytes_left, 0);
-      if (nbytes < 0) {
-        if(thePipeW) {
-          pipe_send(FLIC_PING, FLIC_STATUS_FATAL, FLIC_BUTTON_ALL, "BAD_PAYLOAD");
+        if(thePipeW && statsTick(GetTickCount())) {
+          pipe_send(FLIC_STATS, FLIC_STATUS_OK, FLIC_BUTTON_ALL, "");
         }
-        perror("read sockfd data");
-        return __BADRET;
-      }
-      read_pos += nbytes;
-      bytes_left -= nbytes;
-    }
-    //fprintf(stderr,"flicd sent %d bytes - event=%s\n",read_pos,FLICD_EVTS[readbuf[0]]);
-    
-    void* pkt = (void*)readbuf;
-    switch (readbuf[0]) {
-      case EVT_ADVERTISEMENT_PACKET_OPCODE: {
-        EvtAdvertisementPacket* evt = (EvtAdvertisementPacket*)pkt;
-        printf("ADV: %s %s %d %s %s%s%s\n",
-               Bdaddr(evt->bd_addr).to_string().c_str(),
-               string(evt->name, (size_t)evt->name_length).c_str(),
-               evt->rssi,
-               (evt->is_private ? "private" : "public"),
-               (evt->already_verified ? "verified" : "unverified"),
-               (evt->already_connected_to_this_device ? " already connected to this device" : ""),
-               (evt->already_connected_to_other_device ? " already connected to other device" : "")
-        );
-        break;
-      }
-      case EVT_CREATE_CONNECTION_CHANNEL_RESPONSE_OPCODE: {
-        EvtCreateConnectionChannelResponse* evt = (EvtCreateConnectionChannelResponse*)pkt;
-        if(thePipeW) {
-          pipe_send(FLIC_CONNECT, FLIC_STATUS_OK, evt->base.conn_id, ConnectionStatusStrings[evt->error]);
-        } else {
-          printf("Create conn: %d %s %s\n", evt->base.conn_id, CreateConnectionChannelErrorStrings[evt->error], ConnectionStatusStrings[evt->connection_status]);
-        }
-        break;
-      }
-      case EVT_CONNECTION_STATUS_CHANGED_OPCODE: {
-        EvtConnectionStatusChanged* evt = (EvtConnectionStatusChanged*)pkt;
-        if(thePipeW) {
-          pipe_send(FLIC_STATUS, FLIC_STATUS_OK, evt->base.conn_id, ConnectionStatusStrings[evt->connection_status]);
-        } else {
-          printf("Connection status changed: %d %s", evt->base.conn_id, ConnectionStatusStrings[evt->connection_status]);
-          if (evt->connection_status == Disconnected) {
-            printf(" %s\n", DisconnectReasonStrings[evt->disconnect_reason]);
-          } else {
-            printf("\n");
-          }
+        if(thePingDead) {
+          fatal="PING_TIMEOUT";
+        } else if(thePipeW && GetTickCount()-lastPipePing>=60000) {
+          //
+          // keep the once a minute sanity ping to the main thread
+          //
+          lastPipePing=GetTickCount();
+          pipe_send(FLIC_PING, FLIC_STATUS_OK, FLIC_BUTTON_ALL, "NO_UPDATE");
         }
-        break;
-      }
-      case EVT_CONNECTION_CHANNEL_REMOVED_OPCODE: {
-        EvtConnectionChannelRemoved* evt = (EvtConnectionChannelRemoved*)pkt;
-        printf("Connection removed: %d %s\n", evt->base.conn_id, RemovedReasonStrings[evt->removed_reason]);
-        break;
+        if(!fatal) { continue; }
       }
-      case EVT_BUTTON_UP_OR_DOWN_OPCODE:
-      case EVT_BUTTON_CLICK_OR_HOLD_OPCODE:
-      case EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OPCODE:
-      case EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OR_HOLD_OPCODE: {
-        EvtButtonEvent* evt = (EvtButtonEvent*)pkt;
-        if(thePipeW) {
-          if (readbuf[0]==EVT_BUTTON_UP_OR_DOWN_OPCODE) {
-            pipe_send(FLIC_UPDOWN, evt->click_type, evt->base.conn_id, ClickTypeStrings[evt->click_type]);
-          } else if (readbuf[0]==EVT_BUTTON_CLICK_OR_HOLD_OPCODE && evt->click_type==ButtonHold) {
-            pipe_send(FLIC_UPDOWN, evt->click_type, evt->base.conn_id, ClickTypeStrings[evt->click_type]);
-          } else if (readbuf[0]==EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OPCODE && evt->click_type==ButtonSingleClick) {
-            pipe_send(FLIC_UPDOWN, evt->click_type, evt->base.conn_id, ClickTypeStrings[evt->click_type]);
-          } else if (readbuf[0]==EVT_BUTTON_SINGLE_OR_DOUBLE_CLICK_OPCODE && evt->click_type==ButtonDoubleClick) {
-            pipe_send(FLIC_UPDOWN, evt->click_type, evt->base.conn_id, ClickTypeStrings[evt->click_type]);
-          }
-        } else {
-          static const char* types[] = {"Button up/down", "Button click/hold", "Button single/double click", "Button single/double click/hold"};
-          printf("%s: %d, %s, %s, %d seconds ago\n", types[readbuf[0]-EVT_BUTTON_UP_OR_DOWN_OPCODE], evt->base.conn_id, ClickTypeStrings[evt->click_type], (evt->was_queued ? "queued" : "not queued"), evt->time_diff);
-        }
-        break;
+    } else if (nbytes == 0) {
+      LOG(LOG_FLICD, LOG_ERROR, "FATAL: flicd closed the connection\n");
+      fatal="CLOSED";
+    } else {
+      stalls=0;
+      have+=nbytes;
+      flicd_request_expire();
+      flicd_ping_check();
+      if(thePipeW && statsTick(GetTickCount())) {
+        pipe_send(FLIC_STATS, FLIC_STATUS_OK, FLIC_BUTTON_ALL, "");   // busy flicd never goes idle
       }
-      case EVT_NEW_VERIFIED_BUTTON_OPCODE: {
-        EvtNewVerifiedButton* evt = (EvtNewVerifiedButton*)pkt;
-        printf("New verified button: %s\n", Bdaddr(evt->bd_addr).to_string().c_str());
-        break;
-      }
-      case EVT_GET_INFO_RESPONSE_OPCODE: {
-        EvtGetInfoResponse* evt = (EvtGetInfoResponse*)pkt;
-        if(thePipeW) {
-          pipe_send(FLIC_INFO_GENERAL, FLIC_STATUS_OK, FLIC_BUTTON_ALL, BluetoothControllerStateStrings[evt->bluetooth_controller_state]);
-        } else {
-          printf("Got info: %s, %s (%s), max pending connections: %d, max conns: %d, current pending conns: %d, currently no space: %c\n",
-               BluetoothControllerStateStrings[evt->bluetooth_controller_state],
-               Bdaddr(evt->my_bd_addr).to_string().c_str(),
-               BdAddrTypeStrings[evt->my_bd_addr_type],
-               evt->max_pending_connections,
-               evt->max_concurrently_connected_buttons,
-               evt->current_pending_connections,
-               evt->currently_no_space_for_new_connection ? 'y' : 'n');
-          puts(evt->nb_verified_buttons > 0 ? "Verified buttons:" : "No verified buttons yet");
-          for(int i = 0; i < evt->nb_verified_buttons; i++) {
-            printf("%s\n", Bdaddr(evt->bd_addr_of_verified_buttons[i]).to_string().c_str());
-          }
-        }
-        break;
-      }
-      case EVT_NO_SPACE_FOR_NEW_CONNECTION_OPCODE: {
-        EvtNoSpaceForNewConnection* evt = (EvtNoSpaceForNewConnection*)pkt;
-        printf("No space for new connection, max: %d\n", evt->max_concurrently_connected_buttons);
-        break;
-      }
-      case EVT_GOT_SPACE_FOR_NEW_CONNECTION_OPCODE: {
-        EvtGotSpaceForNewConnection* evt = (EvtGotSpaceForNewConnection*)pkt;
-        printf("Got space for new connection, max: %d\n", evt->max_concurrently_connected_buttons);
-        break;
-      }
-      case EVT_BLUETOOTH_CONTROLLER_STATE_CHANGE_OPCODE: {
-        EvtBluetoothControllerStateChange* evt = (EvtBluetoothControllerStateChange*)pkt;
-        printf("Bluetooth state change: %d\n", evt->state);
-        break;
-      }
-      case EVT_GET_BUTTON_INFO_RESPONSE_OPCODE: {
-        EvtGetButtonInfoResponse* evt = (EvtGetButtonInfoResponse*)pkt;
-        printf("Button info response: %s %s %s %s %d %d\n",
-               Bdaddr(evt->bd_addr).to_string().c_str(),
-               bytes_to_hex_string(evt->uuid, sizeof(evt->uuid)).c_str(),
-               string(evt->color, (size_t)evt->color_length).c_str(),
-               string(evt->serial_number, (size_t)evt->serial_number_length).c_str(),
-               evt->flic_version,
-               evt->firmware_version
-        );
-        break;
-      }
-      case EVT_SCAN_WIZARD_FOUND_PRIVATE_BUTTON_OPCODE: {
-        printf("Found private button. Please hold down it for 7 seconds to make it public.\n");
-        break;
-      }
-      case EVT_SCAN_WIZARD_FOUND_PUBLIC_BUTTON_OPCODE: {
-        EvtScanWizardFoundPublicButton* evt = (EvtScanWizardFoundPublicButton*)pkt;
-        printf("Found public button %s %s, connecting...\n", Bdaddr(evt->bd_addr).to_string().c_str(), string(evt->name, (size_t)evt->name_length).c_str());
-        break;
-      }
-      case EVT_SCAN_WIZARD_BUTTON_CONNECTED_OPCODE: {
-        printf("Connected, now pairing and verifying...\n");
-        break;
-      }
-      case EVT_SCAN_WIZARD_COMPLETED_OPCODE: {
-        EvtScanWizardCompleted* evt = (EvtScanWizardCompleted*)pkt;
-        printf("Scan wizard done with status %s\n", ScanWizardResultStrings[evt->result]);
-        break;
-      }
-      case EVT_BATTERY_STATUS_OPCODE: {
-        EvtBatteryStatus* evt = (EvtBatteryStatus*)pkt;
-        printf("Battery status report for id %d, percentage: %d%%, timestamp: %s\n", evt->listener_id, evt->battery_percentage, ctime((time_t*)&evt->timestamp));
-        break;
+
+      int used=flicd_client_decode_stream(readbuf, have, &badRun);
+      if(used) {
+        memmove(readbuf, readbuf+used, have-used);
+        have-=used;
       }
-      case EVT_BUTTON_DELETED_OPCODE: {
-        EvtButtonDeleted* evt = (EvtButtonDeleted*)pkt;
-        printf("Button %s deleted %s\n", Bdaddr(evt->bd_addr).to_string().c_str(), evt->deleted_by_this_client ? "by this client" : "not by this client");
-        break;
+      if(badRun>=8) {
+        //
+        // a corrupt length has most likely desynchronised the framing.  There are no
+        // frame markers to hunt for, so start over on a fresh connection.
+        //
+        LOG(LOG_FLICD, LOG_ERROR, "FATAL: %d undecodable flicd packets in a row\n",badRun);
+        fatal="BAD_STREAM";
       }
-      default: {
-        fprintf(stderr,"Unknown Packet opcode: %d\n",readbuf[0]);
+    }
+
+    if(fatal) {
+      if(!thePipeW) {
+        //
+        // interactive mode has nobody to relink for.  Just stop.
+        //
+        return __BADRET;
       }
+      have=0;
+      stalls=0;
+      badRun=0;
+      sockfd=flicd_client_relink(sockfd, fatal);
     }
   }
 }
@@ -517,7 +1350,7 @@ static int linein(char *buf, int sz) {
   return len;
 }
 
-int flicd_client_handle_line(int sockfd, const char *incmd) {
+int flicd_client_handle_line(const char *incmd) {
   //
   // split cmdline into up to three words ignoring excess spaces
   //
@@ -548,114 +1381,67 @@ int flicd_client_handle_line(int sockfd, const char *incmd) {
 
   //fprintf(stderr,"wordnum=%d w0=%s w1=%s w2=%s\n",wordnum,words[0],words[1],words[2],words[3]);
 
+  FlicdBatch batch;
   if (strcmp("startScanWizard", words[0]) == 0) {
     assert(wordnum==1);
-    CmdCreateScanWizard cmd;
-    cmd.opcode = CMD_CREATE_SCAN_WIZARD_OPCODE;
-    cmd.scan_wizard_id = 0;
-    write_packet(sockfd, &cmd, sizeof(cmd));
-    
+    batch.createScanWizard(0);
     printf("Please click and hold down your Flic button!\n");
   }
   if (strcmp("cancelScanWizard", words[0]) == 0) {
     assert(wordnum==1);
-    CmdCancelScanWizard cmd;
-    cmd.opcode = CMD_CANCEL_SCAN_WIZARD_OPCODE;
-    cmd.scan_wizard_id = 0;
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.cancelScanWizard(0);
   }
   if (strcmp("startScan", words[0]) == 0) {
     assert(wordnum==1);
-    CmdCreateScanner cmd;
-    cmd.opcode = CMD_CREATE_SCANNER_OPCODE;
-    cmd.scan_id = 0;
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.createScanner(0);
   }
   if (strcmp("stopScan", words[0]) == 0) {
     assert(wordnum==1);
-    CmdRemoveScanner cmd;
-    cmd.opcode = CMD_REMOVE_SCANNER_OPCODE;
-    cmd.scan_id = 0;
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.removeScanner(0);
   }
   if (strcmp("connect", words[0]) == 0) {
     assert(wordnum==3);
-    CmdCreateConnectionChannel cmd;
-    cmd.opcode = CMD_CREATE_CONNECTION_CHANNEL_OPCODE;
-    memcpy(cmd.bd_addr, read_bdaddr(words[1]).addr, 6);
-    sscanf(words[2],"%u", &cmd.conn_id);
-    cmd.latency_mode = NormalLatency;
-    cmd.auto_disconnect_time = 0x1ff;
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.connect(words[1], strtoul(words[2], 0, 10));
   }
   if (strcmp("disconnect", words[0]) == 0) {
     assert(wordnum==2);
-    CmdRemoveConnectionChannel cmd;
-    cmd.opcode = CMD_REMOVE_CONNECTION_CHANNEL_OPCODE;
-    sscanf(words[1],"%u", &cmd.conn_id);
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.disconnect(strtoul(words[1], 0, 10));
   }
   if (strcmp("forceDisconnect", words[0]) == 0) {
     assert(wordnum==2);
-    CmdForceDisconnect cmd;
-    cmd.opcode = CMD_FORCE_DISCONNECT_OPCODE;
-    memcpy(cmd.bd_addr, read_bdaddr(words[1]).addr, 6);
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.forceDisconnect(words[1]);
   }
   if (strcmp("changeModeParameters", words[0]) == 0) {
     assert(wordnum==4);
-    CmdChangeModeParameters cmd;
-    cmd.opcode = CMD_CHANGE_MODE_PARAMETERS_OPCODE;
-    sscanf(words[1],"%u", &cmd.conn_id);
-    char latency_mode[32];
-    uint32_t auto_disconnect_time;
-    sscanf(words[2],"%s", latency_mode);
-    sscanf(words[3],"%u", &auto_disconnect_time);
     int mode = 0;
     for (int i = 0; i < 3; i++) {
-      if (strcmp(latency_mode, LatencyModeStrings[i]) == 0) {
+      if (strcmp(words[2], LatencyModeStrings[i]) == 0) {
         mode = i;
       }
     }
-    cmd.latency_mode = (enum LatencyMode)mode;
-    cmd.auto_disconnect_time = auto_disconnect_time;
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.changeModeParameters(strtoul(words[1], 0, 10), mode, strtoul(words[3], 0, 10));
   }
   if (strcmp("getButtonInfo", words[0]) == 0) {
     assert(wordnum==2);
-    CmdGetButtonInfo cmd;
-    cmd.opcode = CMD_GET_BUTTON_INFO_OPCODE;
-    memcpy(cmd.bd_addr, read_bdaddr(words[1]).addr, 6);
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.getButtonInfo(words[1]);
   }
   if (strcmp("getInfo", words[0]) == 0) {
     assert(wordnum==1);
-    CmdGetInfo cmd;
-    cmd.opcode = CMD_GET_INFO_OPCODE;
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.getInfo();
   }
   if (strcmp("createBatteryStatusListener", words[0]) == 0) {
     assert(wordnum==3);
-    CmdCreateBatteryStatusListener cmd;
-    cmd.opcode = CMD_CREATE_BATTERY_STATUS_LISTENER_OPCODE;
-    memcpy(cmd.bd_addr, read_bdaddr(words[1]).addr, 6);
-    sscanf(words[2], "%u", &cmd.listener_id);
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.createBatteryStatusListener(words[1], strtoul(words[2], 0, 10));
   }
   if (strcmp("removeBatteryStatusListener", words[0]) == 0) {
     assert(wordnum==2);
-    CmdRemoveBatteryStatusListener cmd;
-    cmd.opcode = CMD_REMOVE_BATTERY_STATUS_LISTENER_OPCODE;
-    sscanf(words[1], "%u", &cmd.listener_id);
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.removeBatteryStatusListener(strtoul(words[1], 0, 10));
   }
   if (strcmp("delete", words[0]) == 0) {
     assert(wordnum==2);
-    CmdDeleteButton cmd;
-    cmd.opcode = CMD_DELETE_BUTTON_OPCODE;
-    memcpy(cmd.bd_addr, read_bdaddr(words[1]).addr, 6);
-    write_packet(sockfd, &cmd, sizeof(cmd));
+    batch.deleteButton(words[1]);
   }
+  batch.flush();
   if (strcmp("help", words[0]) == 0) {
     print_help();
   }
@@ -669,56 +1455,14 @@ int flicd_client_handle_line(int sockfd, const char *incmd) {
 int flicd_client_init(const char *host, int port) {
   fprintf(stderr,"host=%s len=%d port=%d\n",host,(int)strlen(host),port);
 
-  // check for valid host
-  //
-  struct hostent* server = gethostbyname(host);
-  if (server == NULL) {
-    fprintf(stderr, "ERROR: no such host: %s\n",host);
-    return -1;
-  }
-
-  // create socket and check for validity
-  //
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0) {
-    fprintf(stderr, "ERROR: failure creating socket\n");
-    perror("socket");
-    return sockfd;
-  }
-
-  // connect and check for valid connection
-  //
-  struct sockaddr_in serv_addr;
-  memset(&serv_addr, 0, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-  serv_addr.sin_port = htons(port);
-  
-  if (connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-    fprintf(stderr, "ERROR: failure connecting socket\n");
-    perror("connect");
-    close(sockfd);
-    return -1;
-  }
-
-  //
-  // Set up one minute timeout on flicd socket
-  //
-#ifdef __LINUX__
-  struct timeval tv;
-  tv.tv_sec=60;
-  tv.tv_usec=0;
-  if(setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))<0) 
-#else
-  DWORD to=60000;
-  if(setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&to, sizeof(to))<0) 
+#ifndef __LINUX__
+  InitializeCriticalSection(&theFlicdWriteLock);
 #endif
-  {
-    fprintf(stderr, "ERROR: setting recieve timeout on socket\n");
-    perror("setsockopt");
-    close(sockfd);
-    return -1;
-  }
+  theFlicdHost=strdup(host);
+  theFlicdPort=port;
+  int sockfd=flicd_client_connect(host, port);
+  if(sockfd<0) { return -1; }
+  theFlicdSock=sockfd;
 
   // Create reader thread and verify successful creation
   //
@@ -770,7 +1514,7 @@ int flicd_client_main(int argc, char* argv[]) {
       return 1;
     }
     fprintf(stderr,"stdin command: %s\n",incmd); 
-    ret=flicd_client_handle_line(sockfd, incmd);
+    ret=flicd_client_handle_line(incmd);
     if(ret) { 
       return 0; 
     }
@@ -8,15 +8,17 @@
 #ifndef _FLICD_CLIENTH
 #define _FLICD_CLIENTH
 
-#define FLIC_BUFSIZE      32
+#define FLIC_BUFSIZE      40
+#define FLIC_TRACE_OFF    36  // offset of the trace id
 
 /* PIPE packet format
- * 32 byte payloads
+ * 40 byte payloads
  * {
  *   char operation;
  *   char status;
- *   char button;
- *   char [29] str;     // Make sure to have a null in offset 28
+ *   unsigned char button[2];   // little endian slot (conn_id)
+ *   char [32] str;             // Make sure to have a null in offset 35
+ *   unsigned char trace[4];    // little endian TRACE_PIPE flow id, 0 when not tracing (see Trace.h)
  * }
  */
 
@@ -27,12 +29,37 @@
 #define FLIC_INFO_GENERAL 1   // getInfo response
 #define FLIC_CONNECT      2   // connect response
 #define FLIC_STATUS       3   // button status changes (online/offline)
-#define FLIC_UPDOWN       4   // down/up/hold message
+#define FLIC_UPDOWN       4   // down/up/hold message (str is the ClickType, then " queued N" if flicd held it N seconds)
+#define FLIC_LINK         5   // flicd socket lost/relinked/pinged (str carries reason, resync ms or rtt us)
+#define FLIC_RELOAD       6   // Flic2MQTT.config changed (from the config watcher, not flicd)
+#define FLIC_REMOVED      7   // flicd dropped a connection channel (status is the RemovedReason)
+#define FLIC_CONTROLLER   8   // bluetooth controller state changed (status is the state)
+#define FLIC_SPACE        9   // flicd ran out of / got back room for connections (str carries the max)
+#define FLIC_BATTERY      10  // battery report, button is the listener_id (slot), str is "percent timestamp"
+#define FLIC_META         11  // getButtonInfo for a slot finished (status is the FLICD_RESULT_xxx), see MetaCache.h
+#define FLIC_PRESENCE     12  // a presence snapshot is due, see Presence.h
+#define FLIC_STATS        13  // usage stats are due, see Stats.h
+#define FLIC_SHUTDOWN     14  // SIGINT/SIGTERM (or a console close on Windows): drain and stop
+#define FLIC_MQTT         15  // the broker connection came up (from paho's thread): republish
+#define FLIC_WATCHDOG     16  // a stage stalled or recovered (from the watchdog thread), see Watchdog.h
 static const char *FLIC_OPS[]={"FLIC_PING",
                         "FLIC_INFO_GENERAL",
                         "FLIC_CONNECT",
                         "FLIC_STATUS",
-                        "FLIC_UPDOWN"};
+                        "FLIC_UPDOWN",
+                        "FLIC_LINK",
+                        "FLIC_RELOAD",
+                        "FLIC_REMOVED",
+                        "FLIC_CONTROLLER",
+                        "FLIC_SPACE",
+                        "FLIC_BATTERY",
+                        "FLIC_META",
+                        "FLIC_PRESENCE",
+                        "FLIC_STATS",
+                        "FLIC_SHUTDOWN",
+                        "FLIC_MQTT",
+                        "FLIC_WATCHDOG"};
+#define FLIC_OP_COUNT ((int)(sizeof(FLIC_OPS)/sizeof(FLIC_OPS[0])))
 //
 // Status
 //
@@ -43,14 +70,109 @@ static const char *FLIC_OPS[]={"FLIC_PING",
 #define FLIC_STATUS_DOUBLECLICK 4
 #define FLIC_STATUS_HOLD        5
 #define FLIC_STATUS_FATAL       255
+#define FLIC_STATUS_LINK_DOWN   0
+#define FLIC_STATUS_LINK_UP     1
+#define FLIC_STATUS_LINK_RTT    2
+#define FLIC_STATUS_DISCONNECTED 0  // FLIC_CONNECT/FLIC_STATUS carry the ConnectionStatus
+#define FLIC_STATUS_CONNECTED   1
+#define FLIC_STATUS_READY       2
+#define FLIC_STATUS_CONN_FAILED 3   // create connection channel refused, str has the error
+static const char *FLIC_CONNECTION_NAMES[]={"Disconnected", "Connected", "Ready", "Failed"};
+#define FLIC_STATUS_DETACHED    0   // FLIC_CONTROLLER / FLIC_INFO_GENERAL carry the BluetoothControllerState
+#define FLIC_STATUS_RESETTING   1
+#define FLIC_STATUS_ATTACHED    2
+#define FLIC_STATUS_NO_SPACE    0   // FLIC_SPACE
+#define FLIC_STATUS_GOT_SPACE   1
 
 //
 // For button neutral messages
 //
-#define FLIC_BUTTON_ALL   255
+#define FLIC_BUTTON_ALL   65535
+
+#include <vector>
+
+//
+// Request/response correlation.  Commands that flicd answers can carry a callback which is
+// run on the flicd reader thread when the answer arrives, the timeout passes (0 = never)
+// or the link drops.  evt is the raw flicd event (0 unless FLICD_RESULT_OK/ERROR) and
+// latencyMs is the time since the command was queued.
+//
+#define FLICD_RESULT_OK       0
+#define FLICD_RESULT_TIMEOUT  1
+#define FLICD_RESULT_ERROR    2   // flicd refused, channel removed or request superseded
+#define FLICD_RESULT_LINKDOWN 3
+
+#define FLICD_REQ_GETINFO     1   // answered in order
+#define FLICD_REQ_CONNECT     2   // keyed by conn_id, completes when the channel is Ready
+#define FLICD_REQ_BUTTONINFO  3   // keyed by Bdaddr
+#define FLICD_REQ_BATTERY     4   // keyed by listener_id, completes on first battery report
+#define FLICD_REQ_PING        5   // keyed by ping_id
+
+typedef void (*FlicdCallback)(void *context, int result, const void *evt, int evtLen, unsigned long latencyMs);
+
+//
+// Pass &future with FlicdFuture::callback to poll or wait on a single result
+//
+class FlicdFuture {
+
+public:
+  bool volatile done;
+  int result;
+  unsigned long latencyMs;
+  unsigned char evt[256];       // copy of the answering event (truncated)
+  int len;
+
+  FlicdFuture();
+  bool ready();
+  bool wait(int ms);
+  static void callback(void *context, int result, const void *evt, int evtLen, unsigned long latencyMs);
+};
+
+//
+// Typed flicd commands.  Queue any number of them, then flush() writes the whole
+// batch to flicd with a single scatter-gather write.  MACs are "xx:xx:xx:xx:xx:xx".
+//
+class FlicdBatch {
+
+private:
+  std::vector<unsigned char*> chunks;   // framed packets, packed into fixed size chunks
+  int used;                             // bytes used in the last chunk
+  int packets;
+  int bytes;
+
+  void clear();
+
+public:
+  FlicdBatch();
+  ~FlicdBatch();
+  void getInfo(FlicdCallback cb=0, void *context=0, int timeoutMs=5000);
+  void createScanner(unsigned int scanId);
+  void removeScanner(unsigned int scanId);
+  void connect(const char *mac, unsigned int connId, int latencyMode=0, int autoDisconnectTime=0x1ff, FlicdCallback cb=0, void *context=0, int timeoutMs=0);
+  void disconnect(unsigned int connId);
+  void forceDisconnect(const char *mac);
+  void changeModeParameters(unsigned int connId, int latencyMode, int autoDisconnectTime);
+  void ping(unsigned int pingId, FlicdCallback cb=0, void *context=0, int timeoutMs=5000);
+  void getButtonInfo(const char *mac, FlicdCallback cb=0, void *context=0, int timeoutMs=5000);
+  void createScanWizard(unsigned int scanWizardId);
+  void cancelScanWizard(unsigned int scanWizardId);
+  void deleteButton(const char *mac);
+  void createBatteryStatusListener(const char *mac, unsigned int listenerId, FlicdCallback cb=0, void *context=0, int timeoutMs=0);
+  void removeBatteryStatusListener(unsigned int listenerId);
+  int count();
+  int flush();
+
+  // low level: queue one already built protocol packet / write to an explicit socket
+  void append(const void *pkt, int len);
+  int writeTo(int fd);
+};
 
 extern int flicd_client_main(int argc, char *argv[]);
 extern int flicd_client_init(const char *server, int port);
-extern int flicd_client_handle_line(int sockfd, const char *incmd);
+extern int flicd_client_handle_line(const char *incmd);
+extern void flicd_client_set_ping(int intervalSec, int misses);
+extern int flicd_client_rtt_format(char *buf, int sz);
+extern void flicd_client_pipe_send(char operation, char status, unsigned int button, const char *str);
+extern int flicd_client_decode_stream(const unsigned char *data, int len, int *badRun);
 
 #endif
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+/*
+ * Table driven decoder for flicd events.
+ *
+ * Each event is described once, as a list of fields in wire order.  Every field names
+ * the member of the (packed) protocol struct it lands in.  The wire size of the event
+ * is derived from that list at compile time and checked against sizeof() of the struct.
+ * So the description and the struct cannot drift apart.
+ *
+ * Decoding copies field by field out of the little endian wire buffer into a properly
+ * typed host order struct.  Nothing aliases the receive buffer and the result is the
+ * same on any endianness.  Packet length, enum ranges and string lengths are all
+ * checked before a handler ever sees the event.
+ *
+ * Commands are still written with the packed structs, so sending stays little endian only.
+ */
+
+#ifndef _FLICD_CLIENT_DECODERH
+#define _FLICD_CLIENT_DECODERH
+
+#include <stddef.h>
+#include <string.h>
+#include "flicd_client_protocol_packets.h"
+
+namespace FlicClientProtocol {
+
+#define F_U8    0    // unsigned/signed 8 bit scalar
+#define F_U16   1    // 16 bit little endian scalar
+#define F_U32   2    // 32 bit little endian scalar
+#define F_U64   3    // 64 bit little endian scalar
+#define F_BYTES 4    // raw bytes (bd_addr, uuid, string payload)
+#define F_ENUM  5    // 8 bit enum; limit is the number of valid values
+#define F_LEN   6    // 8 bit length of the F_BYTES field that follows; limit is its capacity
+
+struct FieldDesc {
+  unsigned char kind;
+  unsigned char size;       // bytes on the wire (and in the struct)
+  unsigned short offset;    // where the member lives in the decoded struct
+  unsigned char limit;
+};
+
+#define FIELD(kind, type, member, limit) { kind, (unsigned char)sizeof(((type*)0)->member), (unsigned short)offsetof(type, member), limit }
+
+template<size_t N> constexpr int wireSize(const FieldDesc (&f)[N]) {
+  int n=0;
+  for(size_t i=0;i<N;i++) { n+=f[i].size; }
+  return n;
+}
+
+// wire offset of field i (sum of the sizes before it)
+constexpr int fieldWireOffset(const FieldDesc *f, int i) {
+  return i==0 ? 0 : f[i-1].size+fieldWireOffset(f, i-1);
+}
+
+//
+// Per event decoders are a handful of instructions; inlining them is what makes the
+// button event path as cheap as the pointer casts it replaced (bench/bench_decoder.cpp).
+//
+#ifdef __GNUC__
+#define DECODE_INLINE __attribute__((always_inline)) inline
+#define DECODE_UNLIKELY(x) __builtin_expect(!!(x),0)
+#else
+#define DECODE_INLINE __forceinline
+#define DECODE_UNLIKELY(x) (x)
+#endif
+
+#define CHECK_WIRE(type, fields) static_assert(wireSize(fields)==sizeof(type), #fields " does not describe " #type)
+
+// number of values the F_ENUM field at offset may take (256 if there is no such enum)
+template<size_t N> constexpr int enumLimit(const FieldDesc (&f)[N], size_t offset) {
+  for(size_t i=0;i<N;i++) {
+    if(f[i].kind==F_ENUM && f[i].offset==offset) { return f[i].limit; }
+  }
+  return 256;
+}
+
+//
+// Check a name table covers every value the decoder lets through for type.member,
+// so indexing it with a decoded enum can never run off the end.
+//
+#define CHECK_STRINGS(strings, type, fields, member) \
+  static_assert(sizeof(strings)/sizeof(strings[0])>=(size_t)enumLimit(fields, offsetof(type, member)), #strings " does not cover " #type "." #member)
+
+//
+// Field lists, one per event layout
+//
+static constexpr FieldDesc EvtAdvertisementPacketFields[]={
+  FIELD(F_U8,    EvtAdvertisementPacket, opcode, 0),
+  FIELD(F_U32,   EvtAdvertisementPacket, scan_id, 0),
+  FIELD(F_BYTES, EvtAdvertisementPacket, bd_addr, 0),
+  FIELD(F_LEN,   EvtAdvertisementPacket, name_length, 16),
+  FIELD(F_BYTES, EvtAdvertisementPacket, name, 0),
+  FIELD(F_U8,    EvtAdvertisementPacket, rssi, 0),
+  FIELD(F_U8,    EvtAdvertisementPacket, is_private, 0),
+  FIELD(F_U8,    EvtAdvertisementPacket, already_verified, 0),
+  FIELD(F_U8,    EvtAdvertisementPacket, already_connected_to_this_device, 0),
+  FIELD(F_U8,    EvtAdvertisementPacket, already_connected_to_other_device, 0)
+};
+CHECK_WIRE(EvtAdvertisementPacket, EvtAdvertisementPacketFields);
+
+static constexpr FieldDesc EvtCreateConnectionChannelResponseFields[]={
+  FIELD(F_U8,    EvtCreateConnectionChannelResponse, base.opcode, 0),
+  FIELD(F_U32,   EvtCreateConnectionChannelResponse, base.conn_id, 0),
+  FIELD(F_ENUM,  EvtCreateConnectionChannelResponse, error, 2),
+  FIELD(F_ENUM,  EvtCreateConnectionChannelResponse, connection_status, 3)
+};
+CHECK_WIRE(EvtCreateConnectionChannelResponse, EvtCreateConnectionChannelResponseFields);
+
+static constexpr FieldDesc EvtConnectionStatusChangedFields[]={
+  FIELD(F_U8,    EvtConnectionStatusChanged, base.opcode, 0),
+  FIELD(F_U32,   EvtConnectionStatusChanged, base.conn_id, 0),
+  FIELD(F_ENUM,  EvtConnectionStatusChanged, connection_status, 3),
+  FIELD(F_ENUM,  EvtConnectionStatusChanged, disconnect_reason, 4)
+};
+CHECK_WIRE(EvtConnectionStatusChanged, EvtConnectionStatusChangedFields);
+
+static constexpr FieldDesc EvtConnectionChannelRemovedFields[]={
+  FIELD(F_U8,    EvtConnectionChannelRemoved, base.opcode, 0),
+  FIELD(F_U32,   EvtConnectionChannelRemoved, base.conn_id, 0),
+  FIELD(F_ENUM,  EvtConnectionChannelRemoved, removed_reason, 12)
+};
+CHECK_WIRE(EvtConnectionChannelRemoved, EvtConnectionChannelRemovedFields);
+
+static constexpr FieldDesc EvtButtonEventFields[]={
+  FIELD(F_U8,    EvtButtonEvent, base.opcode, 0),
+  FIELD(F_U32,   EvtButtonEvent, base.conn_id, 0),
+  FIELD(F_ENUM,  EvtButtonEvent, click_type, 6),
+  FIELD(F_U8,    EvtButtonEvent, was_queued, 0),
+  FIELD(F_U32,   EvtButtonEvent, time_diff, 0)
+};
+CHECK_WIRE(EvtButtonEvent, EvtButtonEventFields);
+
+static constexpr FieldDesc EvtNewVerifiedButtonFields[]={
+  FIELD(F_U8,    EvtNewVerifiedButton, opcode, 0),
+  FIELD(F_BYTES, EvtNewVerifiedButton, bd_addr, 0)
+};
+CHECK_WIRE(EvtNewVerifiedButton, EvtNewVerifiedButtonFields);
+
+// followed on the wire by nb_verified_buttons 6 byte addresses (see EVENT_TAIL)
+static constexpr FieldDesc EvtGetInfoResponseFields[]={
+  FIELD(F_U8,    EvtGetInfoResponse, opcode, 0),
+  FIELD(F_ENUM,  EvtGetInfoResponse, bluetooth_controller_state, 3),
+  FIELD(F_BYTES, EvtGetInfoResponse, my_bd_addr, 0),
+  FIELD(F_ENUM,  EvtGetInfoResponse, my_bd_addr_type, 2),
+  FIELD(F_U8,    EvtGetInfoResponse, max_pending_connections, 0),
+  FIELD(F_U16,   EvtGetInfoResponse, max_concurrently_connected_buttons, 0),
+  FIELD(F_U8,    EvtGetInfoResponse, current_pending_connections, 0),
+  FIELD(F_U8,    EvtGetInfoResponse, currently_no_space_for_new_connection, 0),
+  FIELD(F_U16,   EvtGetInfoResponse, nb_verified_buttons, 0)
+};
+CHECK_WIRE(EvtGetInfoResponse, EvtGetInfoResponseFields);
+
+static constexpr FieldDesc EvtNoSpaceForNewConnectionFields[]={
+  FIELD(F_U8,    EvtNoSpaceForNewConnection, opcode, 0),
+  FIELD(F_U8,    EvtNoSpaceForNewConnection, max_concurrently_connected_buttons, 0)
+};
+CHECK_WIRE(EvtNoSpaceForNewConnection, EvtNoSpaceForNewConnectionFields);
+
+static constexpr FieldDesc EvtGotSpaceForNewConnectionFields[]={
+  FIELD(F_U8,    EvtGotSpaceForNewConnection, opcode, 0),
+  FIELD(F_U8,    EvtGotSpaceForNewConnection, max_concurrently_connected_buttons, 0)
+};
+CHECK_WIRE(EvtGotSpaceForNewConnection, EvtGotSpaceForNewConnectionFields);
+
+static constexpr FieldDesc EvtBluetoothControllerStateChangeFields[]={
+  FIELD(F_U8,    EvtBluetoothControllerStateChange, opcode, 0),
+  FIELD(F_ENUM,  EvtBluetoothControllerStateChange, state, 3)
+};
+CHECK_WIRE(EvtBluetoothControllerStateChange, EvtBluetoothControllerStateChangeFields);
+
+static constexpr FieldDesc EvtPingResponseFields[]={
+  FIELD(F_U8,    EvtPingResponse, opcode, 0),
+  FIELD(F_U32,   EvtPingResponse, ping_id, 0)
+};
+CHECK_WIRE(EvtPingResponse, EvtPingResponseFields);
+
+static constexpr FieldDesc EvtGetButtonInfoResponseFields[]={
+  FIELD(F_U8,    EvtGetButtonInfoResponse, opcode, 0),
+  FIELD(F_BYTES, EvtGetButtonInfoResponse, bd_addr, 0),
+  FIELD(F_BYTES, EvtGetButtonInfoResponse, uuid, 0),
+  FIELD(F_LEN,   EvtGetButtonInfoResponse, color_length, 16),
+  FIELD(F_BYTES, EvtGetButtonInfoResponse, color, 0),
+  FIELD(F_LEN,   EvtGetButtonInfoResponse, serial_number_length, 16),
+  FIELD(F_BYTES, EvtGetButtonInfoResponse, serial_number, 0),
+  FIELD(F_U8,    EvtGetButtonInfoResponse, flic_version, 0),
+  FIELD(F_U32,   EvtGetButtonInfoResponse, firmware_version, 0)
+};
+CHECK_WIRE(EvtGetButtonInfoResponse, EvtGetButtonInfoResponseFields);
+
+static constexpr FieldDesc EvtScanWizardBaseFields[]={
+  FIELD(F_U8,    EvtScanWizardBase, opcode, 0),
+  FIELD(F_U32,   EvtScanWizardBase, scan_wizard_id, 0)
+};
+CHECK_WIRE(EvtScanWizardBase, EvtScanWizardBaseFields);
+
+static constexpr FieldDesc EvtScanWizardFoundPublicButtonFields[]={
+  FIELD(F_U8,    EvtScanWizardFoundPublicButton, base.opcode, 0),
+  FIELD(F_U32,   EvtScanWizardFoundPublicButton, base.scan_wizard_id, 0),
+  FIELD(F_BYTES, EvtScanWizardFoundPublicButton, bd_addr, 0),
+  FIELD(F_LEN,   EvtScanWizardFoundPublicButton, name_length, 16),
+  FIELD(F_BYTES, EvtScanWizardFoundPublicButton, name, 0)
+};
+CHECK_WIRE(EvtScanWizardFoundPublicButton, EvtScanWizardFoundPublicButtonFields);
+
+static constexpr FieldDesc EvtScanWizardCompletedFields[]={
+  FIELD(F_U8,    EvtScanWizardCompleted, base.opcode, 0),
+  FIELD(F_U32,   EvtScanWizardCompleted, base.scan_wizard_id, 0),
+  FIELD(F_ENUM,  EvtScanWizardCompleted, result, 9)
+};
+CHECK_WIRE(EvtScanWizardCompleted, EvtScanWizardCompletedFields);
+
+static constexpr FieldDesc EvtButtonDeletedFields[]={
+  FIELD(F_U8,    EvtButtonDeleted, opcode, 0),
+  FIELD(F_BYTES, EvtButtonDeleted, bd_addr, 0),
+  FIELD(F_U8,    EvtButtonDeleted, deleted_by_this_client, 0)
+};
+CHECK_WIRE(EvtButtonDeleted, EvtButtonDeletedFields);
+
+static constexpr FieldDesc EvtBatteryStatusFields[]={
+  FIELD(F_U8,    EvtBatteryStatus, opcode, 0),
+  FIELD(F_U32,   EvtBatteryStatus, listener_id, 0),
+  FIELD(F_U8,    EvtBatteryStatus, battery_percentage, 0),
+  FIELD(F_U64,   EvtBatteryStatus, timestamp, 0)
+};
+CHECK_WIRE(EvtBatteryStatus, EvtBatteryStatusFields);
+
+#define DECODE_OK          0
+#define DECODE_SHORT       1   // packet shorter than the event description
+#define DECODE_BAD_ENUM    2   // enum value out of range
+#define DECODE_BAD_LENGTH  3   // string length larger than its buffer
+#define DECODE_BAD_OPCODE  4   // no such event
+#define DECODE_BAD_TAIL    5   // variable tail runs past the packet
+
+static const char *DECODE_ERRORS[]={"OK", "SHORT", "BAD_ENUM", "BAD_LENGTH", "BAD_OPCODE", "BAD_TAIL"};
+
+//
+// Copy field I..N-1 of one event out of the little endian wire buffer into dst.
+// F[I] is a constant expression, so each instantiation folds down to the few loads,
+// shifts and stores for that one field and the recursion unrolls the whole event.
+//
+template<const FieldDesc *F, int I, int N> struct FieldDecoder {
+  static inline int decode(const uint8_t *wire, uint8_t *dst) {
+    const uint8_t *w=wire+fieldWireOffset(F, I);
+    uint8_t *d=dst+F[I].offset;
+    switch(F[I].kind) {
+      case F_BYTES:
+        memcpy(d, w, F[I].size);
+        break;
+      case F_ENUM:
+        if(w[0]>=F[I].limit) { return DECODE_BAD_ENUM; }
+        d[0]=w[0];
+        break;
+      case F_LEN:
+        if(w[0]>F[I].limit) { return DECODE_BAD_LENGTH; }
+        d[0]=w[0];
+        break;
+      case F_U8:
+        d[0]=w[0];
+        break;
+      case F_U16: {
+        uint16_t x=(uint16_t)(w[0] | (w[1]<<8));
+        memcpy(d, &x, 2);
+        break;
+      }
+      case F_U32: {
+        uint32_t x=(uint32_t)w[0] | ((uint32_t)w[1]<<8) | ((uint32_t)w[2]<<16) | ((uint32_t)w[3]<<24);
+        memcpy(d, &x, 4);
+        break;
+      }
+      case F_U64: {
+        uint64_t x=0;
+        for(int b=7;b>=0;b--) { x=(x<<8)|w[b]; }
+        memcpy(d, &x, 8);
+        break;
+      }
+    }
+    return FieldDecoder<F, I+1, N>::decode(wire, dst);
+  }
+};
+
+template<const FieldDesc *F, int N> struct FieldDecoder<F, N, N> {
+  static inline int decode(const uint8_t *wire, uint8_t *dst) { return DECODE_OK; }
+};
+
+//
+// One dispatch table entry per opcode, generated from the event's field list.
+// The handler gets the decoded event plus, for events with a variable tail, a pointer
+// to the raw tail and its element count (read from the U16 member at COUNTOFF).
+//
+typedef int (*EventDecoder)(const uint8_t *pkt, int len);
+
+template<typename T, const FieldDesc *F, int N, int TAIL, int COUNTOFF, void (*H)(const T &evt, const uint8_t *tail, int tailCount)>
+static DECODE_INLINE int decodeAndDispatch(const uint8_t *pkt, int len) {
+  union {
+    T evt;
+    uint8_t bytes[sizeof(T)];
+  } u;
+  if(DECODE_UNLIKELY(len<(int)sizeof(T))) { return DECODE_SHORT; }
+  int ret=FieldDecoder<F, 0, N>::decode(pkt, u.bytes);
+  if(ret!=DECODE_OK) { return ret; }
+  const uint8_t *tail=0;
+  int tailCount=0;
+  if(TAIL) {
+    uint16_t cnt;
+    memcpy(&cnt, &u.bytes[COUNTOFF], 2);
+    if((int)sizeof(T)+(int)cnt*TAIL>len) { return DECODE_BAD_TAIL; }
+    tail=pkt+sizeof(T);
+    tailCount=cnt;
+  }
+  H(u.evt, tail, tailCount);
+  return DECODE_OK;
+}
+
+#define FIELD_COUNT(fields) ((int)(sizeof(fields)/sizeof(FieldDesc)))
+#define EVENT(type, fields, handler) \
+  decodeAndDispatch<type, fields, FIELD_COUNT(fields), 0, 0, handler>
+#define EVENT_TAIL(type, fields, elem, count, handler) \
+  decodeAndDispatch<type, fields, FIELD_COUNT(fields), elem, (int)offsetof(type, count), handler>
+
+//
+// Decode and dispatch one packet through table (indexed by opcode, ntable entries).
+// Returns DECODE_xxx.
+//
+static inline int decodeEvent(const EventDecoder *table, int ntable, const uint8_t *pkt, int len) {
+  if(len<1 || pkt[0]>=ntable) { return DECODE_BAD_OPCODE; }
+  return table[pkt[0]](pkt, len);
+}
+
+//
+// decodeEvent with opcodes LO..HI, the button events that are nearly all of the traffic,
+// handed straight to HOT so it inlines here instead of going through the table.
+//
+template<int LO, int HI, EventDecoder HOT>
+static inline int decodeEventHot(const EventDecoder *table, int ntable, const uint8_t *pkt, int len) {
+  if(len>=1 && (unsigned)(pkt[0]-LO)<=(unsigned)(HI-LO)) { return HOT(pkt, len); }
+  return decodeEvent(table, ntable, pkt, len);
+}
+
+}
+
+#endif
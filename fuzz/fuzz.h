@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef _FUZZH
+#define _FUZZH
+
+//
+// Shared setup for the libFuzzer targets in this directory (make fuzz).  The event
+// handlers run as they do under -mqtt, with the pipe to the main thread going to
+// /dev/null and logging off so a rejected packet costs what it costs in production.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include "../flicd_client.h"
+#include "../Log.h"
+
+int thePipeW=0;                 // Flic2MQTT.cpp's, for the handlers
+
+static bool fuzzInit() {
+  thePipeW=open("/dev/null", O_WRONLY);
+  if(thePipeW<=0) { abort(); }
+  for(int i=0;i<LOG_SUBSYSTEMS;i++) { logSetLevel(i, -1); }
+  return true;
+}
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// One event decoder: built once per opcode with -DFUZZ_OPCODE=n (fuzz/fuzz_event_n).  The
+// input is one packet whose opcode byte is forced to FUZZ_OPCODE, framed and handed to
+// flicd_client_decode_stream(), so every mutation lands in that event's field table,
+// range checks and handler.  Seeds are single packets (fuzz/corpus/packet).
+//
+
+#ifndef FUZZ_OPCODE
+#error build with -DFUZZ_OPCODE=n, one target per flicd event opcode
+#endif
+
+#include <string.h>
+#include "fuzz.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static bool init=fuzzInit();
+  if(size<1 || size>65535) { return 0; }
+  //
+  // exactly sized so ASan sees any read past the packet
+  //
+  uint8_t *frame=(uint8_t*)malloc(size+2);
+  frame[0]=size & 0xff;
+  frame[1]=size >> 8;
+  memcpy(frame+2, data, size);
+  frame[2]=FUZZ_OPCODE;
+  int used=flicd_client_decode_stream(frame, (int)size+2, 0);
+  free(frame);
+  if(used!=(int)size+2) { abort(); }
+  return 0;
+}
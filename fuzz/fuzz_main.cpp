@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// Stand in for libFuzzer's main where there is none (make fuzz-replay with g++): feed
+// each file named, or every file in each directory named, to LLVMFuzzerTestOneInput once.
+// Reproduces a crash file, and keeps the seed corpus passing under the sanitizers.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <dirent.h>
+#include <sys/stat.h>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int fuzz_file(const char *path) {
+  FILE *f=fopen(path, "rb");
+  if(!f) {
+    fprintf(stderr, "fuzz: can not read %s\n", path);
+    return -1;
+  }
+  std::string buf;
+  char chunk[4096];
+  size_t n;
+  while((n=fread(chunk, 1, sizeof(chunk), f))>0) { buf.append(chunk, n); }
+  fclose(f);
+  //
+  // a copy of exactly the file's size, as libFuzzer does, so overreads are caught
+  //
+  uint8_t *data=(uint8_t*)malloc(buf.size() ? buf.size() : 1);
+  memcpy(data, buf.data(), buf.size());
+  LLVMFuzzerTestOneInput(data, buf.size());
+  free(data);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int files=0, bad=0;
+  for(int i=1;i<argc;i++) {
+    struct stat st;
+    if(stat(argv[i], &st)) {
+      fprintf(stderr, "fuzz: no such file %s\n", argv[i]);
+      bad++;
+      continue;
+    }
+    if(!S_ISDIR(st.st_mode)) {
+      bad+=fuzz_file(argv[i])<0;
+      files++;
+      continue;
+    }
+    DIR *d=opendir(argv[i]);
+    struct dirent *e;
+    while(d && (e=readdir(d))) {
+      if(e->d_name[0]=='.') { continue; }
+      std::string path=std::string(argv[i])+"/"+e->d_name;
+      bad+=fuzz_file(path.c_str())<0;
+      files++;
+    }
+    if(d) { closedir(d); }
+  }
+  fprintf(stderr, "%s: %d inputs ok\n", argv[0], files-bad);
+  return bad ? 1 : 0;
+}
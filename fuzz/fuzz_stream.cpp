@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2024, Chris Elford
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+//
+// The flicd framing: any bytes, as they might arrive from the socket, through
+// flicd_client_decode_stream().  Seeds are captures of whole conversations (fuzz/corpus/stream).
+//
+
+#include "fuzz.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static bool init=fuzzInit();
+  if(size>(1<<20)) { return 0; }
+  int badRun=0;
+  int used=flicd_client_decode_stream(data, (int)size, &badRun);
+  //
+  // it may only ever leave a trailing partial frame behind
+  //
+  if(used<0 || used>(int)size) { abort(); }
+  if((int)size-used>=2 && (int)size-used-2>=(data[used] | (data[used+1]<<8))) { abort(); }
+  return 0;
+}
@@ -8,11 +8,11 @@
 #ifndef GLOBALH
 #define GLOBALH 1
 
-//Define this to get some extra debugging prints
 //
-//#define DEBUG_PRINT_CONFIG    1
-#define DEBUG_PRINT_MQTT      1
-#define DEBUG_PRINT_MAIN      1
+// Debug printing is controlled at runtime per subsystem (see Log.h).  Set
+// LOG_LEVEL_MAIN/MQTT/FLICD/CONFIG= in Flic2MQTT.config, or send SIGUSR1 to turn
+// everything up to DEBUG and SIGUSR2 to go back to the configured levels.
+//
 
 #endif
 